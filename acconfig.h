@@ -329,12 +329,18 @@
 /* Define this to use poll() */
 #undef USE_POLL
 
+/* Define this to use epoll() */
+#undef USE_EPOLL
+
 /* Define this to use kqueue() */
 #undef USE_FREEBSD_KQUEUE
 
 /* Define this to use pthreads */
 #undef USE_PTHREAD
 
+/* Define this to do dns lookups in threads instead of child processes */
+#undef USE_THREADED_DNS
+
 /* Define this if you have arc4random() */
 #undef HAVE_ARC4RANDOM
 
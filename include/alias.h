@@ -122,6 +122,12 @@
 
 /* These are in expr.c */
 	ssize_t next_statement (const char *string);
+	ssize_t next_balanced_statement (const char *string);
+	int	expands_to_itself (const char *str);
+
+/* These are in expr2.c */
+	char *	expr_cache_stats (void);
+	void	expr_cache_flush (void);
 
 /*
  * This function is a general purpose interface to alias expansion.
@@ -29,6 +29,11 @@ extern	int	need_defered_commands;
         void    call_user_command       (Char *, Char *, char *, void *);
 	void	runcmds			(Char *, Char *);
         void    runcmds_with_arglist    (Char *, char *, const char *);
+	void *	get_compiled_block	(Char *);
+	void	release_compiled_block	(void *);
+	void	forget_compiled_block	(Char *);
+        char *  call_compiled_function  (Char *, void *, char *, void *);
+        void    call_compiled_command   (Char *, void *, char *, void *);
 
 	int     parse_statement 	(const char *, int, const char *);
 
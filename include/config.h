@@ -267,12 +267,14 @@
 #define DEFAULT_ALLOW_C1_CHARS 0
 #define DEFAULT_ALT_CHARSET 1
 #define DEFAULT_ALWAYS_SPLIT_BIGGEST 1
+#define DEFAULT_APPROXIMATE_CHANNEL_SIZE 0
 #define DEFAULT_BANNER "***"
 #define DEFAULT_BANNER_EXPAND 0
 #define DEFAULT_BEEP 1
 #define DEFAULT_BEEP_MAX 3
 #define DEFAULT_BLINK_VIDEO 1
 #define	DEFAULT_BOLD_VIDEO 1
+#define DEFAULT_CAPABILITIES NULL
 #define DEFAULT_CHANNEL_NAME_WIDTH 0
 #define DEFAULT_CLOCK 1
 #define DEFAULT_CLOCK_24HOUR 0
@@ -350,6 +352,7 @@
 #define DEFAULT_SCROLLBACK 256
 #define DEFAULT_SCROLLBACK_RATIO 50
 #define DEFAULT_SCROLL_LINES 1
+#define DEFAULT_SERVER_BATCH_SIZE 100
 #define DEFAULT_SHELL "/bin/sh"
 #define DEFAULT_SHELL_FLAGS "-c"
 #define DEFAULT_SHELL_LIMIT 0
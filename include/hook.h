@@ -98,6 +98,7 @@ enum HOOK_TYPES {
 	SWITCH_WINDOWS_LIST,
 	TIMER_LIST,
 	TOPIC_LIST,
+	TWITCH_LIST,
 	UNKNOWN_COMMAND_LIST,
 	UNKNOWN_SET_LIST,
 	UNLOAD_LIST,
@@ -120,9 +121,11 @@ enum HOOK_TYPES {
 
 	BUILT_IN_COMMAND(oncmd);
 	BUILT_IN_COMMAND(shookcmd);
+	BUILT_IN_COMMAND(hookstatscmd);
 
 	int	do_hook 		(int, const char *, ...) __A(2);
 	int	do_hook_with_result	(int, char **, const char *, ...) __A(3);
+	int	hook_is_listened	(int);
 	char *	hookctl			(char *);
 	void	flush_on_hooks 		(void);
 	void	unload_on_hooks		(char *);
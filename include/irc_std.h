@@ -56,6 +56,7 @@
  * Everybody needs these INET headers...
  */
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #ifdef HAVE_NETDB_H
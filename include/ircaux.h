@@ -199,6 +199,10 @@ char *	malloc_strcat_wordlist_c (char **, const char *, const char *,size_t *);
 char *	malloc_strcat_word_c    (char **, const char *, const char *, int, size_t *);
 char *	malloc_sprintf 		(char **, const char *, ...) __A(2);
 char *  malloc_vsprintf		(char **ptr, const char *format, va_list args);
+char *	intern_string		(const char *);
+void	release_string		(char **);
+char *	intern_strcpy		(char **, const char *);
+char *	intern_stats		(void);
 
 
 #define malloc_strcpy(x,y) malloc_strcpy_c((x),(y),NULL)
@@ -12,6 +12,7 @@
 	void	remove_channel		(Char *, int);
 	void	add_to_channel		(Char *, Char *, int, int, int, int, int);
 	void	add_userhost_to_channel	(Char *, Char *, int, Char *);
+	void	channel_saw_speaker	(Char *, Char *, int, Char *);
 	void	remove_from_channel	(Char *, Char *, int);
 	void	rename_nick		(Char *, Char *, int);
 	Char *	check_channel_type	(Char *);
@@ -26,6 +27,8 @@
 	char *	create_nochops_list	(Char *, int);
 	int     chanmodetype		(char);
 	int	channel_is_syncing	(Char *, int);
+	int	channel_is_approximate	(Char *, int);
+	void	channel_names_done	(Char *, int);
 	void	channel_not_waiting	(Char *, int); 
 	void	update_channel_mode	(Char *, Char *);
 	Char *	get_channel_key		(Char *, int);
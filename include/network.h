@@ -65,6 +65,8 @@ void	my_freeaddrinfo		(AI *);
 pid_t	async_getaddrinfo	(const char *, const char *, const AI *, int);
 void	marshall_getaddrinfo	(int, AI *results);
 void	unmarshall_getaddrinfo	(AI *results);
+void	dns_cache_store		(const char *, const char *, int, const void *, ssize_t);
+void	dns_cache_forget	(const char *, const char *, int);
 int	set_non_blocking	(int);
 int	set_blocking		(int);
 
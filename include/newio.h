@@ -77,6 +77,7 @@
 
 	int	dgets_buffer		(int, void *, ssize_t);
 	ssize_t	dgets 			(int, char *, size_t, int);
+	ssize_t	dgets_lines		(int, char *, size_t, size_t, char **, int);
 	int	do_wait			(struct timeval *);
 	void	do_filedesc		(void);
 	void	init_newio		(void);
@@ -86,6 +87,7 @@
 
 	int	new_open		(int, void (*) (int), int, int, int);
 	int     new_open_failure_callback (int vfd, void (*) (int, int));
+	int	new_wait_writable	(int, void (*) (int));
 	int	new_hold_fd		(int);
 	int	new_unhold_fd		(int);
 	int 	new_close_with_option	(int, int);
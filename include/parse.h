@@ -18,6 +18,7 @@ extern 	protocol_command rfc1459[];
 extern	int		 num_protocol_cmds;
 
 #define PROTO_QUOTEBAD 	(1 << 0)
+#define PROTO_NOARGS	(1 << 1)	/* Command may have no arguments */
 
 
 	void    rfc1459_odd 	(const char *, const char *, const char **);
@@ -25,6 +26,8 @@ const 	char	*PasteArgs 	(const char **, int);
 	void	parse_server 	(const char *, size_t);
 	int	is_channel	(const char *);
 	void    rfc1459_any_to_utf8 (char *, size_t, char **);
+const	char *	get_message_tags (void);
+	char *	get_message_tag	(const char *);
 
 extern	const char	*FromUserHost;
 
@@ -31,6 +31,41 @@ typedef struct WaitCmdstru
         struct  WaitCmdstru *next;
 } WaitCmd;
 
+/*
+ * Lines waiting to be written to the server, in the order they were sent.
+ * Each line is charged against the server's token buckets (see below)
+ * just before it is written.
+ */
+typedef struct SendQueueItem
+{
+	char *	line;			/* The line, with its CR/LF */
+	size_t	len;			/* strlen(line) */
+	int	exempt;			/* Not subject to rate limiting */
+	int	joins;			/* How many channels it JOINs */
+	char *	channel;		/* Channel it talks to, if any */
+	int	charged;		/* Tokens have been taken for it */
+	struct SendQueueItem *next;
+} SendQueueItem;
+
+/*
+ * A token bucket allows "capacity" lines every "period" seconds, with
+ * the tokens refilling continuously.  A capacity of 0 means unlimited.
+ */
+typedef struct TokenBucket
+{
+	int	capacity;
+	double	period;
+	double	tokens;
+	Timeval	last;
+} TokenBucket;
+
+typedef struct ChannelBucket
+{
+	char *		channel;	/* Must be first (see alist.h) */
+	u_32int_t	hash;		/* Must be second */
+	TokenBucket	bucket;
+} ChannelBucket;
+
 typedef struct ServerInfo 
 {
 	int	clean;
@@ -138,6 +173,28 @@ const	AI	*next_addr;		/* The next one to try upon failure */
 
 	char *		ssl_certificate;
 	char *		ssl_certificate_hash;
+	int		ssl_resume_hits;	/* SSL connects that resumed */
+	int		ssl_resume_misses;	/* SSL connects that didn't */
+
+	SendQueueItem *	sendq_head;	/* Outbound lines not yet written */
+	SendQueueItem *	sendq_tail;
+	int		sendq_depth;	/* How many lines are queued */
+	size_t		sendq_bytes;	/* How many bytes are queued */
+	size_t		sendq_offset;	/* Bytes of sendq_head already sent */
+	char *		sendq_pending;	/* An ssl batch that must be retried */
+	size_t		sendq_pending_len;
+	size_t		sendq_pending_offset; /* Bytes of it already sent */
+	int		sendq_held;	/* Don't write yet (see register_server) */
+	TokenBucket	send_bucket;	/* All rate limited lines */
+	TokenBucket	join_bucket;	/* JOINs, per channel joined */
+	TokenBucket	chan_bucket;	/* Template for each channel */
+	array		chan_buckets;	/* PRIVMSG/NOTICE, per channel */
+	double		throttled;	/* Seconds spent waiting for tokens */
+	Timeval		throttled_since; /* When the current wait started */
+
+	char *		caps_available;	/* What the server said in CAP LS */
+	char *		caps;		/* What the server said in CAP ACK */
+	int		caps_listing;	/* A multi-line CAP LS is coming in */
 }	Server;
 extern	Server	**server_list;
 
@@ -234,6 +291,14 @@ extern	const char *server_states[13];
 	void	send_to_server_with_payload	(const char *, const char *, ...) __A(2);
 	void	send_to_aserver_with_payload	(int, const char *, const char *, ...) __A(3);
 	void	send_to_aserver_raw		(int, size_t len, const char *buffer);
+	void	flush_server_sendq		(int);
+	void	clear_server_sendq		(int);
+	void	server_caps_listed		(int, const char *, int);
+	void	server_caps_new			(int, const char *);
+	void	server_caps_acked		(int, const char *);
+	void	server_caps_deleted		(int, const char *);
+	void	server_caps_nakked		(int, const char *);
+	int	server_has_cap			(int, const char *);
 	int	grab_server_address		(int);
 	int	connect_to_server		(int);
 	int	close_all_servers		(const char *);
@@ -19,9 +19,11 @@ extern
 
 int	ALLOW_C1_CHARS_VAR,
 	ALWAYS_SPLIT_BIGGEST_VAR,
+	APPROXIMATE_CHANNEL_SIZE_VAR,
 	BANNER_VAR,
 	BANNER_EXPAND_VAR,
 	BEEP_VAR,
+	CAPABILITIES_VAR,
 	CHANNEL_NAME_WIDTH_VAR,
 	CLIENT_INFORMATION_VAR,
 	CLOCK_VAR,
@@ -102,6 +104,7 @@ int	ALLOW_C1_CHARS_VAR,
 	SCROLLBACK_VAR,
 	SCROLLBACK_RATIO_VAR,
 	SCROLL_LINES_VAR,
+	SERVER_BATCH_SIZE_VAR,
 	SHELL_VAR,
 	SHELL_FLAGS_VAR,
 	SHELL_LIMIT_VAR,
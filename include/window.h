@@ -223,6 +223,11 @@ extern	unsigned current_window_priority;
 	void	recalculate_windows		(struct ScreenStru *);
 	void	rebalance_windows		(struct ScreenStru *);
 	void	update_all_windows		(void);
+	void	defer_window_updates		(void);
+	void	resume_window_updates		(void);
+	int	window_updates_deferred		(void);
+	int	suspend_window_updates_deferral	(void);
+	void	restore_window_updates_deferral	(int);
 	void	set_current_window		(Window *);
 	void	hide_window			(Window *);
 	BUILT_IN_KEYBINDING(swap_last_window);
@@ -0,0 +1,588 @@
+/*
+ * ircbench.c -- Replay recorded server traffic into epic and time it.
+ *
+ * Copyright 2026 EPIC Software Labs.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notices, the above paragraph (the one permitting redistribution),
+ *    this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The names of the author(s) may not be used to endorse or promote
+ *    products derived from this software without specific prior written
+ *    permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * Here's the plan:
+ * We pretend to be an irc server on the loopback, and run epic on a pty
+ * so it thinks it has a real screen.  Once epic registers, we send it the
+ * traffic file over and over, at a fixed rate, until we've sent enough.
+ *
+ * The traffic file is just server lines.  The lines before a line that
+ * says "%%" are sent once after registration (to join the channel); the
+ * rest are replayed.  In each line {nick} is replaced with epic's nick
+ * and {seq} with a number that goes up by one for every line we send.
+ * Lines that contain "[bench:{seq}]" are timed from when we write them
+ * to the socket until the "[bench:N]" shows up on epic's screen.
+ *
+ * The results go to stdout as one line of JSON, so a script can keep
+ * track of them from one build to the next:
+ *	lines		How many lines we sent (not counting the prologue)
+ *	seconds		From the first line sent to the last one displayed
+ *	lines_per_sec	lines / seconds
+ *	timed		How many lines were timed
+ *	seen		How many of those showed up on the screen
+ *	p50_ms, p99_ms	Send-to-screen latency of the timed lines
+ *	max_rss_kb	epic's peak resident size
+ *	cpu_us_per_line	epic's user+system cpu time, divided by lines
+ *	rate, dumb	The -r and -d we were run with
+ *
+ * With -s, we don't replay anything.  Instead epic joins a channel with
+ * that many (made up) nicks on it, sent as fast as we can in a NAMES 
+ * burst, and we time how long it takes epic to get through it, that is,
+ * until a message we send right after the 366 shows up on the screen:
+ *	nicks		How many nicks were in the NAMES burst
+ *	seconds		From the JOIN being sent to the message being seen
+ *	nicks_per_sec	nicks / seconds
+ *	max_rss_kb	epic's peak resident size
+ *	cpu_us_per_nick	epic's user+system cpu time, divided by nicks
+ *	dumb		The -d we were run with
+ *
+ * Usage: ircbench [-d] [-r rate] [-n lines] [-f traffic] [-s nicks] epic5
+ *	-d	Run epic in dumb mode (-d) instead of full screen
+ *	-r	Lines per second to send (0 means as fast as we can)
+ *	-n	How many lines to send
+ *	-f	The traffic file
+ *	-s	Time a NAMES burst of this many nicks instead
+ */
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define NICK		"bencher"
+#define MARKER		"[bench:"
+#define END_MARKER	"[bench:end]"
+#define WAIT_SECS	30		/* Give up if epic stalls this long */
+#define NAMES_PER_LINE	40		/* Nicks in each 353 for -s */
+
+static	char **	traffic = NULL;		/* Replayed lines */
+static	int	traffic_count = 0;
+static	char **	prologue = NULL;	/* Lines sent once */
+static	int	prologue_count = 0;
+
+static	double *sent_at = NULL;		/* When each timed {seq} was sent */
+static	double *latency = NULL;		/* And how long until it was seen */
+static	int	timed = 0;
+static	double	last_seen = 0;
+static	int	saw_end = 0;
+
+static	char	outbuf[1 << 16];	/* Waiting to be written to epic */
+static	size_t	outlen = 0;
+
+static double	now (void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void	die (const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void	load_traffic (const char *file)
+{
+	FILE *	fp;
+	char	line[4096];
+	int	in_prologue = 1;
+	char ***list;
+	int *	count;
+
+	if (!(fp = fopen(file, "r")))
+		die(file);
+
+	while (fgets(line, sizeof(line), fp))
+	{
+		line[strcspn(line, "\r\n")] = 0;
+		if (!*line || *line == '#')
+			continue;
+		if (!strcmp(line, "%%"))
+		{
+			in_prologue = 0;
+			continue;
+		}
+
+		list = in_prologue ? &prologue : &traffic;
+		count = in_prologue ? &prologue_count : &traffic_count;
+		*list = realloc(*list, sizeof(char *) * (*count + 1));
+		(*list)[(*count)++] = strdup(line);
+	}
+	fclose(fp);
+
+	if (in_prologue)
+	{
+		/* No "%%" -- everything gets replayed */
+		traffic = prologue;
+		traffic_count = prologue_count;
+		prologue = NULL;
+		prologue_count = 0;
+	}
+	if (traffic_count == 0)
+	{
+		fprintf(stderr, "%s: no traffic to replay\n", file);
+		exit(1);
+	}
+}
+
+/*
+ * queue_line - Expand {nick} and {seq} in "tmpl" and queue it for epic.
+ *	Returns 1 if the line has a timing marker in it.
+ */
+static int	queue_line (const char *tmpl, long seq)
+{
+	char	line[8192];
+	char *	p = line;
+	const char *t;
+	int	is_timed = 0;
+
+	for (t = tmpl; *t && p < line + sizeof(line) - 64; )
+	{
+		if (!strncmp(t, "{nick}", 6))
+		{
+			p += sprintf(p, "%s", NICK);
+			t += 6;
+		}
+		else if (!strncmp(t, "{seq}", 5))
+		{
+			if (p - line >= 7 && !strncmp(p - 7, MARKER, 7))
+				is_timed = 1;
+			p += sprintf(p, "%ld", seq);
+			t += 5;
+		}
+		else
+			*p++ = *t++;
+	}
+	*p++ = '\r';
+	*p++ = '\n';
+
+	if (outlen + (p - line) > sizeof(outbuf))
+		return -1;
+	memcpy(outbuf + outlen, line, p - line);
+	outlen += p - line;
+	return is_timed;
+}
+
+static void	flush_out (int fd)
+{
+	ssize_t	n;
+
+	if (outlen == 0)
+		return;
+	if ((n = write(fd, outbuf, outlen)) < 0)
+	{
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		die("write to epic");
+	}
+	memmove(outbuf, outbuf + n, outlen - n);
+	outlen -= n;
+}
+
+/*
+ * scan_screen - Look for timing markers in what epic wrote to the screen.
+ *	Markers can be split across reads, so the last few bytes are kept.
+ */
+static void	scan_screen (int pty, long max_seq)
+{
+	static char	buf[65536 + 32];
+	static size_t	keep = 0;
+	ssize_t		n;
+	char *		p, *end;
+	long		seq;
+	double		t;
+
+	if ((n = read(pty, buf + keep, sizeof(buf) - keep - 1)) <= 0)
+		return;
+	t = now();
+	n += keep;
+	buf[n] = 0;
+
+	for (p = buf; (p = memchr(p, '[', buf + n - p)); p++)
+	{
+		if (buf + n - p < (ssize_t)sizeof(END_MARKER))
+			break;
+		if (!strncmp(p, END_MARKER, sizeof(END_MARKER) - 1))
+		{
+			saw_end = 1;
+			last_seen = t;
+			continue;
+		}
+		if (strncmp(p, MARKER, 7))
+			continue;
+		seq = strtol(p + 7, &end, 10);
+		if (*end != ']' || seq < 0 || seq >= max_seq)
+			continue;
+		if (sent_at[seq] > 0 && latency[seq] < 0)
+		{
+			latency[seq] = t - sent_at[seq];
+			last_seen = t;
+		}
+	}
+
+	keep = n < 32 ? n : 32;
+	memmove(buf, buf + n - keep, keep);
+}
+
+/*
+ * sync_line - The "seq"th line of the -s NAMES burst: the JOIN, then the
+ *	353's, then the 366.  Returns NULL after the 366.
+ */
+static const char *	sync_line (long seq, long nicks)
+{
+	static char	line[1024];
+	long		names = (nicks + NAMES_PER_LINE - 1) / NAMES_PER_LINE;
+	long		n;
+	char *		p;
+
+	if (seq == 0)
+		return ":{nick}!{nick}@{nick}.tmi.twitch.tv JOIN #bench";
+	if (seq > names + 1)
+		return NULL;
+	if (seq == names + 1)
+		return ":tmi.twitch.tv 366 {nick} #bench :End of /NAMES list";
+
+	/* Servers don't send names in order, so we don't either */
+	p = line + sprintf(line, ":tmi.twitch.tv 353 {nick} = #bench :");
+	for (n = (seq - 1) * NAMES_PER_LINE; 
+			n < seq * NAMES_PER_LINE && n < nicks; n++)
+		p += sprintf(p, "%suser%ld", p[-1] == ':' ? "" : " ",
+				(n * 2654435761UL) % 100000007UL);
+	return line;
+}
+
+static int	cmp_double (const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * wait_for_registration - Read from epic until it has sent NICK and USER.
+ */
+static void	wait_for_registration (int sock, int pty)
+{
+	char	buf[4096];
+	char	seen[8192] = "";
+	struct pollfd pfd[2];
+	double	give_up = now() + WAIT_SECS;
+	ssize_t	n;
+
+	while (!strstr(seen, "USER ") || !strstr(seen, "NICK "))
+	{
+		if (now() > give_up)
+		{
+			fprintf(stderr, "epic never registered\n");
+			exit(1);
+		}
+		pfd[0].fd = sock;	pfd[0].events = POLLIN;
+		pfd[1].fd = pty;	pfd[1].events = POLLIN;
+		if (poll(pfd, 2, 100) <= 0)
+			continue;
+		if (pfd[1].revents & POLLIN)
+			read(pty, buf, sizeof(buf));
+		if (pfd[0].revents & POLLIN)
+		{
+			if ((n = read(sock, buf, sizeof(buf) - 1)) <= 0)
+				die("epic hung up");
+			buf[n] = 0;
+			if (strlen(seen) + n < sizeof(seen))
+				strcat(seen, buf);
+		}
+	}
+}
+
+int	main (int argc, char **argv)
+{
+	const char *	file = "twitch-traffic";
+	const char *	epic;
+	long		rate = 2000, lines = 20000, nicks = 0, seq;
+	const char *	tmpl;
+	int		dumb = 0, c, i;
+	int		lsock, sock, pty;
+	struct sockaddr_in sin;
+	socklen_t	sinlen = sizeof(sin);
+	struct winsize	ws;
+	char		port[16], home[] = "/tmp/ircbench.XXXXXX";
+	char		buf[4096];
+	pid_t		pid;
+	struct pollfd	pfd[2];
+	double		start, next, give_up;
+	struct rusage	ru;
+	int		status;
+	double		cpu, p50 = 0, p99 = 0;
+	double *	sorted;
+
+	while ((c = getopt(argc, argv, "dr:n:f:s:")) != -1)
+	{
+		switch (c)
+		{
+			case 'd': dumb = 1; break;
+			case 'r': rate = atol(optarg); break;
+			case 'n': lines = atol(optarg); break;
+			case 'f': file = optarg; break;
+			case 's': nicks = atol(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-d] [-r rate] [-n lines] "
+					"[-f traffic] [-s nicks] epic5\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (optind >= argc || lines <= 0 || nicks < 0)
+	{
+		fprintf(stderr, "Usage: %s [-d] [-r rate] [-n lines] "
+				"[-f traffic] [-s nicks] epic5\n", argv[0]);
+		exit(1);
+	}
+	epic = argv[optind];
+
+	if (nicks > 0)
+	{
+		/* The JOIN, the 353's, and the 366, all at once */
+		lines = (nicks + NAMES_PER_LINE - 1) / NAMES_PER_LINE + 2;
+		rate = 0;
+	}
+	else
+		load_traffic(file);
+
+	sent_at = calloc(lines, sizeof(double));
+	latency = malloc(lines * sizeof(double));
+	for (seq = 0; seq < lines; seq++)
+		latency[seq] = -1;
+
+	/* Our pretend server */
+	if ((lsock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		die("socket");
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(lsock, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    listen(lsock, 1) < 0 ||
+	    getsockname(lsock, (struct sockaddr *)&sin, &sinlen) < 0)
+		die("bind");
+	snprintf(port, sizeof(port), "%d", ntohs(sin.sin_port));
+
+	/* epic's screen */
+	if ((pty = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+	    grantpt(pty) < 0 || unlockpt(pty) < 0)
+		die("pty");
+	ws.ws_row = 24;
+	ws.ws_col = 80;
+	ws.ws_xpixel = ws.ws_ypixel = 0;
+	if (!mkdtemp(home))
+		die("mkdtemp");
+
+	if ((pid = fork()) < 0)
+		die("fork");
+	if (pid == 0)
+	{
+		char	server[64];
+		int	tty;
+
+		setsid();
+		if ((tty = open(ptsname(pty), O_RDWR)) < 0)
+			die("open pty");
+		ioctl(tty, TIOCSWINSZ, &ws);
+		dup2(tty, 0);
+		dup2(tty, 1);
+		dup2(tty, 2);
+		if (tty > 2)
+			close(tty);
+		close(pty);
+		close(lsock);
+
+		setenv("HOME", home, 1);
+		setenv("TERM", "vt100", 1);
+		snprintf(server, sizeof(server), "127.0.0.1:%s", port);
+		if (dumb)
+			execl(epic, epic, "-q", "-d", NICK, server, (char *)NULL);
+		else
+			execl(epic, epic, "-q", NICK, server, (char *)NULL);
+		die(epic);
+	}
+
+	pfd[0].fd = lsock;
+	pfd[0].events = POLLIN;
+	if (poll(pfd, 1, WAIT_SECS * 1000) <= 0 ||
+	    (sock = accept(lsock, NULL, NULL)) < 0)
+	{
+		fprintf(stderr, "epic never connected\n");
+		kill(pid, SIGKILL);
+		exit(1);
+	}
+
+	wait_for_registration(sock, pty);
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	fcntl(pty, F_SETFL, O_NONBLOCK);
+
+	queue_line(":irc.bench 001 {nick} :Welcome to the benchmark", 0);
+	queue_line(":irc.bench 376 {nick} :End of /MOTD command", 0);
+	for (i = 0; i < prologue_count; i++)
+		queue_line(prologue[i], 0);
+	while (outlen)
+	{
+		flush_out(sock);
+		while (read(sock, buf, sizeof(buf)) > 0)
+			;
+	}
+
+	/* Give epic a moment to settle before we start the clock */
+	give_up = now() + 1;
+	while (now() < give_up)
+	{
+		poll(NULL, 0, 50);
+		while (read(pty, buf, sizeof(buf)) > 0)
+			;
+		while (read(sock, buf, sizeof(buf)) > 0)
+			;
+	}
+
+	start = next = now();
+	seq = 0;
+	give_up = start + WAIT_SECS;
+	while (!saw_end)
+	{
+		double	t = now();
+
+		/* Queue everything that's due by now */
+		while (seq < lines && (rate == 0 || next <= t) &&
+				outlen < sizeof(outbuf) - 8192)
+		{
+			if (nicks > 0)
+				tmpl = sync_line(seq, nicks);
+			else
+				tmpl = traffic[seq % traffic_count];
+			if (queue_line(tmpl, seq) == 1)
+			{
+				sent_at[seq] = t;
+				timed++;
+			}
+			seq++;
+			if (rate > 0)
+				next += 1.0 / rate;
+			if (seq == lines)
+				queue_line(":x!x@x PRIVMSG #bench :" END_MARKER, 0);
+		}
+		flush_out(sock);
+
+		pfd[0].fd = sock;
+		pfd[0].events = POLLIN | (outlen ? POLLOUT : 0);
+		pfd[1].fd = pty;
+		pfd[1].events = POLLIN;
+		poll(pfd, 2, rate > 0 ? 1 : (outlen ? 10 : 100));
+
+		if (pfd[0].revents & POLLIN)
+			while (read(sock, buf, sizeof(buf)) > 0)
+				;
+		if (pfd[1].revents & POLLIN)
+		{
+			scan_screen(pty, lines);
+			give_up = now() + WAIT_SECS;
+		}
+		if (now() > give_up)
+		{
+			fprintf(stderr, "epic stalled after %ld lines\n", seq);
+			break;
+		}
+	}
+
+	/* Tell epic to go away, and see what it cost */
+	write(pty, "/quit\r", 6);
+	give_up = now() + 5;
+	while (waitpid(pid, &status, WNOHANG) == 0)
+	{
+		if (now() > give_up)
+		{
+			kill(pid, SIGKILL);
+			waitpid(pid, &status, 0);
+			break;
+		}
+		while (read(pty, buf, sizeof(buf)) > 0)
+			;
+		poll(NULL, 0, 20);
+	}
+	getrusage(RUSAGE_CHILDREN, &ru);
+
+	sorted = malloc(sizeof(double) * (timed + 1));
+	for (c = 0, seq = 0; seq < lines; seq++)
+		if (latency[seq] >= 0)
+			sorted[c++] = latency[seq];
+	if (c > 0)
+	{
+		qsort(sorted, c, sizeof(double), cmp_double);
+		p50 = sorted[c / 2];
+		p99 = sorted[(c * 99) / 100];
+	}
+
+	cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0 +
+	      ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+	if (nicks > 0)
+	{
+	    printf("{\"nicks\": %ld, \"seconds\": %.3f, "
+		"\"nicks_per_sec\": %.0f, \"max_rss_kb\": %ld, "
+		"\"cpu_us_per_nick\": %.2f, \"dumb\": %d}\n",
+		nicks, last_seen - start,
+		last_seen > start ? nicks / (last_seen - start) : 0.0,
+		ru.ru_maxrss, cpu * 1000000 / nicks, dumb);
+	}
+	else
+	{
+	    printf("{\"lines\": %ld, \"seconds\": %.3f, \"lines_per_sec\": %.0f, "
+		"\"timed\": %d, \"seen\": %d, \"p50_ms\": %.3f, "
+		"\"p99_ms\": %.3f, \"max_rss_kb\": %ld, "
+		"\"cpu_us_per_line\": %.2f, \"rate\": %ld, \"dumb\": %d}\n",
+		lines, last_seen - start,
+		last_seen > start ? lines / (last_seen - start) : 0.0,
+		timed, c, p50 * 1000, p99 * 1000, ru.ru_maxrss,
+		cpu * 1000000 / lines, rate, dumb);
+	}
+
+	snprintf(buf, sizeof(buf), "rm -rf %s", home);
+	system(buf);
+	return saw_end ? 0 : 1;
+}
@@ -146,7 +146,29 @@ typedef struct	SymbolSetStru
 
 static SymbolSet globals = 	{ NULL, 0, 0, strncmp, HASH_INSENSITIVE };
 
+/*
+ * The symbol lookup cache.  Every $word() and /echo has to find its
+ * symbol in 'globals', and doing a binary search a few million times
+ * in a loop adds up.  So we remember the last symbol found for each name
+ * in a small direct-mapped table.  An entry is only good so long as no
+ * symbol has been added to or removed from 'globals' since it was made,
+ * which is what 'symbol_generation' counts.  We keep the Symbol and not
+ * its contents, so redefining an alias doesn't need to invalidate it.
+ */
+#define SYMBOL_CACHE_SIZE	256
+
+typedef struct
+{
+	Symbol *	item;
+	u_32int_t	hash;
+	unsigned long	generation;
+}	SymbolCache;
+
+static	SymbolCache	symbol_cache[SYMBOL_CACHE_SIZE];
+static	unsigned long	symbol_generation = 1;
+
 static	Symbol *lookup_symbol (const char *name);
+static	void	add_global_symbol (Symbol *item);
 static	Symbol *find_local_alias   (const char *name, SymbolSet **list);
 
 /*
@@ -249,6 +271,7 @@ void	flush_all_symbols (void)
 		new_free(&s->name);
 		new_free(&s->user_variable);
 		new_free(&s->user_variable_package);
+		forget_compiled_block(s->user_command);
 		new_free(&s->user_command);
 		new_free(&s->user_command_package);
 		destroy_arglist(&s->arglist);
@@ -266,6 +289,7 @@ void	flush_all_symbols (void)
 		new_free(&globals.list[i]);
 	}
 	new_free(&globals.list);
+	symbol_generation++;
 }
 
 
@@ -1045,6 +1069,8 @@ static int	GC_symbol (Symbol *item, array *list, int loc)
 
 	if (list && loc >= 0)
 		array_pop(list, loc);
+	if (list == (array *)&globals)
+		symbol_generation++;
 
 	new_free(&item->user_variable_package);
 	new_free(&item->user_command_package);
@@ -1114,7 +1140,7 @@ void	add_var_alias	(const char *orig_name, const char *stuff, int noisy)
 		if (!tmp || cnt >= 0)
 		{
 			tmp = make_new_Symbol(name);
-			add_to_array ((array *)&globals, (array_item *)tmp);
+			add_global_symbol(tmp);
 		}
 
 		if (current_package())
@@ -1170,7 +1196,7 @@ void	add_var_stub_alias  (const char *orig_name, const char *stuff)
 		tmp = make_new_Symbol(name);
 		if (current_package())
 		    tmp->user_variable_package = malloc_strdup(current_package());
-		add_to_array ((array *)&globals, (array_item *)tmp);
+		add_global_symbol(tmp);
 	}
 	else if (current_package())
 	{
@@ -1247,7 +1273,7 @@ void	add_cmd_alias	(const char *orig_name, ArgList *arglist, const char *stuff)
 		tmp = make_new_Symbol(name);
 		if (current_package())
 		   tmp->user_command_package = malloc_strdup(current_package());
-		add_to_array ((array *)&globals, (array_item *)tmp);
+		add_global_symbol(tmp);
 	}
 	else if (current_package()) 
 	{
@@ -1256,6 +1282,7 @@ void	add_cmd_alias	(const char *orig_name, ArgList *arglist, const char *stuff)
 		malloc_strcpy(&tmp->user_command_package, current_package());
 	}
 
+	forget_compiled_block(tmp->user_command);
 	malloc_strcpy(&(tmp->user_command), stuff);
 	tmp->user_command_stub = 0;
 	destroy_arglist(&tmp->arglist);
@@ -1286,7 +1313,7 @@ void	add_cmd_stub_alias  (const char *orig_name, const char *stuff)
 		tmp = make_new_Symbol(name);
 		if (current_package())
 		   tmp->user_command_package = malloc_strdup(current_package());
-		add_to_array ((array *)&globals, (array_item *)tmp);
+		add_global_symbol(tmp);
 	}
 	else if (current_package())
 	{
@@ -1295,6 +1322,7 @@ void	add_cmd_stub_alias  (const char *orig_name, const char *stuff)
 		malloc_strcpy(&(tmp->user_command_package), current_package());
 	}
 
+	forget_compiled_block(tmp->user_command);
 	malloc_strcpy(&(tmp->user_command), stuff);
 	tmp->user_command_stub = 1;
 
@@ -1313,7 +1341,7 @@ void	add_builtin_cmd_alias	(const char *name, void (*func) (const char *, char *
 	if (!tmp || cnt >= 0)
 	{
 		tmp = make_new_Symbol(name);
-		add_to_array ((array *)&globals, (array_item *)tmp);
+		add_global_symbol(tmp);
 	}
 
 	tmp->builtin_command = func;
@@ -1329,7 +1357,7 @@ void	add_builtin_func_alias	(const char *name, char * (*func) (char *))
 	if (!tmp || cnt >= 0)
 	{
 		tmp = make_new_Symbol(name);
-		add_to_array ((array *)&globals, (array_item *)tmp);
+		add_global_symbol(tmp);
 	}
 
 	tmp->builtin_function = func;
@@ -1345,7 +1373,7 @@ void	add_builtin_expando	(const char *name, char *(*func) (void))
 	if (!tmp || cnt >= 0)
 	{
 		tmp = make_new_Symbol(name);
-		add_to_array ((array *)&globals, (array_item *)tmp);
+		add_global_symbol(tmp);
 	}
 
 	tmp->builtin_expando = func;
@@ -1361,7 +1389,7 @@ void	add_builtin_variable_alias (const char *name, IrcVariable *var)
 	if (!tmp || cnt >= 0)
 	{
 		tmp = make_new_Symbol(name);
-		add_to_array((array *)&globals, (array_item *)tmp);
+		add_global_symbol(tmp);
 	}
 
 	tmp->builtin_variable = var;
@@ -1437,14 +1465,34 @@ static Symbol *	lookup_symbol (const char *name)
 	Symbol *	item = NULL;
 	int 	loc;
 	int 	cnt = 0;
+	u_32int_t	hash = 2166136261U;	/* FNV-1a */
+	const char *	p;
+	SymbolCache *	c;
 
 #if 0
 	name += strspn(name, ":");		/* Accept ::global */
 #endif
 
-	item = (Symbol *)find_array_item((array *)&globals, name, &cnt, &loc);
-	if (cnt >= 0)
-		item = NULL;
+	for (p = name; *p; p++)
+		hash = (hash ^ (u_32int_t)(unsigned char)*p) * 16777619U;
+	c = &symbol_cache[hash % SYMBOL_CACHE_SIZE];
+
+	if (c->generation == symbol_generation && c->hash == hash &&
+	    !strcmp(c->item->name, name))
+		item = c->item;
+	else
+	{
+		item = (Symbol *)find_array_item((array *)&globals, name, &cnt, &loc);
+		if (cnt >= 0)
+			item = NULL;
+		else
+		{
+			c->item = item;
+			c->hash = hash;
+			c->generation = symbol_generation;
+		}
+	}
+
 	if (item && item->user_variable_stub)
 		item = unstub_variable(item);
 	if (item && item->user_command_stub)
@@ -1452,6 +1500,16 @@ static Symbol *	lookup_symbol (const char *name)
 	return item;
 }
 
+/*
+ * Every symbol that goes into 'globals' goes in through here, so that
+ * the lookup cache knows to forget what it has.
+ */
+static void	add_global_symbol (Symbol *item)
+{
+	add_to_array((array *)&globals, (array_item *)item);
+	symbol_generation++;
+}
+
 /*
  * An example will best describe the semantics:
  *
@@ -1614,6 +1672,7 @@ static void	delete_cmd_alias (const char *orig_name, int noisy)
 	item = (Symbol *)find_array_item((array *)&globals, name, &cnt, &loc);
 	if (item && cnt < 0)
 	{
+		forget_compiled_block(item->user_command);
 		new_free(&item->user_command);
 		item->user_command_stub = 0;
 		new_free(&(item->user_command_package));
@@ -2235,6 +2294,7 @@ static	void	destroy_cmd_aliases (SymbolSet *my_array)
 				!item->arglist && !item->user_command_package)
 			continue;
 
+		forget_compiled_block(item->user_command);
 		new_free((void **)&item->user_command);
 		new_free((void **)&item->user_command_package);
 		item->user_command_stub = 0;
@@ -2816,7 +2876,7 @@ int	stack_push_var_alias (const char *name)
 	if (!item || cnt >= 0)
 	{
 	    item = make_new_Symbol(name);
-	    add_to_array((array *)&globals, (array_item *)item);
+	    add_global_symbol(item);
 	}
 
 	sym = make_new_Symbol(name);
@@ -2895,7 +2955,7 @@ int	stack_push_cmd_alias (char *name)
 	if (!item || cnt >= 0)
 	{
 	    item = make_new_Symbol(name);
-	    add_to_array((array *)&globals, (array_item *)item);
+	    add_global_symbol(item);
 	}
 
 	sym = make_new_Symbol(name);
@@ -2928,6 +2988,8 @@ int	stack_pop_cmd_alias (const char *name)
 
 	s = sym->saved;
 	ss = sym->saved->saved;
+	forget_compiled_block(item->user_command);
+	forget_compiled_block(s->user_command);
 	malloc_strcpy(&item->user_command, s->user_command);
 	item->user_command_stub = s->user_command_stub;
 	malloc_strcpy(&item->user_command_package, s->user_command_package);
@@ -2980,7 +3042,7 @@ int	stack_push_builtin_cmd_alias (const char *name)
 	if (!item || cnt >= 0)
 	{
 	    item = make_new_Symbol(name);
-	    add_to_array((array *)&globals, (array_item *)item);
+	    add_global_symbol(item);
 	}
 
 	sym = make_new_Symbol(name);
@@ -3055,7 +3117,7 @@ int	stack_push_builtin_func_alias (const char *name)
 	if (!item || cnt >= 0)
 	{
 	    item = make_new_Symbol(name);
-	    add_to_array((array *)&globals, (array_item *)item);
+	    add_global_symbol(item);
 	}
 
 	sym = make_new_Symbol(name);
@@ -3129,7 +3191,7 @@ int	stack_push_builtin_expando_alias (const char *name)
 	if (!item || cnt >= 0)
 	{
 	    item = make_new_Symbol(name);
-	    add_to_array((array *)&globals, (array_item *)item);
+	    add_global_symbol(item);
 	}
 
 	sym = make_new_Symbol(name);
@@ -3204,7 +3266,7 @@ int	stack_push_builtin_var_alias (const char *name)
 	if (!item || cnt >= 0)
 	{
 	    item = make_new_Symbol(name);
-	    add_to_array((array *)&globals, (array_item *)item);
+	    add_global_symbol(item);
 	}
 
 	sym = make_new_Symbol(name);
@@ -3452,7 +3514,7 @@ char    *symbolctl      (char *input)
 	    if (!s || cnt >= 0)
 	    {
 		s = make_new_Symbol(symbol);
-		add_to_array((array *)&globals, (array_item *)s);
+		add_global_symbol(s);
 		RETURN_INT(1);
 	    }
 	    RETURN_INT(0);
@@ -3472,6 +3534,7 @@ char    *symbolctl      (char *input)
 		    new_free(&s->user_variable_package);
 		}
 		if (all || !my_stricmp(input, "ALIAS")) {
+		    forget_compiled_block(s->user_command);
 		    new_free(&s->user_command);
 		    s->user_command_stub = 0;
 		    new_free(&s->user_command_package);
@@ -3626,6 +3689,7 @@ char    *symbolctl      (char *input)
             if (!my_stricmp(type, "ALIAS")) {
 		GET_FUNC_ARG(attr, input);
 		if (!my_stricmp(attr, "VALUE")) {
+		    forget_compiled_block(s->user_command);
 		    if (input && *input)
 		        malloc_strcpy(&s->user_command, input);
 		    else
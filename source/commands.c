@@ -167,6 +167,12 @@ static	void	allocdumpcmd	(const char *, char *, const char *);
 static	void	eval_inputlist 	(char *, const char *);
 static void	parse_block (const char *, const char *, int interactive);
 
+/* Compiled blocks of ircII code (see get_compiled_block) */
+typedef struct BlockStru	Block;
+static	Block *	compile_block	(const char *);
+static	void	run_block	(Block *, const char *);
+static	void	dispatch_command (const char *, char *, int, const char *);
+
 /* I hate typedefs, but they sure can be useful.. */
 typedef void (*CmdFunc) (const char *, char *, const char *);
 
@@ -232,6 +238,7 @@ static	IrcCommand irc_command[] =
         { "FOR",        forcmd		}, /* if.c */
 	{ "FOREACH",	foreach		}, /* if.c */
 	{ "HOOK",	hookcmd		},
+	{ "HOOKSTATS",	hookstatscmd	}, /* hook.c */
 	{ "HOSTNAME",	e_hostname	},
 	{ "IF",		ifcmd		}, /* if.c */
 	{ "IGNORE",	ignore		}, /* ignore.c */
@@ -3548,7 +3555,65 @@ void 	new_send_text (int server, const char *orig_target_list, const char *text,
 #endif
 
 /***************************************************************************/
-static char *	parse_line_alias_special (const char *name, const char *what, const char *args, void *arglist, int function);
+/*
+ * Compiled blocks
+ *
+ * Aliases and /ON's get run over and over again, and every time they do,
+ * parse_block() has to copy the text and find where each statement ends,
+ * and parse_statement() has to figure out what kind of statement each one
+ * is.  None of that changes unless the alias or /ON is redefined, so the
+ * first time a stored block of code is run, we break it up into a list of
+ * pre-digested statements and keep that around, keyed by the address of
+ * the stored text.
+ *
+ * Stored text can be freed (and its address reused) without anyone telling
+ * us, so we keep a copy of the text, and we make sure it still matches 
+ * before we use a compiled block.  Anyone who frees or replaces a block of
+ * code that might have been run should call forget_compiled_block() so we
+ * don't hold onto it forever.
+ */
+#define STMT_EMPTY	0	/* Nothing at all */
+#define STMT_BLOCK	1	/* { ... } */
+#define STMT_EXPR	2	/* @ ...  or  ( ... ) */
+#define STMT_COMMAND	3	/* Everything else */
+#define STMT_OTHER	4	/* Let parse_statement() deal with it */
+
+typedef struct StatementStru
+{
+	int		kind;
+	char *		text;		/* As parse_statement() would see it */
+	const char *	body;		/* 'text' after the ^'s and /'s */
+	int		quiet;		/* How many ^'s there were */
+	int		cmdchar_used;	/* How many /'s there were */
+	char *		expr;		/* STMT_EXPR: The expression */
+	Block *		block;		/* STMT_BLOCK: What's inside the {}s */
+	char *		cmd;		/* STMT_COMMAND: The command (in upper
+					   case) or NULL if it must be expanded
+					   every time */
+	char *		args;		/* STMT_COMMAND: Everything after 'cmd' */
+	int		literal;	/* STMT_COMMAND: 'args' has nothing to 
+					   expand */
+} Statement;
+
+struct BlockStru
+{
+	const char *	key;		/* The stored text we were made from */
+	char *		text;		/* Our own copy of that text */
+	int		compiled;	/* 0 if we just parse_block() 'text' */
+	int		count;		/* How many statements */
+	Statement *	stmts;		/* The statements */
+	int		refcnt;		/* How many are running us right now */
+	int		cached;		/* 1 if we are in compiled_blocks[] */
+	struct BlockStru *next;
+};
+
+#define COMPILED_BLOCK_BUCKETS	1024
+#define MAX_COMPILED_BLOCKS	4096
+
+static	Block *	compiled_blocks[COMPILED_BLOCK_BUCKETS];
+static	int	compiled_block_count = 0;
+
+static char *	parse_line_alias_special (const char *name, const char *what, Block *block, const char *args, void *arglist, int function);
 
 /* 
  * Execute a block of ircII code (``what'') as a lambda function.
@@ -3576,7 +3641,7 @@ char *  call_lambda_function (const char *name, const char *what, const char *ar
 	 * C does not allow you to treat a pointer as conditionally const, so
 	 * we just use the cast to hide that.  This is absolutely safe.
 	 */
-	return parse_line_alias_special(name, what, (char *)
+	return parse_line_alias_special(name, what, NULL, (char *)
 #ifdef HAVE_INTPTR_T
 	 					    (intptr_t)
 #endif
@@ -3589,7 +3654,7 @@ char *  call_lambda_function (const char *name, const char *what, const char *ar
  */
 void	call_lambda_command (const char *name, const char *what, const char *args)
 {
-	parse_line_alias_special(name, what, (char *)
+	parse_line_alias_special(name, what, NULL, (char *)
 #ifdef HAVE_INTPTR_T
 	 					    (intptr_t)
 #endif
@@ -3603,8 +3668,14 @@ void	call_lambda_command (const char *name, const char *what, const char *args)
  */
 char 	*call_user_function	(const char *alias_name, const char *alias_stuff, char *args, void *arglist)
 {
-	return parse_line_alias_special(alias_name, alias_stuff, args, 
-						arglist, 1);
+	void *	block;
+	char *	result;
+
+	block = get_compiled_block(alias_stuff);
+	result = parse_line_alias_special(alias_name, alias_stuff, 
+					(Block *)block, args, arglist, 1);
+	release_compiled_block(block);
+	return result;
 }
 
 /*
@@ -3613,8 +3684,34 @@ char 	*call_user_function	(const char *alias_name, const char *alias_stuff, char
  */
 void	call_user_command (const char *alias_name, const char *alias_stuff, char *args, void *arglist)
 {
-	parse_line_alias_special(alias_name, alias_stuff, args, 
-					arglist, 0);
+	void *	block;
+
+	block = get_compiled_block(alias_stuff);
+	parse_line_alias_special(alias_name, alias_stuff, (Block *)block, 
+					args, arglist, 0);
+	release_compiled_block(block);
+}
+
+/*
+ * Execute a block returned by get_compiled_block() as a named user alias
+ * function.  This is for callers (like /ON) who have to let go of the
+ * original text before the block is run.
+ */
+char *	call_compiled_function (const char *alias_name, void *block, char *args, void *arglist)
+{
+	return parse_line_alias_special(alias_name, NULL, 
+					(Block *)block, 
+					args, arglist, 1);
+}
+
+/*
+ * Execute a block returned by get_compiled_block() as a named user alias
+ * command.
+ */
+void	call_compiled_command (const char *alias_name, void *block, char *args, void *arglist)
+{
+	parse_line_alias_special(alias_name, NULL, (Block *)block, 
+					args, arglist, 0);
 }
 
 /*
@@ -3623,6 +3720,8 @@ void	call_user_command (const char *alias_name, const char *alias_stuff, char *a
  *	name	 - If non-NULL, the name of a new atomic scope.
  *		   If NULL, this is not a new atomic scope.
  *	what	 - The block of code to execute
+ *	block	 - If non-NULL, the compiled version of 'what', which is
+ *		   run instead.  'what' may be NULL if this is given.
  *	args	 - The value of $*
  *	arglist	 - Local variables to auto-assign, shifting off of $*
  *		   If NULL, do not change $*
@@ -3635,13 +3734,15 @@ void	call_user_command (const char *alias_name, const char *alias_stuff, char *a
  *		just want to run a block of code inside an existing scope
  *		then use the runcmds() function.
  */
-static char *	parse_line_alias_special (const char *name, const char *what, const char *orig_subargs, void *arglist, int function)
+static char *	parse_line_alias_special (const char *name, const char *what, Block *block, const char *orig_subargs, void *arglist, int function)
 {
 	int	old_last_function_call_level = last_function_call_level;
 	char *	result = NULL;
 	int	localvars = name ? 1 : 0;	/* 'name' could be free()d */
 	char *	subargs;
 
+	if (block)
+		what = block->text;
 	if (!orig_subargs)
 		subargs = LOCAL_COPY(empty_string);
 	else
@@ -3665,7 +3766,10 @@ static char *	parse_line_alias_special (const char *name, const char *what, cons
 	}
 
 	will_catch_return_exceptions++;
-	parse_block(what, subargs, 0);
+	if (block)
+		run_block(block, subargs);
+	else
+		parse_block(what, subargs, 0);
 	will_catch_return_exceptions--;
 	return_exception = 0;
 
@@ -3693,7 +3797,7 @@ void    runcmds_with_arglist (const char *what, char *args, const char *subargs)
 	if (!subargs)
 		subargs = LOCAL_COPY(empty_string);
 	arglist = parse_arglist(args);
-	parse_line_alias_special(NULL, what, subargs, arglist, 0);
+	parse_line_alias_special(NULL, what, NULL, subargs, arglist, 0);
 
 	destroy_arglist(&arglist);
 }
@@ -3813,9 +3917,10 @@ static void	parse_block (const char *org_line, const char *args, int interactive
  *	Input in dumb mode (ditto)
  *	/SENDLINE  (which simulates processing of the input line)
  */
+static	unsigned	statement_level = 0;
+
 int	parse_statement (const char *stmt, int interactive, const char *subargs)
 {
-static	unsigned 	level = 0;
 	unsigned 	display;
 	int		old_display_var;
 	int		cmdchar_used = 0;
@@ -3832,8 +3937,8 @@ static	unsigned 	level = 0;
 	old_display_var = get_int_var(DISPLAY_VAR);
 
 	if (get_int_var(DEBUG_VAR) & DEBUG_COMMANDS)
-		privileged_yell("Executing [%d] %s", level, stmt);
-	level++;
+		privileged_yell("Executing [%d] %s", statement_level, stmt);
+	statement_level++;
 
 	/* 
 	 * Once and for all i hope i fixed this.  What does this do?
@@ -3925,10 +4030,6 @@ static	unsigned 	level = 0;
 	else
 	{
 		char	*cmd, *args;
-		const char *alias = NULL;
-		void	*arglist = NULL;
-		void	(*builtin) (const char *, char *, const char *) = NULL;
-		const char *prevcmd = NULL;
 
 		if (subargs != NULL)
 			cmd = expand_alias(stmt, subargs); 
@@ -3942,29 +4043,388 @@ static	unsigned 	level = 0;
 			*args++ = 0;
 
 		upper(cmd);
-		alias = get_cmd_alias(cmd, &arglist, &builtin);
+		dispatch_command(cmd, args, cmdchar_used, subargs);
+		new_free(&cmd);
+	}
+
+	if (old_display_var != get_int_var(DISPLAY_VAR))
+		window_display = get_int_var(DISPLAY_VAR);
+	else
+		window_display = display;
+
+	statement_level--;
+	unset_current_command();
+        return 0;
+}
+
+/*
+ * dispatch_command: Run a command statement that has already been expanded
+ * and split into the command name ('cmd', in upper case) and its arguments.
+ */
+static void	dispatch_command (const char *cmd, char *args, int cmdchar_used, const char *subargs)
+{
+	const char *alias = NULL;
+	void	*arglist = NULL;
+	void	(*builtin) (const char *, char *, const char *) = NULL;
+	const char *prevcmd = NULL;
+
+	alias = get_cmd_alias(cmd, &arglist, &builtin);
+
+	if (cmdchar_used >= 2)
+		alias = NULL;		/* Unconditionally */
+
+	if (alias || builtin) {
+		prevcmd = current_command;
+		current_command = cmd;
+	}
+	if (alias) {
+		call_user_command(cmd, alias, args, arglist);
+	}
+	else if (builtin)
+		builtin(cmd, args, subargs);
+	else if (get_int_var(DISPATCH_UNKNOWN_COMMANDS_VAR))
+		send_to_server("%s %s", cmd, args);
+	else if (do_hook(UNKNOWN_COMMAND_LIST, "%s%s %s", cmdchar_used >= 2 ? "//" : "", cmd, args))
+		say("Unknown command: %s", cmd);
+
+	if (alias || builtin) {
+		current_command = prevcmd;
+	}
+}
+
+/*
+ * compile_statement: Pre-digest 'stmt' the way parse_statement() would
+ * (non-interactively) into 's'.  Anything that depends on $* or on what
+ * aliases exist is left for run_statement() to do.
+ */
+static void	compile_statement (Statement *s, const char *stmt)
+{
+	const char *	p;
+	char *		copy;
+	char *		stuff;
+	ssize_t		span;
+
+	memset(s, 0, sizeof(*s));
+	s->text = malloc_strdup(stmt);
+	if (!*stmt)
+	{
+		s->kind = STMT_EMPTY;
+		return;
+	}
+
+	/* This is the same as the ^ and / loop in parse_statement */
+	for (p = s->text; *p; p++)
+	{
+		if (*p == '^')
+		{
+			if (s->quiet++ > 1)
+				break;
+		}
+		else if (*p == '/')
+		{
+			if (s->cmdchar_used++ > 2)
+				break;
+		}
+		else
+			break;
+	}
+	s->body = p;
+
+	if (*p == '{')
+	{
+		copy = LOCAL_COPY(p);
+		if (!(stuff = next_expr_failok(&copy, '{')))
+			s->kind = STMT_OTHER;	/* Let it complain */
+		else
+		{
+			s->kind = STMT_BLOCK;
+			s->block = compile_block(stuff);
+		}
+	}
+	else if (*p == '@' || *p == '(')
+	{
+		copy = LOCAL_COPY(p);
+		if (*copy == '(')
+		{
+			if ((span = MatchingBracket(copy + 1, '(', ')')) >= 0)
+				copy[1 + span] = 0;
+		}
+		s->kind = STMT_EXPR;
+		s->expr = malloc_strdup(copy + 1);
+	}
+	else
+	{
+		s->kind = STMT_COMMAND;
+
+		/*
+		 * If the command name has nothing to expand, then expanding
+		 * the statement is the same as expanding what comes after
+		 * the first space, so we can look up the command ahead of
+		 * time.
+		 */
+		for (span = 0; p[span] && !isspace(p[span]); span++)
+			if (strchr("$\\(){}", p[span]))
+				return;
+		if (span == 0)
+			return;
+
+		s->cmd = new_malloc(span + 1);
+		memcpy(s->cmd, p, span);
+		s->cmd[span] = 0;
+		upper(s->cmd);
+
+		p += span;
+		if (*p)
+			p++;
+		s->args = malloc_strdup(p);
+		s->literal = expands_to_itself(s->args);
+	}
+}
+
+/*
+ * compile_block: Break 'text' up into statements, the same way that
+ * parse_block() does.  If the brackets don't match up, parse_block() has to
+ * complain about it at the right time, so we don't compile it at all.
+ */
+static Block *	compile_block (const char *text)
+{
+	Block *	block;
+	char *	line;
+	char *	ptr;
+	ssize_t	span;
+	int	count, i;
+
+	block = (Block *)new_malloc(sizeof(Block));
+	block->key = NULL;
+	block->text = malloc_strdup(text);
+	block->compiled = 0;
+	block->count = 0;
+	block->stmts = NULL;
+	block->refcnt = 0;
+	block->cached = 0;
+	block->next = NULL;
+
+	line = LOCAL_COPY(text);
+	for (ptr = line, count = 0; *ptr; count++)
+	{
+		if ((span = next_balanced_statement(ptr)) < 0)
+			return block;
+		ptr += span;
+		if (*ptr == ';')
+			ptr++;
+		while (*ptr && isspace(*ptr))
+			ptr++;
+	}
+
+	if (count)
+		block->stmts = (Statement *)new_malloc(sizeof(Statement) * count);
+	for (ptr = line, i = 0; i < count; i++)
+	{
+		span = next_balanced_statement(ptr);
+		if (ptr[span] == ';')
+			ptr[span++] = 0;
+		compile_statement(&block->stmts[i], ptr);
+		ptr += span;
+		while (*ptr && isspace(*ptr))
+			ptr++;
+	}
+
+	block->count = count;
+	block->compiled = 1;
+	return block;
+}
+
+static void	free_block (Block *block)
+{
+	Statement *	s;
+	int		i;
 
-		if (cmdchar_used >= 2)
-			alias = NULL;		/* Unconditionally */
+	for (i = 0; i < block->count; i++)
+	{
+		s = &block->stmts[i];
+		new_free(&s->text);
+		new_free(&s->expr);
+		new_free(&s->cmd);
+		new_free(&s->args);
+		if (s->block)
+			free_block(s->block);
+	}
+	new_free(&block->stmts);
+	new_free(&block->text);
+	new_free(&block);
+}
+
+/* Take 'block' out of the cache; it goes away when nobody is running it. */
+static void	uncache_block (Block *block)
+{
+	block->cached = 0;
+	compiled_block_count--;
+	if (block->refcnt == 0)
+		free_block(block);
+}
 
-		if (alias || builtin) {
-			prevcmd = current_command;
-			current_command = cmd;
+static void	flush_compiled_blocks (void)
+{
+	Block *	block;
+	int	i;
+
+	for (i = 0; i < COMPILED_BLOCK_BUCKETS; i++)
+	{
+		while ((block = compiled_blocks[i]))
+		{
+			compiled_blocks[i] = block->next;
+			uncache_block(block);
 		}
-		if (alias) {
-			call_user_command(cmd, alias, args, arglist);
+	}
+}
+
+#define COMPILED_BLOCK_BUCKET(x) \
+	(compiled_blocks[((size_t)(x) >> 4) % COMPILED_BLOCK_BUCKETS])
+
+/*
+ * get_compiled_block: Return the compiled version of the stored block of
+ * code 'text', compiling it if necessary.  'text' must be valid right now,
+ * but it does not need to stay valid while the block is running.  You must
+ * call release_compiled_block() when you're done with it.
+ */
+void *	get_compiled_block (const char *text)
+{
+	Block **	prev;
+	Block *		block;
+
+	if (!text)
+		return NULL;
+
+	for (prev = &COMPILED_BLOCK_BUCKET(text); (block = *prev); 
+						prev = &block->next)
+	{
+		if (block->key != text)
+			continue;
+
+		if (!strcmp(block->text, text))
+		{
+			block->refcnt++;
+			return block;
 		}
-		else if (builtin)
-			builtin(cmd, args, subargs);
-		else if (get_int_var(DISPATCH_UNKNOWN_COMMANDS_VAR))
-			send_to_server("%s %s", cmd, args);
-		else if (do_hook(UNKNOWN_COMMAND_LIST, "%s%s %s", cmdchar_used >= 2 ? "//" : "", cmd, args))
-			say("Unknown command: %s", cmd);
-
-		if (alias || builtin) {
-			current_command = prevcmd;
+
+		/* The text was freed and something else lives there now */
+		*prev = block->next;
+		uncache_block(block);
+		break;
+	}
+
+	if (compiled_block_count >= MAX_COMPILED_BLOCKS)
+		flush_compiled_blocks();
+
+	block = compile_block(text);
+	block->key = text;
+	block->cached = 1;
+	block->refcnt = 1;
+	block->next = COMPILED_BLOCK_BUCKET(text);
+	COMPILED_BLOCK_BUCKET(text) = block;
+	compiled_block_count++;
+	return block;
+}
+
+void	release_compiled_block (void *ptr)
+{
+	Block *	block = (Block *)ptr;
+
+	if (!block)
+		return;
+	if (--block->refcnt == 0 && !block->cached)
+		free_block(block);
+}
+
+/*
+ * forget_compiled_block: 'text' is about to be freed or changed, so throw
+ * away its compiled version (once nobody is running it any more).
+ */
+void	forget_compiled_block (const char *text)
+{
+	Block **	prev;
+	Block *		block;
+
+	if (!text)
+		return;
+
+	for (prev = &COMPILED_BLOCK_BUCKET(text); (block = *prev); 
+						prev = &block->next)
+	{
+		if (block->key == text)
+		{
+			*prev = block->next;
+			uncache_block(block);
+			return;
 		}
+	}
+}
+
+/*
+ * run_statement: The same as parse_statement(s->text, 0, subargs), but
+ * without doing the parts that compile_statement() did already.
+ */
+static void	run_statement (Statement *s, const char *subargs)
+{
+	unsigned 	display;
+	int		old_display_var;
+	char *		cmd;
+	char *		args;
+	char *		tmp;
+
+	if (s->kind == STMT_EMPTY)
+		return;
+	if (s->kind == STMT_OTHER)
+	{
+		parse_statement(s->text, 0, subargs);
+		return;
+	}
+
+	set_current_command(s->text);
+
+	display = window_display;
+	old_display_var = get_int_var(DISPLAY_VAR);
+
+	if (get_int_var(DEBUG_VAR) & DEBUG_COMMANDS)
+		privileged_yell("Executing [%d] %s", statement_level, s->text);
+	statement_level++;
+
+	if (s->quiet)
+		window_display = 0;
+
+	if (s->kind == STMT_BLOCK)
+		run_block(s->block, subargs);
 
+	else if (s->kind == STMT_EXPR)
+	{
+		/* The expression parser mangles what it's given */
+		tmp = LOCAL_COPY(s->expr);
+		if ((tmp = parse_inline(tmp, subargs)))
+			new_free(&tmp);
+	}
+
+	else if (s->cmd && !(get_int_var(DEBUG_VAR) & DEBUG_EXPANSIONS))
+	{
+		if (s->literal)
+			args = malloc_strdup(s->args);
+		else
+			args = expand_alias(s->args, subargs);
+		dispatch_command(s->cmd, args, s->cmdchar_used, subargs);
+		new_free(&args);
+	}
+
+	else
+	{
+		cmd = expand_alias(s->body, subargs);
+
+		args = cmd;
+		while (*args && !isspace(*args))
+			args++;
+		if (*args)
+			*args++ = 0;
+
+		upper(cmd);
+		dispatch_command(cmd, args, s->cmdchar_used, subargs);
 		new_free(&cmd);
 	}
 
@@ -3973,9 +4433,34 @@ static	unsigned 	level = 0;
 	else
 		window_display = display;
 
-	level--;
+	statement_level--;
 	unset_current_command();
-        return 0;
+}
+
+/*
+ * run_block: The same as parse_block(block->text, subargs, 0), but without
+ * doing the parts that compile_block() did already.
+ */
+static void	run_block (Block *block, const char *subargs)
+{
+	int	i;
+
+	if (!block->compiled || subargs == NULL)
+	{
+		parse_block(block->text, subargs, 0);
+		return;
+	}
+
+	for (i = 0; i < block->count; i++)
+	{
+		run_statement(&block->stmts[i], subargs);
+
+		if ((will_catch_break_exceptions && break_exception) ||
+		    (will_catch_return_exceptions && return_exception) ||
+		    (will_catch_continue_exceptions && continue_exception) ||
+		     system_exception)
+			break;
+	}
 }
 
 /***********************************************************************/
@@ -1285,19 +1285,17 @@ char	*parse_inline (char *str, const char *args)
 
 /**************************** TEXT MODE PARSER *****************************/
 /*
- * next_statement: Determines the length of the first statement in 'string'.
+ * statement_span: Determines the length of the first statement in 'string',
+ * and how many ('s and {'s were left open at the end of it.
  *
  * A statement ends at the first semicolon EXCEPT:
  *   -- Anything inside (...) or {...} doesn't count
  */
-ssize_t	next_statement (const char *string)
+static ssize_t	statement_span (const char *string, int *parens, int *braces)
 {
 	const char *ptr;
 	int	paren_count = 0, brace_count = 0;
 
-	if (!string || !*string)
-		return -1;
-
 	for (ptr = string; *ptr; ptr++)
 	{
 	    switch (*ptr)
@@ -1329,6 +1327,24 @@ ssize_t	next_statement (const char *string)
 	}
 
 all_done:
+	*parens = paren_count;
+	*braces = brace_count;
+	return (ssize_t)(ptr - string);
+}
+
+/*
+ * next_statement: Determines the length of the first statement in 'string'.
+ * Complains (but returns the length anyways) if the brackets don't balance.
+ */
+ssize_t	next_statement (const char *string)
+{
+	ssize_t	span;
+	int	paren_count, brace_count;
+
+	if (!string || !*string)
+		return -1;
+
+	span = statement_span(string, &paren_count, &brace_count);
 	if (paren_count != 0)
 	{
 		privileged_yell("[%d] More ('s than )'s found in this "
@@ -1340,7 +1356,26 @@ all_done:
 				"statement: \"%s\"", brace_count, string);
 	}
 
-	return (ssize_t)(ptr - string);
+	return span;
+}
+
+/*
+ * next_balanced_statement: Just like next_statement(), except that it
+ * returns -2 instead of complaining if the brackets don't balance.  This
+ * is for those who want to look at a block before it is run.
+ */
+ssize_t	next_balanced_statement (const char *string)
+{
+	ssize_t	span;
+	int	paren_count, brace_count;
+
+	if (!string || !*string)
+		return -1;
+
+	span = statement_span(string, &paren_count, &brace_count);
+	if (paren_count || brace_count)
+		return -2;
+	return span;
 }
 
 /*
@@ -1474,6 +1509,35 @@ char	*expand_alias	(const char *string, const char *args)
 	return buffer;
 }
 
+/*
+ * expands_to_itself: Returns 1 if expand_alias() would just hand back a
+ * copy of 'str' -- that is, if there are no $'s or \'s outside of brackets,
+ * and all of the brackets match.  (Except for the DEBUG_EXPANSIONS output,
+ * which is up to you.)
+ */
+int	expands_to_itself (const char *str)
+{
+	const char *	ptr;
+	ssize_t		span;
+
+	for (ptr = str; *ptr; )
+	{
+		if (*ptr == '$' || *ptr == '\\')
+			return 0;
+		else if (*ptr == LEFT_PAREN || *ptr == LEFT_BRACE)
+		{
+			if ((span = MatchingBracket(ptr + 1, *ptr, 
+					(*ptr == LEFT_PAREN) ? 
+					RIGHT_PAREN : RIGHT_BRACE)) < 0)
+				return 0;
+			ptr += span + 2;
+		}
+		else
+			ptr++;
+	}
+	return 1;
+}
+
 /*
  * alias_special_char: Here we determine what to do with the character after
  * the $ in a line of text. The special characters are described more fully
@@ -115,6 +115,14 @@
  * this might change in the future, but don't count on it.  The lexer uses
  * the results of prior operations to support such things as short circuits
  * and changing that would be a big pain.
+ *
+ * What we do instead is remember what the lexer found the last few hundred
+ * times it was run (see "EXPRESSION CACHE" below).  What the lexer returns
+ * only depends on the text of the expression, and not on the values of
+ * anything, so the next time we see the same expression, we can just play
+ * back the tokens without scanning the text again.  The operands are still
+ * turned into symbols (and variables and functions are still looked up) 
+ * every time, just like before.
  */
 
 typedef 	int		TOKEN;
@@ -222,6 +230,18 @@ typedef struct
 	TOKEN	last_token;
 
 	const char	*args;
+
+	/* LEXER CACHE */
+	/* If not NULL, we play back the tokens from this instead of lexing */
+	struct ExprProgramStru *program;
+	int	pc;
+
+	/* If not NULL, we save every token the lexer returns in this */
+	struct ExprProgramStru *recording;
+	int	rec_push;		/* Token pushed while lexing, or -1 */
+	int	rec_kind;		/* What kind of operand was lexed */
+	char *	rec_text;		/* The text of that operand */
+	int	uncacheable;		/* Set if the lexer complained */
 } expr_info;
 
 /* 
@@ -274,6 +294,13 @@ static void	setup_expr_info (expr_info *c)
 	c->mtok = 0;
 	c->errflag = 0;
 	c->last_token = 0;
+	c->program = NULL;
+	c->pc = 0;
+	c->recording = NULL;
+	c->rec_push = -1;
+	c->rec_kind = 0;
+	c->rec_text = NULL;
+	c->uncacheable = 0;
 	tokenize_raw(c, empty_string);	/* Always token 0 */
 }
 
@@ -497,7 +524,7 @@ __inline static	TOKEN		tokenize_raw (expr_info *c, const char *t)
  * 'expanded' tokens never can be passed through expand_alias() again.  This
  * protects against possible security holes in the client.
  */
-__inline static	TOKEN		tokenize_expanded (expr_info *c, char *t)
+__inline static	TOKEN		tokenize_expanded (expr_info *c, const char *t)
 {
 	if (c->token >= TOKENCOUNT)
 	{
@@ -1667,6 +1694,332 @@ static void	reduce (expr_info *cx, int what)
 }
 
 
+/**************************** EXPRESSION CACHE ******************************/
+/*
+ * The lexer only looks at the text of the expression, so it always returns
+ * the same tokens for the same text.  The first time we see an expression,
+ * we save every token the lexer returns (along with the text of each 
+ * operand, and any implied operand it pushed), and the next time we see
+ * the same expression, zzlex() just plays them back.  Operands are still 
+ * turned into symbols every time, so variables, functions and {} blocks
+ * are looked up and run just like they always were.  But if the name of a 
+ * variable (or a [...] string) has nothing in it to expand, we don't pass
+ * it through expand_alias() every time just to get the same thing back.
+ *
+ * We only keep the last EXPR_CACHE_SIZE expressions, and we don't keep an
+ * expression if the lexer complained about it (so it complains every time).
+ */
+#define EXPR_CACHE_SIZE		512
+#define EXPR_CACHE_BUCKETS	1024
+
+/* What kind of operand a token is */
+#define OPERAND_NONE		0	/* An operator, not an operand */
+#define OPERAND_RAW		1	/* tokenize_raw() */
+#define OPERAND_EXPANDED	2	/* tokenize_expanded() */
+#define OPERAND_LVAL		3	/* tokenize_lval() */
+#define OPERAND_LAMBDA		4	/* Run it, tokenize_expanded() the result */
+
+typedef struct
+{
+	int	type;			/* What zzlex() returned */
+	int	push;			/* Token to push first, or -1 */
+	int	kind;			/* OPERAND_* */
+	char *	text;			/* The operand, if there is one */
+	int	literal;		/* 'text' doesn't need expanding */
+} LEXEME;
+
+typedef struct ExprProgramStru
+{
+	char *		expr;		/* The text of the expression */
+	u_32int_t	hash;
+	int		count;		/* How many lexemes */
+	int		size;		/* How many lexemes we have room for */
+	LEXEME *	lexemes;
+	int		refcnt;		/* How many are playing us back */
+	int		cached;		/* 1 if we are in expr_cache[] */
+	struct ExprProgramStru *hnext;	/* Next in our hash bucket */
+	struct ExprProgramStru *newer;	/* Next most recently used */
+	struct ExprProgramStru *older;	/* Next least recently used */
+} PROGRAM;
+
+static	PROGRAM *	expr_cache[EXPR_CACHE_BUCKETS];
+static	PROGRAM *	expr_cache_newest = NULL;
+static	PROGRAM *	expr_cache_oldest = NULL;
+static	int		expr_cache_count = 0;
+static	unsigned long	expr_cache_hits = 0;
+static	unsigned long	expr_cache_misses = 0;
+
+static u_32int_t	expr_hash (const char *str)
+{
+	u_32int_t	h = 2166136261U;	/* FNV-1a */
+
+	for (; *str; str++)
+		h = (h ^ (u_32int_t)(unsigned char)*str) * 16777619U;
+	return h;
+}
+
+static PROGRAM *	new_program (const char *expr, u_32int_t hash)
+{
+	PROGRAM *	p;
+
+	p = (PROGRAM *)new_malloc(sizeof(PROGRAM));
+	p->expr = malloc_strdup(expr);
+	p->hash = hash;
+	p->count = 0;
+	p->size = 0;
+	p->lexemes = NULL;
+	p->refcnt = 0;
+	p->cached = 0;
+	p->hnext = NULL;
+	p->newer = NULL;
+	p->older = NULL;
+	return p;
+}
+
+static void	free_program (PROGRAM *p)
+{
+	int	i;
+
+	for (i = 0; i < p->count; i++)
+		new_free(&p->lexemes[i].text);
+	new_free(&p->lexemes);
+	new_free(&p->expr);
+	new_free(&p);
+}
+
+/* Take 'p' out of the cache.  It goes away when nobody is playing it. */
+static void	uncache_program (PROGRAM *p)
+{
+	PROGRAM **	ptr;
+
+	for (ptr = &expr_cache[p->hash % EXPR_CACHE_BUCKETS]; *ptr; 
+						ptr = &(*ptr)->hnext)
+	{
+		if (*ptr == p)
+		{
+			*ptr = p->hnext;
+			break;
+		}
+	}
+
+	if (p->newer)
+		p->newer->older = p->older;
+	else
+		expr_cache_newest = p->older;
+	if (p->older)
+		p->older->newer = p->newer;
+	else
+		expr_cache_oldest = p->newer;
+
+	p->hnext = p->newer = p->older = NULL;
+	p->cached = 0;
+	expr_cache_count--;
+	if (p->refcnt == 0)
+		free_program(p);
+}
+
+/* Make 'p' the most recently used expression */
+static void	touch_program (PROGRAM *p)
+{
+	if (p == expr_cache_newest)
+		return;
+
+	if (p->cached)
+	{
+		/* Unlink it (we know it isn't the newest) */
+		p->newer->older = p->older;
+		if (p->older)
+			p->older->newer = p->newer;
+		else
+			expr_cache_oldest = p->newer;
+	}
+
+	p->newer = NULL;
+	p->older = expr_cache_newest;
+	if (expr_cache_newest)
+		expr_cache_newest->newer = p;
+	expr_cache_newest = p;
+	if (!expr_cache_oldest)
+		expr_cache_oldest = p;
+}
+
+static PROGRAM *	find_program (const char *expr, u_32int_t hash)
+{
+	PROGRAM *	p;
+
+	for (p = expr_cache[hash % EXPR_CACHE_BUCKETS]; p; p = p->hnext)
+		if (p->hash == hash && !strcmp(p->expr, expr))
+			return p;
+	return NULL;
+}
+
+/* Put a newly recorded expression into the cache */
+static void	cache_program (PROGRAM *p)
+{
+	if (find_program(p->expr, p->hash))
+	{
+		/* Somebody beat us to it (recursion) */
+		free_program(p);
+		return;
+	}
+
+	while (expr_cache_count >= EXPR_CACHE_SIZE && expr_cache_oldest)
+		uncache_program(expr_cache_oldest);
+
+	p->hnext = expr_cache[p->hash % EXPR_CACHE_BUCKETS];
+	expr_cache[p->hash % EXPR_CACHE_BUCKETS] = p;
+	touch_program(p);
+	p->cached = 1;
+	expr_cache_count++;
+}
+
+static void	release_program (PROGRAM *p)
+{
+	if (--p->refcnt == 0 && !p->cached)
+		free_program(p);
+}
+
+/*
+ * expr_cache_stats: Returns "<hits> <misses> <hit rate> <expressions>"
+ * for $exprctl(STATS).  The hit rate is a percentage.
+ */
+char *	expr_cache_stats (void)
+{
+	unsigned long	total = expr_cache_hits + expr_cache_misses;
+
+	return malloc_sprintf(NULL, "%lu %lu %.1f %d", 
+			expr_cache_hits, expr_cache_misses,
+			total ? 100.0 * expr_cache_hits / total : 0.0,
+			expr_cache_count);
+}
+
+/* Throw away every saved expression and start counting over */
+void	expr_cache_flush (void)
+{
+	while (expr_cache_oldest)
+		uncache_program(expr_cache_oldest);
+	expr_cache_hits = expr_cache_misses = 0;
+}
+
+/*
+ * Turn the operand 'text' into a symbol.  This is the part of lexing an
+ * operand that has to be done every time.
+ */
+static TOKEN	make_operand (expr_info *c, int kind, const char *text)
+{
+	char *	result;
+	TOKEN	t;
+
+	switch (kind)
+	{
+		case OPERAND_RAW:
+			return tokenize_raw(c, text);
+		case OPERAND_EXPANDED:
+			return tokenize_expanded(c, text);
+		case OPERAND_LVAL:
+			return tokenize_lval(c, text);
+		case OPERAND_LAMBDA:
+			result = call_lambda_function(NULL, text, c->args);
+			t = tokenize_expanded(c, result);
+			new_free(&result);
+			return t;
+	}
+	return 0;
+}
+
+/*
+ * The lexer calls this for every operand it finds.  If we're in the 
+ * short-circuit of a noeval, the operand is thrown away.
+ */
+static void	lex_operand (expr_info *c, int kind, const char *text)
+{
+	if (c->recording)
+	{
+		c->rec_kind = kind;
+		malloc_strcpy(&c->rec_text, text);
+	}
+
+	if (c->noeval)
+		c->last_token = 0;
+	else
+		c->last_token = make_operand(c, kind, text);
+}
+
+/* The lexer calls this when it pushes an implied operand */
+static void	lex_push (expr_info *c, TOKEN t)
+{
+	if (c->recording)
+		c->rec_push = t;
+	push_token(c, t);
+}
+
+static void	record_lexeme (expr_info *c, int type)
+{
+	PROGRAM *	p = c->recording;
+	LEXEME *	l;
+
+	if (p->count == p->size)
+	{
+		p->size = p->size ? p->size * 2 : 16;
+		RESIZE(p->lexemes, LEXEME, p->size);
+	}
+	l = &p->lexemes[p->count++];
+	l->type = type;
+	l->push = c->rec_push;
+	l->kind = c->rec_kind;
+	l->text = c->rec_text;
+	c->rec_text = NULL;
+
+	if (l->kind == OPERAND_LVAL || (l->kind == OPERAND_RAW && type == ID))
+		l->literal = expands_to_itself(l->text);
+	else
+		l->literal = 0;
+}
+
+static int	replay_lexeme (expr_info *c)
+{
+	LEXEME *	l;
+
+	/* This can't happen, but just in case. */
+	if (c->pc >= c->program->count)
+		return EOI;
+
+	l = &c->program->lexemes[c->pc++];
+	if (l->push != -1)
+		push_token(c, l->push);
+	if (l->kind != OPERAND_NONE)
+	{
+		if (c->noeval)
+			c->last_token = 0;
+		else
+			c->last_token = make_operand(c, l->kind, l->text);
+
+		/*
+		 * Save get_token_raw() (for a variable name) or 
+		 * get_token_expanded() (for a [...] string) from having
+		 * to expand_alias() something that expands to itself.
+		 */
+		if (l->literal && c->last_token > 0 &&
+		    !(get_int_var(DEBUG_VAR) & DEBUG_EXPANSIONS))
+		{
+			SYMBOL *s = &TOK(c, c->last_token);
+
+			if (l->kind == OPERAND_LVAL)
+			{
+				s->raw_value = malloc_strdup(l->text);
+				s->used |= USED_RAW;
+			}
+			else
+			{
+				s->expanded_value = malloc_strdup(l->text);
+				s->used |= USED_EXPANDED;
+			}
+		}
+	}
+	return l->type;
+}
+
+
 /**************************** EXPRESSION LEXER ******************************/
 static	int	dummy = 1;
 
@@ -1681,6 +2034,7 @@ static int	lexerr (expr_info *c, const char *format, ...)
 
 	my_error("%s", buffer);
 	c->errflag = 1;
+	c->uncacheable = 1;
 	return EOI;
 }
 
@@ -1695,7 +2049,7 @@ static __inline int	check_implied_arg (expr_info *c)
 {
 	if (c->operand == 2)
 	{
-		push_token(c, MAGIC_TOKEN);	/* XXXX Bleh */
+		lex_push(c, MAGIC_TOKEN);	/* XXXX Bleh */
 		c->operand = 0;
 		return 0;
 	}
@@ -1728,7 +2082,7 @@ static __inline TOKEN 	unary (expr_info *c, const char *x, int y, TOKEN z)
 /*
  * This finds and extracts the next token in the expression
  */
-static int	zzlex (expr_info *c)
+static int	lex_token (expr_info *c)
 {
 	char	*start = c->ptr;
 
@@ -1765,10 +2119,7 @@ static int	zzlex (expr_info *c)
 			    else
 				c->ptr = endstr(c->ptr);
 
-			    if (c->noeval)
-				c->last_token = 0;
-			    else
-				c->last_token = tokenize_raw(c, p);
+			    lex_operand(c, OPERAND_RAW, p);
 
 			    if (oc)
 				*c->ptr++ = oc;
@@ -1789,7 +2140,7 @@ static int	zzlex (expr_info *c)
 			 * rhs for the last operand and hope it all works out.
 			 */
 			if (check_implied_arg(c))
-				push_token(c, 0);
+				lex_push(c, 0);
 			c->operand = 0;
 			return M_OUTPAR;
 
@@ -2070,15 +2421,7 @@ static int	zzlex (expr_info *c)
 			else
 				c->ptr = endstr(c->ptr);
 
-			c->last_token = 0;
-			if (!c->noeval)
-			{
-				char *	result;
-
-				result = call_lambda_function(NULL, p, c->args);
-				c->last_token = tokenize_expanded(c, result);
-				new_free(&result);
-			}
+			lex_operand(c, OPERAND_LAMBDA, p);
 
 			if (oc)
 				*c->ptr++ = oc;
@@ -2114,10 +2457,7 @@ static int	zzlex (expr_info *c)
 			else
 				c->ptr = endstr(c->ptr);
 
-			if (c->noeval)
-				c->last_token = 0;
-			else
-				c->last_token = tokenize_raw(c, p);
+			lex_operand(c, OPERAND_RAW, p);
 
 			if (oc)
 				*c->ptr++ = oc;
@@ -2148,10 +2488,7 @@ static int	zzlex (expr_info *c)
 			else
 				c->ptr = endstr(c->ptr);
 
-			if (c->noeval)
-				c->last_token = 0;
-			else
-				c->last_token = tokenize_raw(c, p);
+			lex_operand(c, OPERAND_RAW, p);
 
 			if (oc)
 				*c->ptr++ = oc;
@@ -2182,13 +2519,13 @@ static int	zzlex (expr_info *c)
 			else
 				c->ptr = endstr(c->ptr);
 
-			if (c->noeval)
+			if (c->noeval && !c->recording)
 				c->last_token = 0;
 			else
 			{
 			    char *ick = NULL;
 			    malloc_strcat_ues(&ick, p, "'");
-			    c->last_token = tokenize_expanded(c, ick);
+			    lex_operand(c, OPERAND_EXPANDED, ick);
 			    new_free(&ick);
 			}
 
@@ -2232,10 +2569,7 @@ static int	zzlex (expr_info *c)
 			endc = *end;
 			*end = 0;
 
-			if (c->noeval)
-				c->last_token = 0;
-			else
-				c->last_token = tokenize_expanded(c, c->ptr);
+			lex_operand(c, OPERAND_EXPANDED, c->ptr);
 
 			*end = endc;
 			c->ptr = end;
@@ -2276,6 +2610,15 @@ handle_expando:
 			c->ptr--;
 			if ((end = after_expando_special(c)))
 			{
+				/*
+				 * after_expando() complains about unmatched
+				 * brackets and then takes the rest of the 
+				 * expression.  Don't save anything that might
+				 * have done that, so it complains every time.
+				 */
+				if (!*end && strpbrk(start, "[("))
+					c->uncacheable = 1;
+
 				endc = *end;
 				*end = 0;
 
@@ -2283,10 +2626,7 @@ handle_expando:
 				 * If we are in the short-circuit of a noeval,
 				 * then we throw the token away.
 				 */
-				if (c->noeval)
-					c->last_token = 0;
-				else
-					c->last_token = tokenize_lval(c, start);
+				lex_operand(c, OPERAND_LVAL, start);
 
 				*end = endc;
 				c->ptr = end;
@@ -2295,6 +2635,7 @@ handle_expando:
 			{
 				c->last_token = 0; /* Empty token */
 				c->ptr = endstr(c->ptr);
+				c->uncacheable = 1;
 			}
 
 			if (x_debug & DEBUG_NEW_MATH_DEBUG)
@@ -2305,6 +2646,25 @@ handle_expando:
 	}
 }
 
+/*
+ * zzlex: Return the next token in the expression, either by lexing it, or
+ * by playing it back if we've seen this expression before.
+ */
+static int	zzlex (expr_info *c)
+{
+	int	type;
+
+	if (c->program)
+		return replay_lexeme(c);
+
+	c->rec_push = -1;
+	c->rec_kind = OPERAND_NONE;
+	type = lex_token(c);
+	if (c->recording)
+		record_lexeme(c, type);
+	return type;
+}
+
 /******************************* STATE MACHINE *****************************/
 /*
  * mathparse -- this is the state machine that actually parses the
@@ -2537,6 +2897,7 @@ static char *	matheval (char *s, const char *args)
 {
 	expr_info	context;
 	char *		ret = NULL;
+	u_32int_t	hash = 0;
 
 	/* Sanity check */
 	if (!s || !*s)
@@ -2550,9 +2911,37 @@ static char *	matheval (char *s, const char *args)
 	context.args = args;
 	context.orig_expr = LOCAL_COPY(s);
 
+	/* Play it back if we've seen it before, otherwise record it */
+	if (!(x_debug & DEBUG_NEW_MATH_DEBUG))
+	{
+		hash = expr_hash(s);
+		if ((context.program = find_program(s, hash)))
+		{
+			expr_cache_hits++;
+			context.program->refcnt++;
+			touch_program(context.program);
+		}
+		else
+		{
+			expr_cache_misses++;
+			context.recording = new_program(s, hash);
+		}
+	}
+
 	/* Actually do the parsing */
 	mathparse(&context, TOPPREC);
 
+	if (context.program)
+		release_program(context.program);
+	else if (context.recording)
+	{
+		if (context.uncacheable)
+			free_program(context.recording);
+		else
+			cache_program(context.recording);
+		new_free(&context.rec_text);
+	}
+
 	/* Check for error */
 	if (context.errflag)
 	{
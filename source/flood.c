@@ -50,9 +50,15 @@
 #include "lastlog.h"
 #include "window.h"
 #include "reg.h"
+#include <math.h>
 
 typedef struct flood_stru
 {
+struct	flood_stru *	hash_next;	/* Next one in the same bucket */
+struct	flood_stru *	newer;		/* Next one used after us */
+struct	flood_stru *	older;		/* Last one used before us */
+	u_32int_t	hash;
+
 	char		*nuh;
 	char		*channel;
 	int		server;
@@ -60,13 +66,29 @@ typedef struct flood_stru
 	int		level;
 	long		cnt;
 	Timeval		start;
-	int		floods;
+
+	Timeval *	times;		/* When the last "window" lines came */
+	int		window;		/* FLOOD_AFTER + 1, when we made "times" */
+	int		seen;		/* How many of "times" are used */
+	int		next;		/* Where the next one goes in "times" */
+
+	double		heat;		/* Lines per second, decaying */
+	Timeval		last;		/* When "heat" was last updated */
 }	Flooding;
 
-static	Flooding *flood = (Flooding *) 0;
+/*
+ * Everybody we're keeping track of is in flood_table, by nuh, channel,
+ * level and server.  They're also on a list from the one we heard from
+ * most recently (flood_newest) to the one we heard from least recently
+ * (flood_oldest), who is the one who gets dropped when we're already
+ * tracking /SET FLOOD_USERS people and somebody new shows up.
+ */
+static	Flooding **	flood_table = NULL;
+static	int		flood_table_size = 0;	/* A power of two */
+static	Flooding *	flood_newest = NULL;
+static	Flooding *	flood_oldest = NULL;
 int	users = 0;
 
-
 /*
  * If flood_maskuser is 0, proceed normally.  If 2, keep
  * track of the @host only.  If 1, keep track of the U@H
@@ -94,28 +116,154 @@ static const char *	normalize_nuh (const char *nuh)
 	return nuh;
 }
 
+/*
+ * The hash folds plain ascii the way my_stricmp() does and stops at the
+ * first non-ascii character, so it never splits up two things that 
+ * my_stricmp() would say are the same.
+ */
+static u_32int_t	flood_hash_str (u_32int_t h, const char *str)
+{
+	unsigned char	c;
+
+	while (str && (c = (unsigned char)*str++) && c < 0x80)
+		h = (h ^ (u_32int_t)tolower(c)) * 16777619U;
+	return h;
+}
+
+static u_32int_t	flood_hash (const char *nuh, const char *chan, int level, int server)
+{
+	u_32int_t	h = 2166136261U;	/* FNV-1a */
+
+	h = (h ^ (u_32int_t)level) * 16777619U;
+	h = (h ^ (u_32int_t)server) * 16777619U;
+	h = flood_hash_str(h, nuh);
+	h = (h ^ (chan ? 1U : 0U)) * 16777619U;
+	return flood_hash_str(h, chan);
+}
+
+static void	flood_unlink (Flooding *tmp)
+{
+	Flooding **	p;
+
+	for (p = &flood_table[tmp->hash & (flood_table_size - 1)]; *p; 
+			p = &(*p)->hash_next)
+	{
+		if (*p == tmp)
+		{
+			*p = tmp->hash_next;
+			break;
+		}
+	}
+
+	if (tmp->newer)
+		tmp->newer->older = tmp->older;
+	else
+		flood_newest = tmp->older;
+	if (tmp->older)
+		tmp->older->newer = tmp->newer;
+	else
+		flood_oldest = tmp->newer;
+	users--;
+}
+
+static void	flood_link (Flooding *tmp)
+{
+	Flooding **	bucket;
+
+	bucket = &flood_table[tmp->hash & (flood_table_size - 1)];
+	tmp->hash_next = *bucket;
+	*bucket = tmp;
+
+	tmp->newer = NULL;
+	if ((tmp->older = flood_newest))
+		flood_newest->newer = tmp;
+	else
+		flood_oldest = tmp;
+	flood_newest = tmp;
+	users++;
+}
+
+static void	flood_destroy (Flooding *tmp)
+{
+	flood_unlink(tmp);
+	release_string(&tmp->nuh);
+	release_string(&tmp->channel);
+	new_free((char **)&tmp->times);
+	new_free((char **)&tmp);
+}
+
+/* Make room for "numusers" in flood_table, and forget the extras */
+static void	flood_resize (int numusers)
+{
+	Flooding **	old = flood_table;
+	int		old_size = flood_table_size;
+	int		size, i;
+	Flooding *	tmp, *next;
+
+	while (users > numusers)
+		flood_destroy(flood_oldest);
+
+	for (size = 16; size < numusers; size *= 2)
+		;
+	if (size == old_size)
+		return;
+
+	flood_table = (Flooding **)new_malloc(sizeof(Flooding *) * size);
+	memset(flood_table, 0, sizeof(Flooding *) * size);
+	flood_table_size = size;
+
+	for (i = 0; i < old_size; i++)
+	{
+		for (tmp = old[i]; tmp; tmp = next)
+		{
+			next = tmp->hash_next;
+			tmp->hash_next = flood_table[tmp->hash & (size - 1)];
+			flood_table[tmp->hash & (size - 1)] = tmp;
+		}
+	}
+	new_free((char **)&old);
+}
+
+/* Decay "heat" to "right_now" (FLOOD_RATE_PER is the time constant) */
+static double	flood_heat (Flooding *tmp, Timeval right_now)
+{
+	double	per = get_int_var(FLOOD_RATE_PER_VAR);
+	double	diff = time_diff(tmp->last, right_now);
+
+	if (per <= 0)
+		per = 1;
+	if (diff > 0)
+	{
+		tmp->heat *= exp(-diff / per);
+		tmp->last = right_now;
+	}
+	return tmp->heat;
+}
+
 /*
  * check_flooding: This checks for message flooding of the type specified for
  * the given nickname.  This is described above.  This will return 0 if no
  * flooding took place, or flooding is not being monitored from a certain
  * person.  It will return 1 if flooding is being check for someone and an ON
  * FLOOD is activated.
+ *
+ * Someone is flooding if the last FLOOD_AFTER + 1 things they said came in
+ * at FLOOD_RATE per FLOOD_RATE_PER seconds or faster.  Once they stop 
+ * flooding, it takes another FLOOD_AFTER of them to set it off again.
  */
 int	new_check_flooding (const char *nick, const char *nuh, const char *chan, const char *line, int level)
 {
-static	int	 pos = 0;
-	int	 i,
-		 numusers,
+	int	 numusers,
 		 server,
+		 window,
 		 retval = 0;
 	Timeval	 right_now;
-	double	 diff;
+	double	 diff, per;
 	Flooding *tmp;
+	u_32int_t hash;
 	int	l;
-	char *	freeit;
-
-	freeit = malloc_strdup(nuh);
-	nuh = freeit;
+	int	is_new = 0;
+	char	nuh_copy[IRCD_BUFFER_SIZE];
 
 	/*
 	 * Figure out how many people we want to track
@@ -123,50 +271,33 @@ static	int	 pos = 0;
 	numusers = get_int_var(FLOOD_USERS_VAR);
 
 	/*
-	 * If the number of users has changed, then resize the info array
+	 * Following 0 people turns off flood checking entirely.
 	 */
-	if (users != numusers)
+	if (numusers <= 0)
 	{
-		i = users;
-		for (i--; i >= numusers; i--)
-		{
-			new_free(&(flood[i].nuh));
-			new_free(&(flood[i].channel));
-		}
-		RESIZE(flood, Flooding, numusers);
-		for (i++; i < numusers; i++)
+		if (flood_table)
 		{
-			flood[i].nuh = NULL;
-			flood[i].channel = NULL;
-			flood[i].server = NOSERV;
-			flood[i].level = LEVEL_NONE;
-			flood[i].cnt = 0;
-			get_time(&(flood[i].start));
-			flood[i].floods = 0;
+			flood_resize(0);
+			new_free((char **)&flood_table);
+			flood_table_size = 0;
 		}
-		users = numusers;
-		if (users)
-			pos %= users;
+		return 0;
 	}
 
 	/*
-	 * Following 0 people turns off flood checking entirely.
+	 * If the number of users has changed, then resize the table
 	 */
-	if (numusers == 0)
-	{
-		if (flood)
-			new_free((char **)&flood);
-		users = 0;
-		new_free(&freeit);
-		return 0;
-	}
+	if (users > numusers || !flood_table || 
+			flood_table_size < numusers || 
+			flood_table_size / 2 > numusers + 16)
+		flood_resize(numusers);
 
-	if (nuh && *nuh)
-		nuh = normalize_nuh(nuh);
-	else {
-		new_free(&freeit);
+	if (!nuh || !*nuh)
 		return 0;
-	}
+
+	/* normalize_nuh() scribbles on it */
+	strlcpy(nuh_copy, nuh, sizeof(nuh_copy));
+	nuh = normalize_nuh(nuh_copy);
 
 	/*
 	 * What server are we using?
@@ -174,8 +305,7 @@ static	int	 pos = 0;
 	server = (from_server == NOSERV) ? primary_server : from_server;
 
 	/*
-	 * Look in the flooding array.
-	 * Find an entry that matches us:
+	 * Find the entry that matches us:
 	 *	It must be the same flooding type and server.
 	 *	It must be for the same nickname
 	 *	If we're for a channel, it must also be for a channel
@@ -183,95 +313,103 @@ static	int	 pos = 0;
 	 *	else if we're not for a channel, it must also not be for
 	 *		a channel.
 	 */
-	for (i = 0; i < users; i++)
+	hash = flood_hash(nuh, chan, level, server);
+	for (tmp = flood_table[hash & (flood_table_size - 1)]; tmp; 
+			tmp = tmp->hash_next)
 	{
-		/*
-		 * Do some inexpensive tests first
-		 */
-		if (level != flood[i].level)
+		if (tmp->hash != hash || tmp->level != level || 
+				tmp->server != server)
 			continue;
-		if (server != flood[i].server)
+		if (my_stricmp(nuh, tmp->nuh))
 			continue;
-		if (!flood[i].nuh)
+		if (!!tmp->channel != !!chan)
 			continue;
-
-		/*
-		 * Must be for the person we're looking for
-		 */
-		if (my_stricmp(nuh, flood[i].nuh))
+		if (chan && my_stricmp(chan, tmp->channel))
 			continue;
-
-		/*
-		 * Must be for a channel if we're for a channel
-		 */
-		if (!!flood[i].channel != !!chan)
-			continue;
-
-		/*
-		 * Must be for the channel we're looking for.
-		 */
-		if (chan && my_stricmp(chan, flood[i].channel))
-			continue;
-
-		/*
-		 * We have a winner!
-		 */
 		break;
 	}
 
 	get_time(&right_now);
+	per = get_int_var(FLOOD_RATE_PER_VAR);
+	if (per <= 0)
+		per = 1;
+	window = get_int_var(FLOOD_AFTER_VAR) + 1;
+	if (window < 2)
+		window = 2;
 
 	/*
-	 * We didnt find anybody.
+	 * We didnt find anybody.  Make room if we need to.
 	 */
-	if (i == users)
+	if (!tmp)
 	{
-		/*
-		 * pos points at the next insertion point in the array.
-		 */
-		int old_pos = pos;
-		do {
-			pos = (0 < pos ? pos : users) - 1;
-		} while (0 < --flood[pos].floods && pos != old_pos);
-
-		tmp = flood + pos;
-		malloc_strcpy(&tmp->nuh, nuh);
-		if (chan)
-			malloc_strcpy(&tmp->channel, chan);
-		else
-			new_free(&tmp->channel);
+		if (users >= numusers)
+			flood_destroy(flood_oldest);
 
+		tmp = (Flooding *)new_malloc(sizeof(Flooding));
+		tmp->hash = hash;
+		tmp->nuh = intern_string(nuh);
+		tmp->channel = intern_string(chan);
 		tmp->server = server;
 		tmp->level = level;
 		tmp->cnt = 0;
 		tmp->start = right_now;
-
-		pos = (0 < old_pos ? old_pos : users) - 1;
-		new_free(&freeit);
-		return 0;
+		tmp->times = NULL;
+		tmp->window = 0;
+		tmp->heat = 0;
+		tmp->last = right_now;
+		flood_link(tmp);
+		is_new = 1;
 	}
 	else
-		tmp = flood + i;
+	{
+		/* Move them to the front of the line */
+		flood_unlink(tmp);
+		flood_link(tmp);
+		tmp->cnt++;
+	}
+
+	flood_heat(tmp, right_now);
+	tmp->heat += 1 / per;
+
+	/* Remember when this line came in */
+	if (tmp->window != window)
+	{
+		RESIZE(tmp->times, Timeval, window);
+		tmp->window = window;
+		tmp->seen = tmp->next = 0;
+	}
+	tmp->times[tmp->next] = right_now;
+	tmp->next = (tmp->next + 1) % tmp->window;
+	if (tmp->seen < tmp->window)
+		tmp->seen++;
+
+	/* The first thing anybody says is never a flood */
+	if (is_new)
+		return 0;
 
 	/*
 	 * Has the person flooded too much?
 	 */
-	if (++tmp->cnt >= get_int_var(FLOOD_AFTER_VAR))
+	if (tmp->cnt >= get_int_var(FLOOD_AFTER_VAR))
 	{
 		float rate = get_int_var(FLOOD_RATE_VAR);
-		rate /= get_int_var(FLOOD_RATE_PER_VAR);
-		diff = time_diff(tmp->start, right_now);
+		rate /= per;
+
+		/* How long it took for the last "seen" lines to come in */
+		diff = time_diff(tmp->times[(tmp->next + tmp->window - 
+						tmp->seen) % tmp->window], 
+				 right_now);
 
-		if ((diff == 0.0 || tmp->cnt / diff >= rate) &&
+		if ((diff == 0.0 || (tmp->seen - 1) / diff >= rate) &&
 				(retval = do_hook(FLOOD_LIST, "%s %s %s %ld %s",
 				nick, level_to_str(tmp->level),
 				chan ? chan : "*", tmp->cnt, line)))
 		{
-			tmp->floods++;
 			l = message_from(chan, LEVEL_OTHER);
 			if (get_int_var(FLOOD_WARNING_VAR))
 				say("FLOOD: %ld %s detected from %s in %f seconds",
-					tmp->cnt+1, level_to_str(tmp->level), nick, diff);
+					tmp->cnt+1, level_to_str(tmp->level), nick, 
+					time_diff(tmp->start, right_now));
 			pop_message_from(l);
 		}
 		else
@@ -284,8 +422,6 @@ static	int	 pos = 0;
 		}
 	}
 
-	new_free(&freeit);
-
 	if (get_int_var(FLOOD_IGNORE_VAR))
 		return retval;
 	else
@@ -297,6 +433,67 @@ int	check_flooding (const char *nick, const char *nuh, int mask, const char *lin
 	return new_check_flooding(nick, nuh, NULL, line, mask);
 }
 
+/*
+ * $floodinfo(-HEAT [<channel-pattern> [<server>]])
+ * Returns "<channel> <server> <heat>" (each in double quotes) for every
+ * channel we're tracking anybody on, where <heat> is about how many lines
+ * per second they've all been saying there lately.  It cools off with a 
+ * time constant of FLOOD_RATE_PER seconds.
+ */
+static char *	flood_channel_heat (char *args)
+{
+const	char *	chan = star;
+	int	server = -1;
+	Timeval	right_now;
+	Flooding *tmp;
+	struct { const char *channel; int server; double heat; } *heats = NULL;
+	int	count = 0, i;
+	char *	ret = NULL;
+	size_t	clue = 0;
+
+	if (args && *args)
+		GET_FUNC_ARG(chan, args);
+	if (args && *args)
+		GET_INT_ARG(server, args);
+
+	get_time(&right_now);
+	for (tmp = flood_newest; tmp; tmp = tmp->older)
+	{
+		if (!tmp->channel)
+			continue;
+		if (server >= 0 && tmp->server != server)
+			continue;
+		if (!wild_match(chan, tmp->channel))
+			continue;
+
+		for (i = 0; i < count; i++)
+			if (heats[i].server == tmp->server && 
+					!my_stricmp(heats[i].channel, tmp->channel))
+				break;
+		if (i == count)
+		{
+			RESIZE(heats, *heats, count + 1);
+			heats[i].channel = tmp->channel;
+			heats[i].server = tmp->server;
+			heats[i].heat = 0;
+			count++;
+		}
+		heats[i].heat += flood_heat(tmp, right_now);
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		malloc_strcat_wordlist_c(&ret, space, "\"", &clue);
+		malloc_strcat_wordlist_c(&ret, empty_string, heats[i].channel, &clue);
+		malloc_strcat_wordlist_c(&ret, space, ltoa(heats[i].server), &clue);
+		malloc_strcat_wordlist_c(&ret, space, ftoa(heats[i].heat), &clue);
+		malloc_strcat_wordlist_c(&ret, empty_string, "\"", &clue);
+	}
+
+	new_free((char **)&heats);
+	RETURN_MSTR(ret);
+}
+
 /*
  * Note:  This will break whatever uses it when any of the arguments
  *        contain a double quote.
@@ -307,12 +504,17 @@ char *	function_floodinfo (char *args)
 	char *ret = NULL;
 	size_t	clue = 0;
 	Timeval right_now;
-	int	i;
+	Flooding *tmp;
 	double	idiff;
 
+	if (!(arg = new_next_arg(args, &args)))
+		RETURN_EMPTY;
+	if (!my_stricmp(arg, "-HEAT"))
+		return flood_channel_heat(args);
+
 	get_time(&right_now);
 
-	while ((arg = new_next_arg(args, &args))) 
+	do
 	{
 	const	char	*nuh = star;
 	const	char	*chan = star;
@@ -350,33 +552,34 @@ char *	function_floodinfo (char *args)
 		if (rate < 0)
 			rate = -rate, rless++;
 
-		for (i = 0; i < users; i++) {
-			if (server >= 0 && flood[i].server != server) {
-			} else if (!flood[i].nuh) {
-			} else if (!wild_match(nuh, flood[i].nuh) && !wild_match(flood[i].nuh, nuh)) {
-			} else if (!wild_match(chan, flood[i].channel ? flood[i].channel : star)) {
-			} else if (!wild_match(level, level_to_str(flood[i].level))) {
-			} else if (!cless && flood[i].cnt < count) {
-			} else if ( cless && flood[i].cnt > count) {
-			} else if (!(idiff = time_diff(flood[i].start, right_now))) {
+		for (tmp = flood_newest; tmp; tmp = tmp->older) {
+			if (server >= 0 && tmp->server != server) {
+			} else if (!tmp->nuh) {
+			} else if (!wild_match(nuh, tmp->nuh) && !wild_match(tmp->nuh, nuh)) {
+			} else if (!wild_match(chan, tmp->channel ? tmp->channel : star)) {
+			} else if (!wild_match(level, level_to_str(tmp->level))) {
+			} else if (!cless && tmp->cnt < count) {
+			} else if ( cless && tmp->cnt > count) {
+			} else if (!(idiff = time_diff(tmp->start, right_now))) {
 			} else if (!dless && idiff < diff) {
 			} else if ( dless && idiff > diff) {
-			} else if (!rless && flood[i].cnt / idiff < rate) {
-			} else if ( rless && flood[i].cnt / idiff > rate) {
+			} else if (!rless && tmp->cnt / idiff < rate) {
+			} else if ( rless && tmp->cnt / idiff > rate) {
 			} else {
 				malloc_strcat_wordlist_c(&ret, space, "\"", &clue);
-				malloc_strcat_wordlist_c(&ret, empty_string, flood[i].nuh, &clue);
-				malloc_strcat_wordlist_c(&ret, space, flood[i].channel ? flood[i].channel : star, &clue);
-				malloc_strcat_wordlist_c(&ret, space, level_to_str(flood[i].level), &clue);
-				malloc_strcat_wordlist_c(&ret, space, ltoa(flood[i].server), &clue);
-				malloc_strcat_wordlist_c(&ret, space, ltoa(flood[i].cnt), &clue);
-				malloc_strcat_wordlist_c(&ret, space, ftoa(time_diff(flood[i].start, right_now)), &clue);
+				malloc_strcat_wordlist_c(&ret, empty_string, tmp->nuh, &clue);
+				malloc_strcat_wordlist_c(&ret, space, tmp->channel ? tmp->channel : star, &clue);
+				malloc_strcat_wordlist_c(&ret, space, level_to_str(tmp->level), &clue);
+				malloc_strcat_wordlist_c(&ret, space, ltoa(tmp->server), &clue);
+				malloc_strcat_wordlist_c(&ret, space, ltoa(tmp->cnt), &clue);
+				malloc_strcat_wordlist_c(&ret, space, ftoa(time_diff(tmp->start, right_now)), &clue);
 				malloc_strcat_wordlist_c(&ret, empty_string, "\"", &clue);
 			}
 		}
 
 		new_free(&freeme);
 	}
+	while ((arg = new_next_arg(args, &args)));
 
 	RETURN_MSTR(ret);
 }
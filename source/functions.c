@@ -113,7 +113,7 @@ static	char
 	*alias_server_version 	(void), *alias_show_userhost 	(void),
 	*alias_show_realname 	(void), *alias_online 		(void),
 	*alias_idle 		(void), *alias_version_str 	(void),
-	*alias_banner		(void);
+	*alias_banner		(void), *alias_message_tags	(void);
 
 typedef struct
 {
@@ -154,6 +154,7 @@ static	BuiltIns built_in[] =
 	{ "X",		alias_show_userhost 	},
 	{ "Y",		alias_show_realname 	},
 	{ "Z",		alias_time 		},
+	{ "MESSAGE_TAGS", alias_message_tags	},
 	{ 0,	 	NULL 			}
 };
 
@@ -214,6 +215,7 @@ static	char
 	*function_channellimit	(char *),
 	*function_channelmode	(char *),
 	*function_channelsyncing (char *),
+	*function_chanapprox	(char *),
 	*function_check_code	(char *),
 	*function_chmod		(char *),
 	*function_chngw 	(char *),
@@ -245,6 +247,7 @@ static	char
 	*function_error		(char *),
 	*function_exec		(char *),
 	*function_exp		(char *),
+	*function_exprctl	(char *),
 	*function_fnexist	(char *),
 	*function_fexist 	(char *),
 	*function_filter 	(char *),
@@ -284,6 +287,7 @@ static	char
 	*function_indextoword	(char *),
 	*function_info		(char *),
 	*function_insert 	(char *),
+	*function_internctl	(char *),
 	*function_insertw 	(char *),
 	*function_iptolong	(char *),
 	*function_iptoname 	(char *),
@@ -406,6 +410,8 @@ static	char
 	*function_strtol	(char *),
 	*function_substr	(char *),
 	*function_symbolctl	(char *),
+	*function_tag		(char *),
+	*function_tags		(char *),
 	*function_tan		(char *),
 	*function_tanh		(char *),
 	*function_tell		(char *),
@@ -482,6 +488,7 @@ static BuiltInFunctions	built_in_functions[] =
 	{ "CEIL",		function_ceil	 	},
 	{ "CENTER",		function_center 	},
 	{ "CEXIST",		function_cexist		},
+	{ "CHANAPPROX",		function_chanapprox	},
 	{ "CHANKEY",		function_chankey	},
 	{ "CHANLIMIT",		function_channellimit	},
 	{ "CHANMODE",		function_channelmode	},
@@ -527,6 +534,7 @@ static BuiltInFunctions	built_in_functions[] =
 	{ "EPIC",		function_epic		},
 	{ "EXEC",		function_exec		},
 	{ "EXP",		function_exp		},
+	{ "EXPRCTL",		function_exprctl	},
 	{ "FERROR",		function_error		},
 	{ "FEXIST",             function_fexist 	},
 	{ "FILTER",             function_filter 	},
@@ -588,6 +596,7 @@ static BuiltInFunctions	built_in_functions[] =
 	{ "INFO",		function_info		},
 	{ "INSERT",		function_insert 	},
 	{ "INSERTW",            function_insertw 	},
+	{ "INTERNCTL",		function_internctl	},
 	{ "IPTOLONG",		function_iptolong	},
 	{ "IPTONAME",		function_iptoname 	},
 	{ "IRCLIB",		function_irclib		},
@@ -740,6 +749,8 @@ static BuiltInFunctions	built_in_functions[] =
 	{ "STRTOL",		function_strtol		},
 	{ "SUBSTR",		function_substr		},
 	{ "SYMBOLCTL",		function_symbolctl	},
+	{ "TAG",		function_tag		},
+	{ "TAGS",		function_tags		},
 	{ "TAN",		function_tan		},
 	{ "TANH",		function_tanh		},
 #ifdef HAVE_TCL
@@ -800,6 +811,47 @@ void	init_functions (void)
 }
 
 
+/*
+ * Function names are nearly always written the same way every time, so
+ * we remember what upper() made of the ones we've seen, rather than doing
+ * the utf8 dance for every $word() in a loop.  Only plain ascii names
+ * are remembered, and names with [brackets] never get here, because
+ * those depend on the arguments.  The symbol itself is looked up through
+ * get_func_alias(), which has a cache of its own.
+ */
+#define FUNC_NAME_CACHE_SIZE	128
+
+static struct
+{
+	char *	name;
+	char *	canon;
+}	func_name_cache[FUNC_NAME_CACHE_SIZE];
+
+static const char *	canon_function_name (char *name)
+{
+	u_32int_t	hash = 2166136261U;	/* FNV-1a */
+	const char *	p;
+	int		ascii = 1;
+	size_t		i;
+
+	for (p = name; *p; p++)
+	{
+		if ((unsigned char)*p & 0x80)
+			ascii = 0;
+		hash = (hash ^ (u_32int_t)(unsigned char)*p) * 16777619U;
+	}
+
+	i = hash % FUNC_NAME_CACHE_SIZE;
+	if (func_name_cache[i].name && !strcmp(func_name_cache[i].name, name))
+		return func_name_cache[i].canon;
+	if (!ascii)
+		return upper(name);
+
+	malloc_strcpy(&func_name_cache[i].name, name);
+	malloc_strcpy(&func_name_cache[i].canon, name);
+	return upper(func_name_cache[i].canon);
+}
+
 /*
  * call_function has changed a little bit.  Now we take the entire call
  * including args in the paren list.  This is a bit more convenient for 
@@ -819,7 +871,7 @@ char	*call_function (char *name, const char *args)
 	char *	(*func) (char *) = NULL;
 	void *	arglist = NULL;
 	size_t	type;
-	char *	str = NULL;
+	char *	str;
 
 	debugging = get_int_var(DEBUG_VAR);
 
@@ -837,11 +889,18 @@ char	*call_function (char *name, const char *args)
 	else
 		lparen = endstr(name);
 
-	upper(name);
 	type = strspn(name, ":");
 	name += type;
 
-	str = remove_brackets(name, args);
+	if (strchr(name, '['))
+	{
+		upper(name);
+		tmp = remove_brackets(name, args);
+		str = LOCAL_COPY(tmp);
+		new_free(&tmp);
+	}
+	else
+		str = LOCAL_COPY(canon_function_name(name));
 	alias = get_func_alias(str, &arglist, &func);
 
 	if ((type == 0 && (!func && !alias)) ||
@@ -852,7 +911,6 @@ char	*call_function (char *name, const char *args)
 		yell("Function call to non-existant alias [%s]", str);
 	    if (debugging & DEBUG_FUNCTIONS)
 		privileged_yell("Function %s(%s) returned ", str, lparen);
-	    new_free(&str);
             return malloc_strdup(empty_string);
         }
 
@@ -873,7 +931,6 @@ char	*call_function (char *name, const char *args)
 		privileged_yell("Function %s(%s) returned %s", 
 					str, debug_copy, result);
 
-	new_free(&str);
 	new_free(&tmp);
 	return result;
 }
@@ -923,6 +980,7 @@ static  char    *alias_online 		(void) { return malloc_sprintf(NULL, INTMAX_FORM
 static  char    *alias_idle 		(void) { return malloc_sprintf(NULL, INTMAX_FORMAT, (intmax_t)time(NULL) - idle_time.tv_sec); }
 static	char	*alias_current_numeric	(void) { return malloc_sprintf(NULL, "%03d", current_numeric); }
 static	char	*alias_banner		(void) { return malloc_strdup(banner()); }
+static	char	*alias_message_tags	(void) { return malloc_strdup(get_message_tags()); }
 
 static	char	*alias_currdir  	(void)
 {
@@ -1446,6 +1504,38 @@ BUILT_IN_FUNCTION(function_userhost, input)
 	RETURN_STR(FromUserHost);
 }
 
+/*
+ * Usage: $tag(name)
+ * Returns: The value of the IRCv3 message tag "name" on the most recently
+ *	    received server message, with the escapes (\s, \:, etc) undone.
+ *	    Returns the empty string if the tag is missing or has no value.
+ * Caveat: Like $userhost(), this changes with every line from the server,
+ *	   and is only meaningful while that line is being handled (ie, in
+ *	   an /ON hooked by it.)
+ * Example: $tag(display-name)  $tag(user-id)  $tag(twitch.tv/foo)
+ */
+BUILT_IN_FUNCTION(function_tag, input)
+{
+	char *	name;
+	char *	value;
+
+	GET_FUNC_ARG(name, input);
+	value = get_message_tag(name);
+	RETURN_MSTR(value);
+}
+
+/*
+ * Usage: $tags()
+ * Returns: All of the IRCv3 message tags on the most recently received 
+ *	    server message, exactly as the server sent them (without the 
+ *	    leading @), or the empty string if there were none.
+ * Caveat: See $tag().
+ */
+BUILT_IN_FUNCTION(function_tags, input)
+{
+	RETURN_STR(get_message_tags());
+}
+
 /* 
  * Usage: $strip(characters text)
  * Returns: <text> with all instances of any characters in the <characters>
@@ -7104,6 +7194,43 @@ BUILT_IN_FUNCTION(function_ignorectl, input)
         return ignorectl(input);
 }
 
+/*
+ * $internctl(STATS)
+ * Returns "<strings> <refs> <bytes> <bytes if copied> <bytes saved>" for
+ * the string intern table shared by the names, lastlog and flood code.
+ */
+BUILT_IN_FUNCTION(function_internctl, input)
+{
+	char *	op;
+
+	GET_FUNC_ARG(op, input);
+	if (!my_stricmp(op, "STATS"))
+		return intern_stats();
+	RETURN_EMPTY;
+}
+
+/*
+ * $exprctl(STATS)
+ * Returns "<hits> <misses> <hit rate> <expressions>" for the cache of 
+ * lexed expressions kept by the math parser.
+ * $exprctl(FLUSH)
+ * Empties that cache and starts counting over.
+ */
+BUILT_IN_FUNCTION(function_exprctl, input)
+{
+	char *	op;
+
+	GET_FUNC_ARG(op, input);
+	if (!my_stricmp(op, "STATS"))
+		return expr_cache_stats();
+	else if (!my_stricmp(op, "FLUSH"))
+	{
+		expr_cache_flush();
+		RETURN_INT(1);
+	}
+	RETURN_EMPTY;
+}
+
 BUILT_IN_FUNCTION(function_metric_time, input)
 {
 	struct metric_time right_now;
@@ -7780,6 +7907,26 @@ BUILT_IN_FUNCTION(function_channelsyncing, word)
 	RETURN_INT(retval);
 }
 
+/*
+ * $chanapprox(<channel> <server>)
+ * Returns 1 if <channel> has gotten too big to keep track of everybody 
+ * on it (see /SET APPROXIMATE_CHANNEL_SIZE).  Then $numonchannel() is an 
+ * estimate, and $onchannel() and $chanusers() only know about the people
+ * who spoke recently.  Returns 0 otherwise.
+ */
+BUILT_IN_FUNCTION(function_chanapprox, word)
+{
+	char *	channel;
+	char *	serverstr;
+	int	servref;
+
+	GET_FUNC_ARG(channel, word);
+	GET_FUNC_ARG(serverstr, word);
+	servref = str_to_servref(serverstr);
+
+	RETURN_INT(channel_is_approximate(channel, servref));
+}
+
 #if 0
 void	help_topics_commands(FILE *);
 void	help_topics_functions(FILE *);
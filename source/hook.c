@@ -78,6 +78,17 @@ struct NoiseInfo noise_info_templates[] = {
 
 #define HF_NORECURSE	0x0001
 
+/* What $hookctl(STATS) knows about a hook, or about an event type */
+typedef struct	hook_stats_stru
+{
+	unsigned long	thrown;		/* Times the event was thrown */
+	unsigned long	calls;		/* Times /on code was run */
+	unsigned long	tests;		/* Times a pattern was matched against */
+	double		wall;		/* Seconds spent running /on code */
+	double		cpu;		/* CPU seconds spent running /on code */
+	double		max;		/* Longest single run, in seconds */
+}	HookStats;
+
 /* Hook: The structure of the entries of the hook functions lists */
 typedef struct	hook_stru
 {
@@ -96,6 +107,16 @@ typedef struct	hook_stru
 	int	userial;	/* Unique serial for this hook */
 	int	skip;		/* hook will be treated like it doesn't exist */
 	char *	filename;	/* Where it was loaded */
+
+	struct	hook_stru *index_next;	/* Next hook in the same index chain */
+	int	index_word;	/* Which word of NICK is the key (0 = none) */
+	int	index_off;	/* Where the key starts in NICK */
+	int	index_len;	/* How long the key is */
+	unsigned index_hash;	/* Hash of the key and index_word */
+	int	position;	/* Where this hook is in its list */
+
+	unsigned long made;	/* Tells apart hooks that reuse a userial */
+	HookStats stats;	/* What $hookctl(STATS HOOK) returns */
 }	Hook;
 
 /* 
@@ -138,6 +159,14 @@ typedef struct Hookables
 	unsigned flags;			/* Anything else needed */
 	char *	implied;		/* Implied output if unhooked */
 	int	implied_protect;	/* Do not re-expand implied hook */
+
+	Hook **	index;			/* Hooks hashed by a literal word */
+	int	index_size;		/* How many buckets in "index" */
+	Hook *	residual;		/* Hooks that can't be indexed */
+	unsigned index_words;		/* Bitmask of key words in "index" */
+	unsigned long index_generation;	/* Value of hook_generation when built */
+
+	HookStats stats;		/* What $hookctl(STATS LIST) returns */
 } Hookables;
 
 Hookables hook_function_templates[] =
@@ -228,6 +257,7 @@ Hookables hook_function_templates[] =
 	{ "SWITCH_WINDOWS",	NULL,	4,	0,	0,	NULL, 0 },
 	{ "TIMER",		NULL,	1,	0,	0,	NULL, 0 },
 	{ "TOPIC",		NULL,	2,	0,	0,	NULL, 0 },
+	{ "TWITCH",		NULL,	3,	0,	0,	NULL, 0 },
 	{ "UNKNOWN_COMMAND",	NULL,	2,	0,	HF_NORECURSE, 	NULL, 0},
 	{ "UNKNOWN_SET",	NULL,	2,	0,	HF_NORECURSE,	NULL, 0},
 	{ "UNLOAD",		NULL,	1,	0,	0,	NULL, 0 },
@@ -261,6 +291,26 @@ static	int 			noise_level_num = 0;
 static	int 			default_noise;
 static	const char *		current_implied_on_hook = NULL;
 
+/*
+ * How many times do_hook() had to press its arguments into a buffer,
+ * and how many times it didn't bother because nobody was listening.
+ */
+static	unsigned long		hook_formats_built = 0;
+static	unsigned long		hook_formats_avoided = 0;
+
+/*
+ * This is bumped every time any hook list changes in a way that could
+ * change which hooks match -- it tells the indexes to rebuild themselves.
+ */
+static	unsigned long		hook_generation = 1;
+
+/*
+ * This is bumped every time a hook is created or redefined.  A userial
+ * can be handed to a new hook as soon as the old one is removed, so this
+ * is how do_hook knows the hook it ran is still the one in that slot.
+ */
+static	unsigned long		hooks_made = 0;
+
 extern char *	    function_cparse	(char *);
 static void 	    add_to_list 	(Hook **list, Hook *item);
 static Hook *	    remove_from_list 	(Hook **list, char *item, int sernum);
@@ -284,6 +334,12 @@ static void	initialize_hook_functions (void)
 		hook_functions[i].flags = 0;
 		hook_functions[i].implied = NULL;
 		hook_functions[i].implied_protect = 0;
+		hook_functions[i].index = NULL;
+		hook_functions[i].index_size = 0;
+		hook_functions[i].residual = NULL;
+		hook_functions[i].index_words = 0;
+		hook_functions[i].index_generation = 0;
+		memset(&hook_functions[i].stats, 0, sizeof(HookStats));
 	}
 
 	for (b = 0, i = FIRST_NAMED_HOOK; i < NUMBER_OF_LISTS; b++, i++)
@@ -295,6 +351,12 @@ static void	initialize_hook_functions (void)
 		hook_functions[i].flags = hook_function_templates[b].flags;
 		hook_functions[i].implied = NULL;
 		hook_functions[i].implied_protect = 0;
+		hook_functions[i].index = NULL;
+		hook_functions[i].index_size = 0;
+		hook_functions[i].residual = NULL;
+		hook_functions[i].index_words = 0;
+		hook_functions[i].index_generation = 0;
+		memset(&hook_functions[i].stats, 0, sizeof(HookStats));
 	}
 
 	if (noise_info == NULL)
@@ -477,6 +539,7 @@ static int	add_hook (int which, char *nick, ArgList *arglist, char *stuff, int n
 
 	new_h->type = which;
 	malloc_strcpy(&new_h->nick, nick);
+	forget_compiled_block(new_h->stuff);
 	malloc_strcpy(&new_h->stuff, stuff);
 	new_h->noisy = noisy;
 	new_h->not = not;
@@ -484,6 +547,8 @@ static int	add_hook (int which, char *nick, ArgList *arglist, char *stuff, int n
 	new_h->flexible = flexible;
 	new_h->skip = 0;
 	new_h->arglist = arglist;
+	new_h->made = ++hooks_made;
+	memset(&new_h->stats, 0, sizeof(HookStats));
 	if (current_package())
 	    malloc_strcpy(&new_h->filename, current_package());
 	new_h->next = NULL;
@@ -520,6 +585,7 @@ static void remove_hook (int which, char *nick, int sernum, int quiet)
 					hook_functions[which].name);
 
 			new_free(&(tmp->nick));
+			forget_compiled_block(tmp->stuff);
 			new_free(&(tmp->stuff));
 			new_free(&(tmp->filename));
 			if (tmp->arglist != NULL)
@@ -561,13 +627,16 @@ static void remove_hook (int which, char *nick, int sernum, int quiet)
 			top = tmp->next;
 		tmp->not = 1;
 		new_free(&(tmp->nick));
+		forget_compiled_block(tmp->stuff);
 		new_free(&(tmp->stuff));
 		new_free(&(tmp->filename));
+		hooklist[tmp->userial] = NULL;
 		tmp->next = NULL;
 		
 		new_free((char **)&tmp);
 	}
 	hook_functions[which].list = top;
+	hook_generation++;
 	if (!quiet)
 	{
 		if (sernum)
@@ -677,6 +746,362 @@ static int show_all_numerics (int numeric)
 
 
 
+/* * * * * * * * INDEXING HOOKS * * * * * * */
+/*
+ * Most hooks look like "% #channel *" or "* PRIVMSG *" -- some words that
+ * can't contain a space, and then a literal word.  Such a word can only
+ * ever match the same word of $*, so each event keeps a hash table of its
+ * hooks keyed by (word number, literal word).  When the event is thrown,
+ * we only look up the words of $* that some hook is keyed on, and only
+ * the hooks found there (plus the "residual" hooks that couldn't be 
+ * indexed) need to be given to wild_match().
+ *
+ * A word "can't contain a space" if it's made of nothing but regular 
+ * characters and %'s.  Anything with *, ? or \ in it stops the search,
+ * as does a flexible hook, since its pattern isn't known until runtime.
+ */
+#define HOOK_INDEX_WORDS	16
+#define HOOK_MAX_CANDIDATES	64
+
+static unsigned	hook_index_hash (int word, const char *key, size_t len)
+{
+	unsigned	hash = (unsigned)word * 0x9E3779B1U;
+
+	while (len--)
+		hash = (hash * 33) ^ (unsigned)tolower(*key++);
+	return hash;
+}
+
+/* This has to fold case exactly the same way that wild_match() does. */
+static int	hook_index_same (const char *key, const char *word, size_t len)
+{
+	while (len--)
+		if (tolower(*key++) != tolower(*word++))
+			return 0;
+	return 1;
+}
+
+/*
+ * Figure out which word of the hook's pattern to key it on, if any.
+ */
+static void	hook_index_key (Hook *hook)
+{
+	const char *p, *word;
+	int	i, literal;
+
+	hook->index_word = 0;
+	if (hook->flexible || strstr(hook->nick, "\\["))
+		return;
+
+	for (p = hook->nick, i = 1; i <= HOOK_INDEX_WORDS; i++)
+	{
+		for (word = p, literal = 1; *p && *p != ' '; p++)
+		{
+			if (*p == '*' || *p == '?' || *p == '\\')
+				return;
+			if (*p == '%')
+				literal = 0;
+		}
+
+		if (literal && p > word)
+		{
+			hook->index_word = i;
+			hook->index_off = word - hook->nick;
+			hook->index_len = p - word;
+			hook->index_hash = hook_index_hash(i, word, p - word);
+			return;
+		}
+		if (!*p++)
+			return;
+	}
+}
+
+/*
+ * Rebuild the index for an event type if any hook list has changed 
+ * since the last time it was built.  A hook that comes after a skipped
+ * hook with the same serial number is never looked at by do_hook(), so
+ * it isn't put in the index at all.
+ */
+static void	hook_index_rebuild (Hookables *h)
+{
+	Hook *	tmp;
+	Hook *	residual_tail = NULL;
+	int	count = 0, size, position = 0;
+	int	skipping = 0, skip_sernum = 0;
+	unsigned bucket;
+
+	if (h->index_generation == hook_generation)
+		return;
+	h->index_generation = hook_generation;
+	h->residual = NULL;
+	h->index_words = 0;
+
+	for (tmp = h->list; tmp; tmp = tmp->next)
+		count++;
+	for (size = 16; size < count * 2; size *= 2)
+		;
+	if (size != h->index_size)
+	{
+		new_free((char **)&h->index);
+		h->index = (Hook **)new_malloc(sizeof(Hook *) * size);
+		h->index_size = size;
+	}
+	memset(h->index, 0, sizeof(Hook *) * size);
+
+	for (tmp = h->list; tmp; tmp = tmp->next)
+	{
+		tmp->position = position++;
+		tmp->index_next = NULL;
+
+		if (skipping && tmp->sernum == skip_sernum)
+			continue;
+		if (tmp->skip)
+		{
+			skipping = 1;
+			skip_sernum = tmp->sernum;
+			continue;
+		}
+		skipping = 0;
+
+		hook_index_key(tmp);
+		if (tmp->index_word)
+		{
+			bucket = tmp->index_hash & (h->index_size - 1);
+			tmp->index_next = h->index[bucket];
+			h->index[bucket] = tmp;
+			h->index_words |= 1U << tmp->index_word;
+		}
+		else
+		{
+			if (residual_tail)
+				residual_tail->index_next = tmp;
+			else
+				h->residual = tmp;
+			residual_tail = tmp;
+		}
+	}
+}
+
+static void	hook_candidate_add (Hook **cands, int *count, Hook *hook)
+{
+	int	i;
+
+	for (i = *count; i > 0 && cands[i - 1]->position > hook->position; i--)
+		cands[i] = cands[i - 1];
+	cands[i] = hook;
+	(*count)++;
+}
+
+/*
+ * Collect the hooks at serial number "sernum" that could possibly match
+ * "buffer", in the same order they are in the list.  Returns the number
+ * of hooks, or -1 if the caller should just look at all of them.
+ */
+static int	hook_candidates (Hookables *h, int sernum, const char *buffer, Hook **cands)
+{
+	const char *	word_start[HOOK_INDEX_WORDS + 1];
+	size_t		word_len[HOOK_INDEX_WORDS + 1];
+	const char *	p;
+	Hook *		tmp;
+	int		i, count = 0, words;
+	unsigned	hash;
+
+	if (x_debug & DEBUG_REGEX)
+		return -1;
+
+	hook_index_rebuild(h);
+
+	/* Chop up $* exactly the way the patterns were */
+	for (p = buffer, words = 0; words < HOOK_INDEX_WORDS; )
+	{
+		word_start[++words] = p;
+		while (*p && *p != ' ')
+			p++;
+		word_len[words] = p - word_start[words];
+		if (!*p++)
+			break;
+	}
+
+	for (tmp = h->residual; tmp; tmp = tmp->index_next)
+	{
+		if (tmp->sernum != sernum)
+			continue;
+		if (count >= HOOK_MAX_CANDIDATES)
+			return -1;
+		hook_candidate_add(cands, &count, tmp);
+	}
+
+	for (i = 1; i <= words; i++)
+	{
+		if (!(h->index_words & (1U << i)))
+			continue;
+
+		hash = hook_index_hash(i, word_start[i], word_len[i]);
+		for (tmp = h->index[hash & (h->index_size - 1)]; tmp; 
+				tmp = tmp->index_next)
+		{
+			if (tmp->index_hash != hash || tmp->index_word != i ||
+			    tmp->sernum != sernum || 
+			    (size_t)tmp->index_len != word_len[i] ||
+			    !hook_index_same(tmp->nick + tmp->index_off, 
+						word_start[i], word_len[i]))
+				continue;
+			if (count >= HOOK_MAX_CANDIDATES)
+				return -1;
+			hook_candidate_add(cands, &count, tmp);
+		}
+	}
+
+	return count;
+}
+
+/*
+ * How well does "buffer" match this hook's pattern?
+ */
+static int	hook_match (Hook *tmp, const char *buffer)
+{
+	char *	tmpnick;
+	int	currmatch;
+
+	tmp->stats.tests++;
+	hook_functions[tmp->type].stats.tests++;
+
+	if (tmp->flexible)
+	{
+		/* XXX What about context? */
+		tmpnick = expand_alias(tmp->nick, buffer);
+		currmatch = wild_match(tmpnick, buffer);
+		new_free(&tmpnick);
+	}
+	else
+		currmatch = wild_match(tmp->nick, buffer);
+
+	return currmatch;
+}
+
+
+/* * * * * * * * PROFILING HOOKS * * * * * * */
+static double	hook_cpu_time (void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) == 0)
+		return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#endif
+	return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static void	hook_stats_add (HookStats *stats, double wall, double cpu)
+{
+	stats->calls++;
+	stats->wall += wall;
+	stats->cpu += cpu;
+	if (wall > stats->max)
+		stats->max = wall;
+}
+
+/*
+ * The things that $hookctl(STATS) and /HOOKSTATS can sort by.
+ */
+enum HOOK_STATS_KEYS {
+	HOOK_STATS_CALLS = 1,
+	HOOK_STATS_CPU,
+	HOOK_STATS_MAX,
+	HOOK_STATS_TESTS,
+	HOOK_STATS_THROWN,
+	HOOK_STATS_WALL
+};
+
+static int	hook_stats_key (char *str)
+{
+	if (!str || !*str)
+		return HOOK_STATS_CPU;
+	return vmy_strnicmp(strlen(str), str, 
+		"CALLS", "CPU", "MAX", "TESTS", "THROWN", "WALL", NULL);
+}
+
+static double	hook_stats_value (const HookStats *stats, int key)
+{
+	switch (key)
+	{
+		case HOOK_STATS_CALLS:	return stats->calls;
+		case HOOK_STATS_CPU:	return stats->cpu;
+		case HOOK_STATS_MAX:	return stats->max;
+		case HOOK_STATS_TESTS:	return stats->tests;
+		case HOOK_STATS_THROWN:	return stats->thrown;
+		case HOOK_STATS_WALL:	return stats->wall;
+	}
+	return 0;
+}
+
+/* A hook (by userial) or an event type (by number) to be sorted */
+typedef struct	hook_stats_item_stru
+{
+	const HookStats *stats;
+	int		id;
+}	HookStatsItem;
+
+static	int	hook_stats_sort_key;
+
+static int	hook_stats_cmp (const void *a, const void *b)
+{
+	const HookStatsItem *one = (const HookStatsItem *)a;
+	const HookStatsItem *two = (const HookStatsItem *)b;
+	double	x = hook_stats_value(one->stats, hook_stats_sort_key);
+	double	y = hook_stats_value(two->stats, hook_stats_sort_key);
+
+	if (x > y)
+		return -1;
+	if (x < y)
+		return 1;
+	return one->id - two->id;
+}
+
+/*
+ * Return every hook (or every event type, if "lists" is set) that has 
+ * done anything, busiest first.  The caller must new_free() the array.
+ */
+static HookStatsItem *	hook_stats_sorted (int lists, int key, int *count)
+{
+	HookStatsItem *	items;
+	const HookStats *stats;
+	int	i, max;
+
+	max = lists ? NUMBER_OF_LISTS : hooklist_size;
+	items = (HookStatsItem *)new_malloc(sizeof(HookStatsItem) * (max + 1));
+	for (*count = i = 0; i < max; i++)
+	{
+		if (lists)
+			stats = &hook_functions[i].stats;
+		else if (hooklist[i])
+			stats = &hooklist[i]->stats;
+		else
+			continue;
+
+		if (!stats->calls && !stats->tests && !stats->thrown)
+			continue;
+		items[*count].stats = stats;
+		items[(*count)++].id = i;
+	}
+
+	hook_stats_sort_key = key;
+	qsort(items, *count, sizeof(HookStatsItem), hook_stats_cmp);
+	return items;
+}
+
+static void	hook_stats_reset (void)
+{
+	int	i;
+
+	for (i = 0; i < hooklist_size; i++)
+		if (hooklist[i])
+			memset(&hooklist[i]->stats, 0, sizeof(HookStats));
+	for (i = 0; i < NUMBER_OF_LISTS; i++)
+		memset(&hook_functions[i].stats, 0, sizeof(HookStats));
+}
+
+
 /* * * * * * * * EXECUTING A HOOK * * * * * * */
 #define NO_ACTION_TAKEN		-1
 #define SUPPRESS_DEFAULT	 0
@@ -684,6 +1109,30 @@ static int show_all_numerics (int numeric)
 #define RESULT_PENDING		 2
 static int 	do_hook_internal (int which, char **result, const char *format, va_list args);
 
+/*
+ * hook_is_listened: Returns 1 if an event of type "which" would do anything
+ * at all -- that is, if there are any /on's or an implied hook for it, and
+ * it's not being held back by DENY_ALL_HOOKS or NORECURSE.  When this returns
+ * 0, do_hook() is guaranteed to return NO_ACTION_TAKEN, so callers who do
+ * a lot of work to build the arguments for an event can check this first.
+ */
+int	hook_is_listened (int which)
+{
+	Hookables *	h;
+
+	if (!hook_functions_initialized)
+		initialize_hook_functions();
+	if (which < 0 || which >= NUMBER_OF_LISTS)
+		return 0;
+
+	h = &hook_functions[which];
+	if (deny_all_hooks || 
+	    (!h->list && !h->implied) ||
+	    (h->mark && h->flags & HF_NORECURSE))
+		return 0;
+	return 1;
+}
+
 /*
  * do_hook: This is what gets called whenever a MSG, INVITES, WALL, (you get
  * the idea) occurs.  The nick is looked up in the appropriate list. If a
@@ -700,6 +1149,18 @@ int	do_hook (int which, const char *format, ...)
 	int	retval;
 	va_list	args;
 
+	/*
+	 * Nobody but do_hook_with_result() callers ever look at $*
+	 * when there's no /on, so don't bother building it.
+	 */
+	if (!format)
+		panic(1, "do_hook: format is NULL (hook type %d)", which);
+	if (!hook_is_listened(which))
+	{
+		hook_formats_avoided++;
+		return NO_ACTION_TAKEN;
+	}
+
 	va_start(args, format);
 	retval = do_hook_internal(which, &result, format, args);
 	new_free(&result);
@@ -725,10 +1186,13 @@ static int 	do_hook_internal (int which, char **result, const char *format, va_l
 	int		retval;
 	char *		buffer		= NULL;
 	unsigned	display		= window_display;
-	char *		stuff_copy;
+	void *		block;
 	int		noise, old;
 	char		quote;
 	int		serial_number;
+	Timeval		run_start;
+	double		cpu_start, wall, cpu;
+	unsigned long	run_made;
 	struct Current_hook *hook;
 	Hookables *	h;
 	va_list		orig_args;
@@ -750,6 +1214,7 @@ static int 	do_hook_internal (int which, char **result, const char *format, va_l
 
 	va_copy(args, orig_args);
 	malloc_vsprintf(&buffer, format, args);
+	hook_formats_built++;
 
 
 	/*
@@ -758,14 +1223,13 @@ static int 	do_hook_internal (int which, char **result, const char *format, va_l
 	 *   2) There are no /on's and no implied hooks
 	 *   3) The /on has recursed and that is forbidden.
 	 */
-	if (deny_all_hooks || 
-	    (!h->list && !h->implied) ||
-	    (h->mark && h->flags & HF_NORECURSE))
+	if (!hook_is_listened(which))
 	{
 		retval = NO_ACTION_TAKEN;
 		*result = buffer;
 		return retval;
 	}
+	h->stats.thrown++;
 
 	/*
 	 * If there are no /on's, but there is an implied hook, skip
@@ -808,6 +1272,9 @@ static int 	do_hook_internal (int which, char **result, const char *format, va_l
 		char *buffer_copy;
 		int bestmatch = 0;
 		int currmatch;
+		Hook *cands[HOOK_MAX_CANDIDATES];
+		int ncands, i;
+		unsigned long generation;
 
 		if (tmp->sernum < serial_number)
 		    continue;
@@ -815,21 +1282,31 @@ static int 	do_hook_internal (int which, char **result, const char *format, va_l
 		if (tmp->sernum > serial_number)
 		    serial_number = tmp->sernum;
 
-		for (; 
-			!hook->halt && tmp && tmp->sernum == serial_number && !tmp->skip;
-			tmp = tmp->next)
+		/*
+		 * Only the hooks the index says could match need to be
+		 * checked.  A flexible hook can change the lists when its
+		 * pattern is expanded, and then the candidates are stale.
+		 */
+		ncands = hook_candidates(h, serial_number, hook->buffer, cands);
+		generation = hook_generation;
+		for (i = 0; !hook->halt && i < ncands; i++)
 		{
-		    if (tmp->flexible)
+		    if (generation != hook_generation)
+			break;
+
+		    currmatch = hook_match(cands[i], hook->buffer);
+		    if (currmatch > bestmatch)
 		    {
-			/* XXX What about context? */
-			char *tmpnick;
-			tmpnick = expand_alias(tmp->nick, hook->buffer);
-		        currmatch = wild_match(tmpnick, hook->buffer);
-			new_free(&tmpnick);
+			besthook = cands[i];
+			bestmatch = currmatch;
 		    }
-		    else
-		        currmatch = wild_match(tmp->nick, hook->buffer);
+		}
 
+		for (; 
+			ncands < 0 && !hook->halt && tmp && tmp->sernum == serial_number && !tmp->skip;
+			tmp = tmp->next)
+		{
+		    currmatch = hook_match(tmp, hook->buffer);
 		    if (currmatch > bestmatch)
 		    {
 			besthook = tmp;
@@ -855,10 +1332,11 @@ static int 	do_hook_internal (int which, char **result, const char *format, va_l
 		noise = tmp->noisy;
 		if (!name)
 			name = LOCAL_COPY(h->name);
-		stuff_copy = LOCAL_COPY(tmp->stuff);
+		block = get_compiled_block(tmp->stuff);
 		quote = tmp->flexible ? '\'' : '"';
 
 		hook->userial = tmp->userial;
+		run_made = tmp->made;
 		tmp_arglist = clone_arglist(tmp->arglist);
 
 		/*
@@ -894,11 +1372,14 @@ static int 	do_hook_internal (int which, char **result, const char *format, va_l
 
 		buffer_copy = LOCAL_COPY(hook->buffer);
 
+		get_time(&run_start);
+		cpu_start = hook_cpu_time();
+
 		if (hook->retval == RESULT_PENDING)
 		{
 			char *xresult;
 
-			xresult = call_user_function(name, stuff_copy,
+			xresult = call_compiled_function(name, block,
 							buffer_copy,
 							tmp_arglist);
 
@@ -918,7 +1399,7 @@ static int 	do_hook_internal (int which, char **result, const char *format, va_l
 			 * so it is absolutely forbidden to reference "tmp" 
 			 * after this point.
 			 */
-			call_user_command(name, stuff_copy, 
+			call_compiled_command(name, block, 
 						buffer_copy, tmp_arglist);
 			if (tmp_arglist)
 				destroy_arglist(&tmp_arglist);
@@ -928,9 +1409,22 @@ static int 	do_hook_internal (int which, char **result, const char *format, va_l
 		 * Clean up the stuff that may have been mangled by the
 		 * execution.
 		 */
+		release_compiled_block(block);
 		system_exception = old;
 		window_display = display;
 
+		/*
+		 * The hook might have removed or redefined itself, and its
+		 * userial may already belong to some other hook, so only
+		 * charge it if it's still the hook we ran.
+		 */
+		wall = time_diff(run_start, get_time(NULL));
+		cpu = hook_cpu_time() - cpu_start;
+		hook_stats_add(&h->stats, wall, cpu);
+		if (hook->userial < hooklist_size && hooklist[hook->userial] &&
+		    hooklist[hook->userial]->made == run_made)
+			hook_stats_add(&hooklist[hook->userial]->stats, wall, cpu);
+
 		/* Move onto the next serial number. */
 		break;
 	    }
@@ -1013,6 +1507,108 @@ static int 	do_hook_internal (int which, char **result, const char *format, va_l
 	return retval;
 }
 
+/*
+ * hookstats: the HOOKSTATS command.  Shows (or writes to a file, one 
+ * tab-separated line per hook, suitable for sort(1)) how much time your
+ * /on's have been taking.  See $hookctl(STATS) for what it all means.
+ *
+ *	HOOKSTATS [-LISTS] [-SORT <key>] [-COUNT <number>] [<filename>]
+ */
+BUILT_IN_COMMAND(hookstatscmd)
+{
+	HookStatsItem *	items;
+	const HookStats *stats;
+	Hook *		tmp;
+	char *		arg;
+	char *		filename = NULL;
+	Filename	fullname;
+	FILE *		fp = NULL;
+	int		lists = 0, key = HOOK_STATS_CPU, max = -1;
+	int		count, i;
+
+	while ((arg = new_next_arg(args, &args)))
+	{
+		if (!my_strnicmp(arg, "-LISTS", 2))
+			lists = 1;
+		else if (!my_strnicmp(arg, "-SORT", 2))
+		{
+			if (!(key = hook_stats_key(next_arg(args, &args))))
+			{
+				say("HOOKSTATS: -SORT must be one of CALLS, CPU, MAX, TESTS, THROWN or WALL");
+				return;
+			}
+		}
+		else if (!my_strnicmp(arg, "-COUNT", 2))
+			max = my_atol(next_arg(args, &args));
+		else
+			filename = arg;
+	}
+
+	if (filename)
+	{
+		if (normalize_filename(filename, fullname))
+			strlcpy(fullname, filename, sizeof(fullname));
+		if (!(fp = fopen(fullname, "w")))
+		{
+			say("HOOKSTATS: Can't write to %s: %s", 
+					fullname, strerror(errno));
+			return;
+		}
+		if (lists)
+			fprintf(fp, "#list\tthrown\tcalls\ttests\twall\tcpu\tmax\n");
+		else
+			fprintf(fp, "#id\tlist\tserial\tcalls\ttests\twall\tcpu\tmax\tpattern\n");
+	}
+	else if (lists)
+		say("%-20s %9s %9s %9s %10s %10s %10s", "List", "Thrown",
+			"Calls", "Tests", "Wall", "CPU", "Max");
+	else
+		say("%5s %-20s %9s %9s %10s %10s %10s %s", "Id", "List", 
+			"Calls", "Tests", "Wall", "CPU", "Max", "Pattern");
+
+	items = hook_stats_sorted(lists, key, &count);
+	for (i = 0; i < count && (max < 0 || i < max); i++)
+	{
+		stats = items[i].stats;
+		if (lists)
+		{
+			const char *name = hook_functions[items[i].id].name;
+
+			if (fp)
+				fprintf(fp, "%s\t%lu\t%lu\t%lu\t%f\t%f\t%f\n",
+					name, stats->thrown, stats->calls, 
+					stats->tests, stats->wall, 
+					stats->cpu, stats->max);
+			else
+				say("%-20s %9lu %9lu %9lu %10.6f %10.6f %10.6f",
+					name, stats->thrown, stats->calls, 
+					stats->tests, stats->wall, 
+					stats->cpu, stats->max);
+			continue;
+		}
+
+		tmp = hooklist[items[i].id];
+		if (fp)
+			fprintf(fp, "%d\t%s\t%d\t%lu\t%lu\t%f\t%f\t%f\t%s\n",
+				tmp->userial, hook_functions[tmp->type].name, 
+				tmp->sernum, stats->calls, stats->tests, 
+				stats->wall, stats->cpu, stats->max, tmp->nick);
+		else
+			say("%5d %-20s %9lu %9lu %10.6f %10.6f %10.6f %s",
+				tmp->userial, hook_functions[tmp->type].name, 
+				stats->calls, stats->tests, stats->wall, 
+				stats->cpu, stats->max, tmp->nick);
+	}
+	new_free((char **)&items);
+
+	if (fp)
+	{
+		fclose(fp);
+		say("HOOKSTATS: Wrote %d %s to %s", i, 
+				lists ? "lists" : "hooks", fullname);
+	}
+}
+
 /* 
  * shook: the SHOOK command -- this probably doesnt belong here,
  * and shook is probably a stupid name.  It simply asserts a fake
@@ -1459,6 +2055,7 @@ void	do_stack_on (int type, char *args)
 		new_os->next = on_stack;
 		on_stack = new_os;
 		hook_functions[which].list = NULL;
+		hook_generation++;
 		return;
 	}
 
@@ -1484,6 +2081,7 @@ void	do_stack_on (int type, char *args)
 		}
 
 		hook_functions[which].list = p->list;
+		hook_generation++;
 
 		new_free((char **)&p);
 		return;
@@ -1521,6 +2119,7 @@ static void 	add_to_list (Hook **list, Hook *item)
 {
 	Hook *tmp, *last = NULL;
 
+	hook_generation++;
 	for (tmp = *list; tmp; last = tmp, tmp = tmp->next)
 	{
 		if (tmp->sernum < item->sernum)
@@ -1548,6 +2147,7 @@ static Hook *remove_from_list (Hook **list, char *item, int sernum)
 {
 	Hook *tmp, *last = NULL;
 
+	hook_generation++;
 	for (tmp = *list; tmp; last = tmp, tmp = tmp->next)
 	{
 		if (tmp->sernum == sernum && !my_stricmp(tmp->nick, item))
@@ -1641,6 +2241,7 @@ enum
 	HOOKCTL_EMPTY_SLOTS,
 	HOOKCTL_EXECUTING_HOOKS,
 	HOOKCTL_FIRST_NAMED_HOOK,
+	HOOKCTL_FORMATS,
 	HOOKCTL_GET,
 	HOOKCTL_HALTCHAIN,
 	HOOKCTL_HOOKLIST_SIZE,
@@ -1655,9 +2256,11 @@ enum
 	HOOKCTL_PACKAGE,
 	HOOKCTL_POPULATED_LISTS,
 	HOOKCTL_REMOVE,
+	HOOKCTL_RESETSTATS,
 	HOOKCTL_RETVAL,
 	HOOKCTL_SERIAL,
 	HOOKCTL_SET,
+	HOOKCTL_STATS,
 	HOOKCTL_USERINFO
 };
 
@@ -1704,6 +2307,10 @@ enum
  *         'recursive' list, listing the current hook first.
  *   FIRST_NAMED_HOOK
  *       - returns FIRST_NAMED_HOOK
+ *   FORMATS
+ *       - returns two numbers: how many times an event's arguments were
+ *         built into $*, and how many times that was skipped because
+ *         nothing was listening for the event.
  *   HOOKLIST_SIZE
  *       - will returns HOOKLIST_SIZE
  *   LAST_CREATED_HOOK
@@ -1738,6 +2345,22 @@ enum
  *         0 otherwise.
  *   SET <type> <arg>
  *       - See GET/SET
+ *   STATS HOOK <hook id>
+ *       - Returns "<calls> <tests> <wall> <cpu> <max>" for the hook: how
+ *         many times it was run, how many times its pattern was matched
+ *         against an event, the total wall-clock and cpu seconds spent
+ *         running it, and the longest it ever took to run once.
+ *   STATS LIST <list>
+ *       - Returns "<thrown> <calls> <tests> <wall> <cpu> <max>" for all 
+ *         of the hooks in the list put together, where <thrown> is how 
+ *         many times the event happened while something was listening.
+ *   STATS [HOOKS|LISTS] [<sort>] [<count>]
+ *       - Returns the hook id's (or list names) that have done anything, 
+ *         busiest first.  <sort> is one of CALLS, CPU (the default), MAX,
+ *         TESTS, THROWN or WALL.  Only the first <count> are returned, if
+ *         you give one.
+ *   RESETSTATS
+ *       - Sets all of the STATS back to zero.
  *
  *   * GET/SET usage
  *   GET gettype <arguments>
@@ -1911,6 +2534,7 @@ char *hookctl (char *input)
 		"EMPTY_SLOTS",
 		"EXECUTING_HOOKS", 
 		"FIRST_NAMED_HOOK",
+		"FORMATS",
 		"GET",
 		"HALTCHAIN",
 		"HOOKLIST_SIZE",
@@ -1925,9 +2549,11 @@ char *hookctl (char *input)
 		"POPULATED_LISTS",
 		"PACKAGE",
 		"REMOVE",
+		"RESETSTATS",
 		"RETVAL",
 		"SERIAL",
 		"SET",
+		"STATS",
 		"USERINFO",
 		NULL);
 
@@ -1974,6 +2600,13 @@ char *hookctl (char *input)
 		RETURN_INT(FIRST_NAMED_HOOK);
 		break;
 		
+	/* go-switch */
+	case HOOKCTL_FORMATS:
+		malloc_sprintf(&ret, "%lu %lu", 
+				hook_formats_built, hook_formats_avoided);
+		RETURN_MSTR(ret);
+		break;
+
 	/* go-switch */
 	case HOOKCTL_HOOKLIST_SIZE:
 		RETURN_INT(hooklist_size);
@@ -2311,6 +2944,7 @@ char *hookctl (char *input)
 			case HOOKCTL_GET_HOOK_STUFF:
 				if (!set)
 					RETURN_STR(hook->stuff);
+				forget_compiled_block(hook->stuff);
 				new_free (&(hook->stuff));
 				hook->stuff = malloc_strdup(str);
 				RETURN_INT(1);
@@ -2328,6 +2962,7 @@ char *hookctl (char *input)
 				if (!set)
 					RETURN_INT(hook->skip);
 				hook->skip = atol(str) ? 1 : 0;
+				hook_generation++;
 				RETURN_INT(1);
 				break;
 				
@@ -2379,6 +3014,7 @@ char *hookctl (char *input)
 				if (!set)
 					RETURN_INT(hook->flexible);
 				hook->flexible = atol(str) ? 1 : 0;
+				hook_generation++;
 				RETURN_INT(1);
 				break;
 
@@ -2674,6 +3310,80 @@ char *hookctl (char *input)
 		RETURN_INT(1);
 		break;
 
+	/* go-switch */
+	case HOOKCTL_RESETSTATS:
+		hook_stats_reset();
+		RETURN_INT(1);
+		break;
+
+	/* go-switch */
+	case HOOKCTL_STATS:
+	{
+		HookStatsItem *	items;
+		HookStats *	stats;
+		int		count, key, lists;
+
+		str = NULL;
+		if (input && *input)
+			GET_FUNC_ARG(str, input);
+
+		if (str && !my_stricmp(str, "HOOK"))
+		{
+			GET_INT_ARG(userial, input);
+			if (userial == -1 && current_hook)
+				userial = current_hook->userial;
+			if (userial < 0 
+				|| hooklist_size <= userial 
+				|| hooklist[userial] == NULL)
+				RETURN_EMPTY;
+			stats = &hooklist[userial]->stats;
+			malloc_sprintf(&ret, "%lu %lu %f %f %f", 
+				stats->calls, stats->tests, 
+				stats->wall, stats->cpu, stats->max);
+			RETURN_MSTR(ret);
+		}
+		else if (str && !my_stricmp(str, "LIST"))
+		{
+			GET_FUNC_ARG(hookname, input);
+			if ((hooknum = find_hook(hookname, NULL, 1)) == INVALID_HOOKNUM)
+				RETURN_EMPTY;
+			stats = &hook_functions[hooknum].stats;
+			malloc_sprintf(&ret, "%lu %lu %lu %f %f %f", 
+				stats->thrown, stats->calls, stats->tests, 
+				stats->wall, stats->cpu, stats->max);
+			RETURN_MSTR(ret);
+		}
+
+		/* STATS [HOOKS|LISTS] [<sort>] [<count>] */
+		lists = 0;
+		if (str && !my_stricmp(str, "LISTS"))
+			lists = 1;
+		else if (str && my_stricmp(str, "HOOKS"))
+			RETURN_EMPTY;
+
+		str = NULL;
+		if (input && *input)
+			GET_FUNC_ARG(str, input);
+		if (!(key = hook_stats_key(str)))
+			RETURN_EMPTY;
+		tmp_int = -1;
+		if (input && *input)
+			GET_INT_ARG(tmp_int, input);
+
+		items = hook_stats_sorted(lists, key, &count);
+		for (tmp_int2 = 0; tmp_int2 < count; tmp_int2++)
+		{
+			if (tmp_int >= 0 && tmp_int2 >= tmp_int)
+				break;
+			malloc_strcat_wordlist_c(&ret, space, 
+				lists ? hook_functions[items[tmp_int2].id].name
+				      : ltoa(items[tmp_int2].id), &retlen);
+		}
+		new_free((char **)&items);
+		RETURN_MSTR(ret);
+		break;
+	}
+
 	/* go-switch */
 	case HOOKCTL_HALTCHAIN:
 		if (input && *input)
@@ -121,6 +121,14 @@ typedef struct	IgnoreStru
 	Timeval	expiration;		/* When this ignore expires */
 	char	*reason;
 	int	enabled;
+
+	/* For the ignore index (see below) */
+struct	IgnoreStru *index_next;		/* Next one in the same bucket */
+	int	index_type;		/* INDEX_EXACT, INDEX_PREFIX, etc */
+	int	index_len;		/* How much of "nick" is the key */
+	u_32int_t index_hash;		/* Hash of the key */
+	int	position;		/* Where it is in ignored_nicks */
+	unsigned long checked;		/* Last check_ignore_channel() it was in */
 }	Ignore;
 
 /* ignored_nicks: pointer to the head of the ignore list */
@@ -128,6 +136,43 @@ static	Ignore *ignored_nicks = NULL;
 static	int	global_ignore_refnum = 0;
 static	int	ignores_are_suspended = 0;
 
+/*
+ * The ignore index
+ *
+ * Checking every ignore pattern against every message gets slow when you
+ * have thousands of them, and most of them can't possibly match.  So 
+ * each ignore also goes into a hash table, by whatever part of it has to
+ * be there literally in anything it matches:
+ *
+ *   INDEX_EXACT	Patterns with no wildcards at all, by the whole thing
+ *   INDEX_PREFIX	Patterns that start with at least INDEX_KEY_MIN
+ *			plain characters, by their first INDEX_KEY_MIN to 
+ *			INDEX_KEY_MAX characters ("nick!*@*")
+ *   INDEX_SUFFIX	Patterns that end with at least INDEX_KEY_MIN plain
+ *			characters, the same way ("*!*@host.com")
+ *   INDEX_OTHER	Everything else, which goes on ignore_others and
+ *			gets checked every time ("*foo*")
+ *
+ * The keys fold case with tolower(), just like wild_match() does.  To 
+ * check a string, we look up the string itself, each of its prefixes and
+ * suffixes that could be a key, and then take everything on ignore_others.
+ * Those are the only ignores that could match it; they still go through
+ * wild_match() in the same order as ignored_nicks, so the best match 
+ * comes out the same as if we'd looked at every ignore.
+ */
+#define INDEX_EXACT	0
+#define INDEX_PREFIX	1
+#define INDEX_SUFFIX	2
+#define INDEX_OTHER	3
+#define INDEX_KEY_MIN	4
+#define INDEX_KEY_MAX	12
+
+static	Ignore **	ignore_index = NULL;
+static	int		ignore_index_size = 0;	/* A power of two */
+static	int		ignore_index_count = 0;
+static	Ignore *	ignore_others = NULL;
+static	int		ignore_positions_stale = 1;
+
 static void	expire_ignores			(void);
 static const char *	get_ignore_types 		(Ignore *item, int);
 static int	change_ignore_mask_by_desc (const char *type, Mask *do_mask, Mask *dont_mask, char **reason, Timeval *expire);
@@ -137,6 +182,8 @@ static int	foreach_ignore			(const char *, int,
 						 int (*)(Ignore *, int, void *),
 						 int, void *);
 static int	remove_ignore			(const char *);
+static void	index_ignore			(Ignore *);
+static void	unindex_ignore			(Ignore *);
 
 /*****************************************************************************/
 static Ignore *new_ignore (const char *new_nick)
@@ -157,10 +204,21 @@ static Ignore *new_ignore (const char *new_nick)
 	item->expiration.tv_sec = 0;
 	item->expiration.tv_usec = 0;
 	item->enabled = 1;
+	item->checked = 0;
 	add_to_list((List **)&ignored_nicks, (List *)item);
+	index_ignore(item);
 	return item;
 }
 
+/* Ignore destructor -- take it off ignored_nicks first! */
+static void	destroy_ignore (Ignore **item)
+{
+	unindex_ignore(*item);
+	new_free(&((*item)->nick));
+	new_free(&((*item)->reason));
+	new_free((char **)item);
+}
+
 /*
  * get_ignore_by_refnum: When all you have is a refnum, all the world's 
  *			 a linked list...
@@ -183,6 +241,187 @@ static Ignore *get_ignore_by_refnum (int refnum)
 	return NULL;
 }
 
+/****************************************************************************/
+static u_32int_t	ignore_key_hash (int type, const char *str, int len)
+{
+	u_32int_t	h = 2166136261U;	/* FNV-1a */
+	int		i;
+
+	h = (h ^ (u_32int_t)type) * 16777619U;
+	h = (h ^ (u_32int_t)len) * 16777619U;
+	for (i = 0; i < len; i++)
+		h = (h ^ (u_32int_t)tolower((unsigned char)str[i])) * 16777619U;
+	return h;
+}
+
+static void	ignore_index_grow (void)
+{
+	Ignore **	old = ignore_index;
+	int		old_size = ignore_index_size;
+	int		i;
+	Ignore *	item, *next;
+	Ignore **	bucket;
+
+	ignore_index_size = old_size ? old_size * 2 : 256;
+	ignore_index = (Ignore **)new_malloc(sizeof(Ignore *) * ignore_index_size);
+	memset(ignore_index, 0, sizeof(Ignore *) * ignore_index_size);
+
+	for (i = 0; i < old_size; i++)
+	{
+		for (item = old[i]; item; item = next)
+		{
+			next = item->index_next;
+			bucket = &ignore_index[item->index_hash & (ignore_index_size - 1)];
+			item->index_next = *bucket;
+			*bucket = item;
+		}
+	}
+	new_free((char **)&old);
+}
+
+/*
+ * index_ignore: Put an Ignore into the ignore index, according to what
+ *		 kind of pattern its "nick" is.
+ */
+static void	index_ignore (Ignore *item)
+{
+	const char *	p = item->nick;
+	size_t		len = strlen(p);
+	size_t		prefix, suffix;
+	Ignore **	bucket;
+
+	ignore_positions_stale = 1;
+
+	/* How many plain characters are at the start and at the end? */
+	prefix = strcspn(p, "*%?\\");
+	for (suffix = 0; suffix < len; suffix++)
+		if (strchr("*%?\\", p[len - suffix - 1]))
+			break;
+
+	/* Anything with a \ in it could be a \[...\] set */
+	if (strchr(p, '\\'))
+		suffix = 0;
+
+	if (prefix == len)
+	{
+		item->index_type = INDEX_EXACT;
+		item->index_len = len;
+	}
+	else if (prefix >= INDEX_KEY_MIN)
+	{
+		item->index_type = INDEX_PREFIX;
+		item->index_len = MIN(prefix, INDEX_KEY_MAX);
+	}
+	else if (suffix >= INDEX_KEY_MIN)
+	{
+		item->index_type = INDEX_SUFFIX;
+		item->index_len = MIN(suffix, INDEX_KEY_MAX);
+		p += len - item->index_len;
+	}
+	else
+	{
+		item->index_type = INDEX_OTHER;
+		item->index_len = 0;
+		item->index_next = ignore_others;
+		ignore_others = item;
+		return;
+	}
+
+	if (ignore_index_count >= ignore_index_size)
+		ignore_index_grow();
+
+	item->index_hash = ignore_key_hash(item->index_type, p, item->index_len);
+	bucket = &ignore_index[item->index_hash & (ignore_index_size - 1)];
+	item->index_next = *bucket;
+	*bucket = item;
+	ignore_index_count++;
+}
+
+static void	unindex_ignore (Ignore *item)
+{
+	Ignore **	p;
+
+	ignore_positions_stale = 1;
+
+	if (item->index_type == INDEX_OTHER)
+		p = &ignore_others;
+	else
+	{
+		p = &ignore_index[item->index_hash & (ignore_index_size - 1)];
+		ignore_index_count--;
+	}
+
+	for (; *p; p = &(*p)->index_next)
+	{
+		if (*p == item)
+		{
+			*p = item->index_next;
+			break;
+		}
+	}
+	item->index_next = NULL;
+}
+
+static	Ignore **	candidates = NULL;
+static	int		candidates_max = 0;
+static	int		candidates_count = 0;
+static	unsigned long	candidates_serial = 0;
+
+static void	add_candidate (Ignore *item)
+{
+	if (item->checked == candidates_serial)
+		return;
+	item->checked = candidates_serial;
+
+	if (candidates_count == candidates_max)
+	{
+		candidates_max = candidates_max ? candidates_max * 2 : 16;
+		RESIZE(candidates, Ignore *, candidates_max);
+	}
+	candidates[candidates_count++] = item;
+}
+
+static void	add_candidates_from (int type, const char *str, int len)
+{
+	u_32int_t	h = ignore_key_hash(type, str, len);
+	Ignore *	item;
+
+	for (item = ignore_index[h & (ignore_index_size - 1)]; item; 
+			item = item->index_next)
+		if (item->index_hash == h && item->index_type == type &&
+				item->index_len == len)
+			add_candidate(item);
+}
+
+/* Collect every ignore that could possibly match 'str' */
+static void	find_candidates (const char *str)
+{
+	int	len = strlen(str);
+	int	i;
+	Ignore *item;
+
+	if (ignore_index)
+	{
+		add_candidates_from(INDEX_EXACT, str, len);
+		for (i = INDEX_KEY_MIN; i <= INDEX_KEY_MAX && i <= len; i++)
+		{
+			add_candidates_from(INDEX_PREFIX, str, i);
+			add_candidates_from(INDEX_SUFFIX, str + len - i, i);
+		}
+	}
+
+	for (item = ignore_others; item; item = item->index_next)
+		add_candidate(item);
+}
+
+static int	cmp_ignore_position (const void *p1, const void *p2)
+{
+	const Ignore *	i1 = *(Ignore * const *)p1;
+	const Ignore *	i2 = *(Ignore * const *)p2;
+
+	return i1->position - i2->position;
+}
+
 /****************************************************************************/
 /*
  * do_expire_ignores: TIMER callback for when ignores should be reaped
@@ -270,9 +509,7 @@ static int 	remove_ignore (const char *nick)
 
 		    say("%s removed from ignorance list (ignore refnum %d)", 
 				item->nick, item->refnum);
-		    new_free(&(item->nick));
-		    new_free(&(item->reason));
-		    new_free((char **)&item);
+		    destroy_ignore(&item);
 		    return 1;
 		}
 		last = item;
@@ -298,9 +535,7 @@ static int 	remove_ignore (const char *nick)
 	{
 		say("%s removed from ignorance list (ignore refnum %d)", 
 				item->nick, item->refnum);
-		new_free(&(item->nick));
-		new_free(&(item->reason));
-		new_free((char **)&item);
+		destroy_ignore(&item);
 		count++;
 	}
 
@@ -313,9 +548,7 @@ static int 	remove_ignore (const char *nick)
 	{
 		say("%s removed from ignorance list (ignore refnum %d)", 
 				item->nick, item->refnum);
-		new_free(&(item->nick));
-		new_free(&(item->reason));
-		new_free((char **)&item);
+		destroy_ignore(&item);
 		count++;
 	} 
 
@@ -1128,7 +1361,9 @@ char *	ignorectl (char *input)
 		GET_FUNC_ARG(listc, input);
 		len = strlen(listc);
 		if (!my_strnicmp(listc, "NICK", len)) {
+			unindex_ignore(i);
 			malloc_strcpy(&i->nick, input);
+			index_ignore(i);
 			RETURN_INT(i->refnum);
 		} else if (!my_strnicmp(listc, "LEVELS", len)) {
 			mask_unsetall(&i->type);
@@ -1216,6 +1451,7 @@ int	check_ignore_channel (const char *nick, const char *uh, const char *channel,
 {
 	char 	nuh[IRCD_BUFFER_SIZE];
 	Ignore	*tmp;
+	int	i;
 	int	count = 0;
 	int	bestimatch = 0;
 	Ignore	*i_match = NULL;
@@ -1241,8 +1477,29 @@ int	check_ignore_channel (const char *nick, const char *uh, const char *channel,
 						nick ? nick : star,
 						uh ? uh : star);
 
-	for (tmp = ignored_nicks; tmp; tmp = tmp->next)
+	/*
+	 * Only look at the ignores that could match, but look at them in
+	 * the same order as ignored_nicks, so ties come out the same.
+	 */
+	if (ignore_positions_stale)
+	{
+		for (count = 0, tmp = ignored_nicks; tmp; tmp = tmp->next)
+			tmp->position = count++;
+		ignore_positions_stale = 0;
+	}
+
+	candidates_serial++;
+	candidates_count = 0;
+	find_candidates(nuh);
+	if (channel)
+		find_candidates(channel);
+	if (candidates_count > 1)
+		qsort(candidates, candidates_count, sizeof(Ignore *), 
+				cmp_ignore_position);
+
+	for (i = 0; i < candidates_count; i++)
 	{
+		tmp = candidates[i];
 		if (!tmp->enabled)
 			continue;
 
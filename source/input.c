@@ -360,6 +360,9 @@ static	int	recursive = 0;
 	if (!foreground)
 		return;		/* Dont bother */
 
+	if (window_updates_deferred())
+		return;		/* We'll be back when the batch is done */
+
 	recursive = 1;
 	for (screen = screen_list; screen; screen = screen->next)
 	{
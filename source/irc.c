@@ -876,6 +876,7 @@ static	int		level = 0,
 			old_level = 0,
 			last_warn = 0;
 	Timeval		timer;
+	int		deferred;
 
 	level++;
 	get_time(&now);
@@ -972,10 +973,12 @@ static	int		level = 0,
 		redraw_all_screens();
 
 	/* Make sure all the windows and status bars are made current */
+	deferred = suspend_window_updates_deferral();
 	update_all_windows();
 
 	/* Move the cursor back to the input line */
 	cursor_to_input();
+	restore_window_updates_deferral(deferred);
 
 #if 0
 #ifdef __GNUC__
@@ -4228,6 +4228,207 @@ char *	malloc_strdup3 (const char *str1, const char *str2, const char *str3)
 	return buffer;
 }
 
+/*
+ * String interning
+ *
+ * The same nicks and userhosts show up over and over again -- one person
+ * on 40 channels is 40 Nicks, and every line they say goes into the 
+ * lastlog with their nick as the target.  Rather than everybody keeping
+ * their own copy, they can share one copy from here.  Every copy is 
+ * counted, and the string goes away when the last user lets go of it.
+ */
+typedef struct interned_stru
+{
+	struct interned_stru *	next;
+	u_32int_t		hash;
+	int			refcnt;
+	size_t			size;		/* strlen + 1 */
+	char			string[1];	/* Must be last */
+} Interned;
+
+static	Interned **	intern_table = NULL;
+static	int		intern_table_size = 0;	/* A power of two */
+static	int		intern_strings = 0;	/* Unique strings */
+static	long		intern_refs = 0;	/* Users of those strings */
+static	long		intern_bytes = 0;	/* Size of the unique strings */
+static	long		intern_saved = 0;	/* Copies we didn't make */
+
+static u_32int_t	intern_hash (const char *str)
+{
+	u_32int_t	h = 2166136261U;	/* FNV-1a */
+
+	while (*str)
+		h = (h ^ (unsigned char)*str++) * 16777619U;
+	return h;
+}
+
+static void	intern_table_grow (void)
+{
+	Interned **	old = intern_table;
+	int		old_size = intern_table_size;
+	int		i;
+	Interned *	item, *next;
+
+	intern_table_size = old_size ? old_size * 2 : 1024;
+	intern_table = (Interned **)new_malloc(sizeof(Interned *) * 
+						intern_table_size);
+	memset(intern_table, 0, sizeof(Interned *) * intern_table_size);
+
+	for (i = 0; i < old_size; i++)
+	{
+		for (item = old[i]; item; item = next)
+		{
+			next = item->next;
+			item->next = intern_table[item->hash & (intern_table_size - 1)];
+			intern_table[item->hash & (intern_table_size - 1)] = item;
+		}
+	}
+	new_free((char **)&old);
+}
+
+/*
+ * intern_string: Return a shared copy of 'str'
+ *
+ * Arguments:
+ *  'str' - The string to be shared.  May be NULL.
+ *
+ * Return value:
+ *  If 'str' is NULL, then NULL.
+ *  Otherwise, a pointer to a string that is the same as 'str' which is 
+ *	shared with anybody else who has interned the same string.
+ *
+ * Notes:
+ *  You must not change or new_free() the return value!  When you're done 
+ *	with it, pass a pointer to it to release_string() instead.
+ */
+char *	intern_string (const char *str)
+{
+	u_32int_t	h;
+	Interned *	item;
+	size_t		size;
+
+	if (!str)
+		return NULL;
+
+	h = intern_hash(str);
+	if (intern_table)
+	{
+		for (item = intern_table[h & (intern_table_size - 1)]; item;
+				item = item->next)
+		{
+			if (item->hash == h && !strcmp(item->string, str))
+			{
+				item->refcnt++;
+				intern_refs++;
+				intern_saved += item->size;
+				return item->string;
+			}
+		}
+	}
+
+	if (intern_strings >= intern_table_size)
+		intern_table_grow();
+
+	size = strlen(str) + 1;
+	item = (Interned *)new_malloc(offsetof(Interned, string) + size);
+	memcpy(item->string, str, size);
+	item->hash = h;
+	item->refcnt = 1;
+	item->size = size;
+	item->next = intern_table[h & (intern_table_size - 1)];
+	intern_table[h & (intern_table_size - 1)] = item;
+
+	intern_strings++;
+	intern_refs++;
+	intern_bytes += size;
+	return item->string;
+}
+
+/*
+ * release_string: Let go of a string from intern_string()
+ *
+ * Arguments:
+ *  'ptr' - A pointer to a variable holding NULL or a value returned by
+ *		intern_string().  It will be set to NULL.
+ *
+ * Notes:
+ *  This panics if (*ptr) didn't come from intern_string(), because 
+ *	that is a bug and the alternative is to corrupt memory.
+ */
+void	release_string (char **ptr)
+{
+	Interned **	prev;
+	Interned *	item;
+
+	if (!*ptr)
+		return;
+
+	if (intern_table)
+	{
+		for (prev = &intern_table[intern_hash(*ptr) & (intern_table_size - 1)];
+				(item = *prev); prev = &item->next)
+		{
+			if (item->string != *ptr)
+				continue;
+
+			*ptr = NULL;
+			intern_refs--;
+			if (--item->refcnt > 0)
+			{
+				intern_saved -= item->size;
+				return;
+			}
+
+			*prev = item->next;
+			intern_strings--;
+			intern_bytes -= item->size;
+			new_free((char **)&item);
+			return;
+		}
+	}
+
+	panic(1, "release_string: [%s] was not interned", *ptr);
+}
+
+/*
+ * intern_strcpy: Like malloc_strcpy(), but for interned strings
+ *
+ * Arguments:
+ *  'ptr' - A pointer to a variable holding NULL or a value returned by
+ *		intern_string().
+ *  'str' - The new value for (*ptr).  May be NULL.
+ *
+ * Return value:
+ *  The new value of (*ptr), which is an interned copy of 'str', or NULL.
+ */
+char *	intern_strcpy (char **ptr, const char *str)
+{
+	char *	old = *ptr;
+
+	/* Intern the new one first, in case 'str' is the old one */
+	*ptr = intern_string(str);
+	release_string(&old);
+	return *ptr;
+}
+
+/*
+ * intern_stats: Describe the intern table
+ *
+ * Return value:
+ *  A new_malloc()ed string containing five numbers:
+ *	The number of different strings being shared
+ *	The number of users of those strings
+ *	The number of bytes the strings take up
+ *	The number of bytes it would take if everybody had their own copy
+ *	The number of bytes saved (the 4th number minus the 3rd)
+ */
+char *	intern_stats (void)
+{
+	return malloc_sprintf(NULL, "%d %ld %ld %ld %ld", 
+			intern_strings, intern_refs, intern_bytes, 
+			intern_bytes + intern_saved, intern_saved);
+}
+
 /*
  * malloc_strcat2_c: Append a copy of 'str1' and 'str2'' to the end of 
  *	'*ptr', with an optional "clue" (length of (*ptr))
@@ -219,10 +219,7 @@ intmax_t	add_to_lastlog (Window *window, const char *line)
 	new_l->level = who_level;
 	new_l->msg = malloc_strdup(line);
 	new_l->window = window;
-	if (who_from)
-		new_l->target = malloc_strdup(who_from);
-	else
-		new_l->target = NULL;
+	new_l->target = intern_string(who_from);
 
 	time(&new_l->created);
 	if (output_expires_after != 0.0)
@@ -1634,7 +1631,7 @@ static void	remove_lastlog_item (Lastlog *item)
 
 	item->dead = 1;
 	new_free((char **)&item->msg);
-	new_free((char **)&item->target);
+	release_string(&item->target);
 	new_free((char **)&item);
 }
 
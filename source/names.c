@@ -33,6 +33,7 @@
  * SUCH DAMAGE.
  */
 
+#define __need_ci_alist_hash__
 #include "irc.h"
 #include "ircaux.h"
 #include "alist.h"
@@ -45,6 +46,7 @@
 #include "list.h"
 #include "hook.h"
 #include "parse.h"
+#include <math.h>
 
 typedef struct nick_stru
 {
@@ -55,17 +57,48 @@ typedef struct nick_stru
 	short	chanop;		/* True if they are a channel operator */
 	short	voice;		/* 1 if they are, 0 if theyre not, -1 if uk */
 	short	half_assed;	/* 1 if they are, 0 if theyre not, -1 if uk */
+
+struct channel_stru *channel;	/* The channel they're on */
+	u_32int_t index_hash;	/* Hash of their nick and server */
+struct nick_stru *index_next;	/* Next nick in the same nick_index bucket */
+struct nick_stru **index_prev;	/* Whatever points at us in nick_index */
+struct nick_stru *lru_newer;	/* Next one to have spoken after us */
+struct nick_stru *lru_older;	/* Last one to have spoken before us */
 }	Nick;
 
+/*
+ * A channel's nicks.  Small channels keep them in a sorted alist, as 
+ * they always have.  Once a channel grows past NICKLIST_HASH_MIN nicks,
+ * they move into an open-addressed hash table, and "list" becomes a
+ * sorted copy that is only rebuilt when someone wants the nicks in order
+ * (/names, $chanusers() and friends).  Everybody should go through the
+ * nicklist_*() functions rather than touching "list" directly.
+ *
+ * While a channel is syncing, its nicks always go into the hash table, 
+ * so the NAMES burst doesn't have to keep the list sorted as it goes.
+ * When the names are done, small channels get sorted (once) back into
+ * an alist.
+ */
 typedef	struct	nick_list_stru
 {
-	Nick	**list;
-	int	max;
+	Nick	**list;		/* The nicks, in order (see "sorted") */
+	int	max;		/* How many nicks are on the channel */
 	int	max_alloc;
 	alist_func func;
 	hash_type hash;
+
+	Nick	**table;	/* Hash table for big channels, else NULL */
+	int	table_size;	/* Slots in "table" (a power of two) */
+	int	sorted;		/* Is "list" up to date with "table"? */
+
+	Nick *	newest;		/* Who spoke most recently */
+	Nick *	oldest;		/* Who spoke least recently (or never) */
+
+	unsigned long generation;	/* Goes up when a nick comes or goes */
 }	NickList;
 
+#define NICKLIST_HASH_MIN	1000
+
 static	int	current_channel_counter = 0;
 
 /* ChannelList: structure for the list of channels you are current on */
@@ -73,6 +106,7 @@ typedef	struct	channel_stru
 {
 struct	channel_stru *	next;		/* pointer to next channel */
 struct	channel_stru *	prev;		/* pointer to previous channel */
+struct	channel_stru *	hash_next;	/* next channel in the same bucket */
 	char *		channel;	/* channel name */
 	int		server;		/* The server the channel is "on" */
 	int		winref;		/* The window the channel is "on" */
@@ -90,12 +124,44 @@ struct	channel_stru *	prev;		/* pointer to previous channel */
 	char		voice;		/* true if i'm a channel voice */
 	char		half_assed;	/* true if i'm a channel helper */
 	Timeval		join_time;	/* When we joined the channel */
+	unsigned long	serial;		/* When it went on channel_list */
+	int		approximate;	/* 0, or how many nicks we keep */
+	u_char *	hll;		/* Approximate count of everybody */
+
+	/*
+	 * Scripts ask for $chanusers() and $chops() a lot more often than
+	 * the channel changes, so the answers are kept until it does.
+	 */
+	unsigned long	lists_generation; /* The nicks.generation they're for */
+	char *		nick_list;	/* create_nick_list() */
+	char *		chops_list;	/* create_chops_list() */
+	char *		nochops_list;	/* create_nochops_list() */
 }	Channel;
 
 
 /* channel_list: list of all the channels you are currently on */
 static	Channel *	channel_list = NULL;
 
+/*
+ * channel_hash: the same channels, by server and name, for find_channel().
+ * The hash folds case the rfc1459 way (A-Z and []\^) for every server,
+ * which lumps together anything either casemapping would, so a channel 
+ * stays in the right bucket even if the server's CASEMAPPING changes.
+ * server_stricmp() still decides whether two names are the same.
+ */
+#define CHANNEL_HASH_SIZE	512	/* Must be a power of two */
+static	Channel *	channel_hash[CHANNEL_HASH_SIZE];
+static	unsigned long	channel_serial = 0;
+
+/*
+ * nick_index: every Nick on every channel, by server and nick, so that
+ * when someone QUITs or changes their NICK we only have to look at the
+ * channels they're actually on.  It grows as it fills up.
+ */
+static	Nick **		nick_index = NULL;
+static	int		nick_index_size = 0;	/* A power of two */
+static	int		nick_index_count = 0;
+
 static	void	channel_hold_election (int winref);
 
 
@@ -125,15 +191,522 @@ static int	traverse_all_channels (Channel **ptr, int server, int only_this_serve
 }
 
 
+/*
+ *
+ * Nick list maintainance
+ *
+ */
+/*
+ * The hash only looks at the plain ascii part of the nick, folding case
+ * the rfc1459 way, so it never splits up two nicks that either of the 
+ * case mappings (nicks.func) would call the same.
+ */
+static u_32int_t	nicklist_hash_key (const char *nick)
+{
+	u_32int_t	h = 2166136261U;	/* FNV-1a */
+	unsigned char	c;
+
+	while ((c = (unsigned char)*nick++) && c < 0x80)
+	{
+		if (c >= 'A' && c <= '^')
+			c += 'a' - 'A';
+		h = (h ^ c) * 16777619U;
+	}
+	return h;
+}
+
+static u_32int_t	nick_index_key (const char *nick, int server)
+{
+	return nicklist_hash_key(nick) ^ ((u_32int_t)server * 2654435761U);
+}
+
+static void	nick_index_grow (void)
+{
+	Nick **	old = nick_index;
+	int	old_size = nick_index_size;
+	int	i;
+	Nick *	n, *next;
+
+	nick_index_size = old_size ? old_size * 2 : 1024;
+	nick_index = (Nick **)new_malloc(sizeof(Nick *) * nick_index_size);
+	memset(nick_index, 0, sizeof(Nick *) * nick_index_size);
+
+	for (i = 0; i < old_size; i++)
+	{
+		for (n = old[i]; n; n = next)
+		{
+			Nick **	bucket;
+
+			next = n->index_next;
+			bucket = &nick_index[n->index_hash & (nick_index_size - 1)];
+			if ((n->index_next = *bucket))
+				(*bucket)->index_prev = &n->index_next;
+			*bucket = n;
+			n->index_prev = bucket;
+		}
+	}
+	new_free((char **)&old);
+}
+
+/* Put a nick into nick_index -- n->channel must be set already */
+static void	index_nick (Nick *n)
+{
+	Nick **	bucket;
+
+	if (nick_index_count >= nick_index_size)
+		nick_index_grow();
+
+	n->index_hash = nick_index_key(n->nick, n->channel->server);
+	bucket = &nick_index[n->index_hash & (nick_index_size - 1)];
+	if ((n->index_next = *bucket))
+		(*bucket)->index_prev = &n->index_next;
+	*bucket = n;
+	n->index_prev = bucket;
+	nick_index_count++;
+}
+
+static void	unindex_nick (Nick *n)
+{
+	if (!n->index_prev)
+		return;
+	if ((*n->index_prev = n->index_next))
+		n->index_next->index_prev = n->index_prev;
+	n->index_next = NULL;
+	n->index_prev = NULL;
+	nick_index_count--;
+}
+
+/* Nick destructor -- take it out of nick_index first! */
+static void	free_nick (Nick **n)
+{
+	release_string(&(*n)->nick);
+	release_string(&(*n)->userhost);
+	new_free((char **)n);
+}
+
+static int	cmp_nick_serial (const void *p1, const void *p2)
+{
+	const Nick *	n1 = *(Nick * const *)p1;
+	const Nick *	n2 = *(Nick * const *)p2;
+
+	if (n1->channel->serial == n2->channel->serial)
+		return 0;
+	return n1->channel->serial > n2->channel->serial ? -1 : 1;
+}
+
+/*
+ * find_nick_everywhere: Find "nick" on every channel on "server".
+ *	Returns how many channels they're on, and if that's not zero, sets
+ *	"*nicks" to a new_malloc()ed array of their Nicks, in channel_list
+ *	order (so you get the same answer that traverse_all_channels() 
+ *	would have given you).  The caller must new_free() it.
+ */
+static int	find_nick_everywhere (const char *nick, int server, Nick ***nicks)
+{
+	u_32int_t	h;
+	Nick *		n;
+	int		cnt = 0, max = 0;
+
+	*nicks = NULL;
+	if (!nick_index || server == NOSERV)
+		return 0;
+
+	h = nick_index_key(nick, server);
+	for (n = nick_index[h & (nick_index_size - 1)]; n; n = n->index_next)
+	{
+		if (n->index_hash != h || n->channel->server != server)
+			continue;
+		if (n->channel->nicks.func(n->nick, nick, UINT_MAX))
+			continue;
+
+		if (cnt == max)
+		{
+			max = max ? max * 2 : 8;
+			RESIZE(*nicks, Nick *, max);
+		}
+		(*nicks)[cnt++] = n;
+	}
+
+	if (cnt > 1)
+		qsort(*nicks, cnt, sizeof(Nick *), cmp_nick_serial);
+	return cnt;
+}
+
+/*
+ * A channel's nicks are also kept in the order they last said something,
+ * from nl->newest to nl->oldest.  New nicks go on the oldest end, since
+ * they haven't said anything yet.  This decides who an approximate 
+ * channel (see below) forgets first.
+ */
+static void	nicklist_lru_unlink (NickList *nl, Nick *n)
+{
+	if (n->lru_newer)
+		n->lru_newer->lru_older = n->lru_older;
+	else
+		nl->newest = n->lru_older;
+
+	if (n->lru_older)
+		n->lru_older->lru_newer = n->lru_newer;
+	else
+		nl->oldest = n->lru_newer;
+
+	n->lru_newer = n->lru_older = NULL;
+}
+
+/* Put "n" just after "newer", or at the newest end if "newer" is NULL */
+static void	nicklist_lru_insert (NickList *nl, Nick *n, Nick *newer)
+{
+	n->lru_newer = newer;
+	n->lru_older = newer ? newer->lru_older : nl->newest;
+
+	if (n->lru_newer)
+		n->lru_newer->lru_older = n;
+	else
+		nl->newest = n;
+
+	if (n->lru_older)
+		n->lru_older->lru_newer = n;
+	else
+		nl->oldest = n;
+}
+
+static void	nicklist_lru_touch (NickList *nl, Nick *n)
+{
+	if (nl->newest == n)
+		return;
+	nicklist_lru_unlink(nl, n);
+	nicklist_lru_insert(nl, n, NULL);
+}
+
+static int	nicklist_slot (NickList *nl, const char *nick)
+{
+	u_32int_t	mask = nl->table_size - 1;
+	u_32int_t	i;
+
+	for (i = nicklist_hash_key(nick) & mask; nl->table[i]; i = (i + 1) & mask)
+		if (!nl->func(nl->table[i]->nick, nick, UINT_MAX))
+			break;
+	return i;
+}
+
+static void	nicklist_grow_table (NickList *nl, int size)
+{
+	Nick **	old = nl->table;
+	int	old_size = nl->table_size;
+	int	i;
+
+	nl->table = (Nick **)new_malloc(sizeof(Nick *) * size);
+	memset(nl->table, 0, sizeof(Nick *) * size);
+	nl->table_size = size;
+
+	for (i = 0; i < old_size; i++)
+		if (old[i])
+			nl->table[nicklist_slot(nl, old[i]->nick)] = old[i];
+	new_free((char **)&old);
+}
+
+/* Move a big channel out of the alist and into a hash table */
+static void	nicklist_make_table (NickList *nl)
+{
+	int	size, i, j;
+
+	for (size = 64; size < nl->max * 4; size *= 2)
+		;
+	nl->table = (Nick **)new_malloc(sizeof(Nick *) * size);
+	memset(nl->table, 0, sizeof(Nick *) * size);
+	nl->table_size = size;
+
+	/*
+	 * The alist's hash only folds a-z, so with rfc1459 casemapping it 
+	 * can hold both "a[" and "A{".  They are the same nick, so only the
+	 * first one gets to stay.
+	 */
+	for (i = j = 0; i < nl->max; i++)
+	{
+		Nick *	n = nl->list[i];
+		int	slot = nicklist_slot(nl, n->nick);
+
+		if (nl->table[slot])
+		{
+			unindex_nick(n);
+			nicklist_lru_unlink(nl, n);
+			free_nick(&n);
+			continue;
+		}
+		nl->table[slot] = n;
+		nl->list[j++] = n;
+	}
+	nl->max = j;
+
+	/* The alist is already in order, so it stays as the sorted copy */
+	nl->sorted = 1;
+}
+
+static Nick *	nicklist_find (NickList *nl, const char *nick)
+{
+	int	cnt, loc;
+	Nick *	n;
+
+	if (nl->table)
+		return nl->table[nicklist_slot(nl, nick)];
+
+	n = (Nick *)find_array_item((array *)nl, nick, &cnt, &loc);
+	if (cnt >= 0 || !n)
+		return NULL;
+	return n;
+}
+
+/*
+ * Displaced nicks get thrown out of nick_index, and the new one takes 
+ * their place in line.
+ */
+static void	nicklist_displace (NickList *nl, Nick *n, Nick *old)
+{
+	if (old)
+	{
+		unindex_nick(old);
+		nicklist_lru_insert(nl, n, old);
+		nicklist_lru_unlink(nl, old);
+	}
+	else
+		nicklist_lru_insert(nl, n, nl->oldest);
+}
+
+/*
+ * Add a nick to the list.  If there is already a nick by that name, it
+ * is displaced and returned to the caller to get rid of.
+ */
+static Nick *	nicklist_add (NickList *nl, Nick *n)
+{
+	u_32int_t	mask;
+	Nick *		old;
+	int		i;
+
+	index_nick(n);
+	if (!nl->table)
+	{
+		old = (Nick *)add_to_array((array *)nl, (array_item *)n);
+		nicklist_displace(nl, n, old);
+		nl->generation++;
+		if (nl->max > NICKLIST_HASH_MIN)
+			nicklist_make_table(nl);
+		return old;
+	}
+
+	/* Keep the table at most half full */
+	if ((nl->max + 1) * 2 > nl->table_size)
+		nicklist_grow_table(nl, nl->table_size * 2);
+
+	n->hash = ci_alist_hash(n->nick, &mask);	/* For sorting */
+	i = nicklist_slot(nl, n->nick);
+	if ((old = nl->table[i]) == NULL)
+		nl->max++;
+	nicklist_displace(nl, n, old);
+	nl->table[i] = n;
+	nl->generation++;
+	nl->sorted = 0;
+	return old;
+}
+
+/* Take a nick off the list and return it (or NULL if it isn't there) */
+static Nick *	nicklist_remove (NickList *nl, const char *nick)
+{
+	u_32int_t	mask;
+	Nick *		n;
+	int		i, j, k;
+
+	if (!nl->table)
+	{
+		if ((n = (Nick *)remove_from_array((array *)nl, nick)))
+		{
+			unindex_nick(n);
+			nicklist_lru_unlink(nl, n);
+			nl->generation++;
+		}
+		return n;
+	}
+
+	i = nicklist_slot(nl, nick);
+	if (!(n = nl->table[i]))
+		return NULL;
+	unindex_nick(n);
+	nicklist_lru_unlink(nl, n);
+
+	/* 
+	 * Backward shift deletion: pull up anything after the hole that
+	 * would not be able to find its way past it any more.
+	 */
+	mask = nl->table_size - 1;
+	for (j = (i + 1) & mask; nl->table[j]; j = (j + 1) & mask)
+	{
+		k = nicklist_hash_key(nl->table[j]->nick) & mask;
+		if (((j - k) & mask) >= ((j - i) & mask))
+		{
+			nl->table[i] = nl->table[j];
+			i = j;
+		}
+	}
+	nl->table[i] = NULL;
+	nl->max--;
+	nl->sorted = 0;
+	nl->generation++;
+	return n;
+}
+
+static alist_func	nicklist_sort_func;
+
+/* The same order add_to_array() would have put them in */
+static int	nicklist_sort_cmp (const void *p1, const void *p2)
+{
+	const Nick *	n1 = *(Nick * const *)p1;
+	const Nick *	n2 = *(Nick * const *)p2;
+
+	if (n1->hash != n2->hash)
+		return n1->hash < n2->hash ? -1 : 1;
+	return nicklist_sort_func(n1->nick, n2->nick, UINT_MAX);
+}
+
+/*
+ * Returns the nicks in order (there are "nl->max" of them).  For big 
+ * channels, the sorted copy is rebuilt here if anything has changed 
+ * since the last time someone asked.
+ */
+static Nick **	nicklist_sorted (NickList *nl)
+{
+	int	i, cnt;
+
+	if (!nl->table || nl->sorted)
+		return nl->list;
+
+	/* add_to_array() wants at least one spare slot */
+	if (nl->max_alloc <= nl->max)
+	{
+		nl->max_alloc = nl->max + nl->max / 4 + 6;
+		RESIZE(nl->list, Nick *, nl->max_alloc);
+	}
+
+	for (i = cnt = 0; i < nl->table_size; i++)
+		if (nl->table[i])
+			nl->list[cnt++] = nl->table[i];
+
+	nicklist_sort_func = nl->func;
+	qsort(nl->list, cnt, sizeof(Nick *), nicklist_sort_cmp);
+	nl->sorted = 1;
+	return nl->list;
+}
+
+/* Start of a NAMES burst -- put everything in the hash table for now */
+static void	nicklist_begin_bulk (NickList *nl)
+{
+	if (!nl->table && nl->max == 0)
+		nicklist_make_table(nl);
+}
+
+/* End of the NAMES burst -- small channels go back to being an alist */
+static void	nicklist_end_bulk (NickList *nl)
+{
+	if (!nl->table || nl->max > NICKLIST_HASH_MIN)
+		return;
+
+	nicklist_sorted(nl);
+	new_free((void **)&nl->table);
+	nl->table_size = 0;
+	nl->sorted = 0;
+}
+
+static void	nicklist_clear (NickList *nl)
+{
+	Nick **	nicks = nicklist_sorted(nl);
+	int	i;
+
+	for (i = 0; i < nl->max; i++)
+	{
+		unindex_nick(nicks[i]);
+		free_nick(&nicks[i]);
+	}
+	new_free((void **)&nl->list);
+	new_free((void **)&nl->table);
+	nl->max = nl->max_alloc = 0;
+	nl->table_size = 0;
+	nl->sorted = 0;
+	nl->newest = nl->oldest = NULL;
+	nl->generation++;
+}
+
+
 /*
  *
  * Channel maintainance
  *
  */
+static u_32int_t	channel_hash_key (const char *name, int server)
+{
+	u_32int_t	h = 2166136261U;	/* FNV-1a */
+	unsigned char	c;
+
+	h = (h ^ (u_32int_t)server) * 16777619U;
+	while ((c = (unsigned char)*name++))
+	{
+		if (c >= 'A' && c <= '^')
+			c += 'a' - 'A';
+		h = (h ^ c) * 16777619U;
+	}
+	return h & (CHANNEL_HASH_SIZE - 1);
+}
+
+/* Put a channel on channel_list and into channel_hash */
+static void	link_channel (Channel *chan)
+{
+	u_32int_t	i = channel_hash_key(chan->channel, chan->server);
+
+	chan->hash_next = channel_hash[i];
+	channel_hash[i] = chan;
+	chan->serial = ++channel_serial;
+
+	chan->prev = NULL;
+	chan->next = channel_list;
+	if (channel_list)
+		channel_list->prev = chan;
+	channel_list = chan;
+}
+
+/* Take a channel off channel_list and out of channel_hash */
+static void	unlink_channel (Channel *chan)
+{
+	Channel **	p;
+
+	for (p = &channel_hash[channel_hash_key(chan->channel, chan->server)];
+			*p; p = &(*p)->hash_next)
+	{
+		if (*p == chan)
+		{
+			*p = chan->hash_next;
+			break;
+		}
+	}
+	chan->hash_next = NULL;
+
+	if (chan != channel_list)
+	{
+		if (!chan->prev)
+			panic(1, "chan != channel_list, but chan->prev is NULL");
+		chan->prev->next = chan->next;
+	}
+	else
+	{
+		if (chan->prev)
+			panic(1, "channel_list->prev is not NULL");
+		channel_list = chan->next;
+	}
+
+	if (chan->next)
+		chan->next->prev = chan->prev;
+	chan->next = chan->prev = NULL;
+}
 
 static Channel *find_channel (const char *channel, int server)
 {
-	Channel *ch = NULL;
+	Channel *ch;
 
 	if (server == NOSERV)
 		server = primary_server;
@@ -143,8 +716,10 @@ static Channel *find_channel (const char *channel, int server)
 		if (!(channel = get_echannel_by_refnum(0)))
 			return NULL;		/* sb colten */
 
-	while (traverse_all_channels(&ch, server, 1))
-	    if (!server_stricmp(ch->channel, channel, server))
+	for (ch = channel_hash[channel_hash_key(channel, server)]; ch; 
+			ch = ch->hash_next)
+	    if (ch->server == server && 
+			!server_stricmp(ch->channel, channel, server))
 		return ch;
 
 	return NULL;
@@ -155,7 +730,7 @@ static Channel *create_channel (const char *name, int server)
 {
 	Channel *new_c = (Channel *)new_malloc(sizeof(Channel));
 
-	new_c->prev = new_c->next = NULL;
+	new_c->prev = new_c->next = new_c->hash_next = NULL;
 	new_c->channel = malloc_strdup(name);
 	new_c->server = server;
 	new_c->waiting = 0;
@@ -167,6 +742,17 @@ static Channel *create_channel (const char *name, int server)
 	else
 		new_c->nicks.func = (alist_func) rfc1459_strnicmp;
 	new_c->nicks.hash = HASH_INSENSITIVE;
+	new_c->nicks.table = NULL;
+	new_c->nicks.table_size = 0;
+	new_c->nicks.sorted = 0;
+	new_c->nicks.newest = new_c->nicks.oldest = NULL;
+	new_c->nicks.generation = 1;
+	new_c->lists_generation = 0;
+	new_c->nick_list = NULL;
+	new_c->chops_list = NULL;
+	new_c->nochops_list = NULL;
+	new_c->approximate = 0;
+	new_c->hll = NULL;
 
 	new_c->base_modes[0] = 0;
 	new_c->modestr = NULL;
@@ -176,27 +762,14 @@ static Channel *create_channel (const char *name, int server)
 	new_c->voice = 0;
 	new_c->half_assed = 0;
 
-	new_c->next = channel_list;
-	if (channel_list)
-		channel_list->prev = new_c;
-	channel_list = new_c;
+	link_channel(new_c);
 	return new_c;
 }
 
 /* Nicklist destructor */
 static void 	clear_channel (Channel *chan)
 {
-	NickList *list = &chan->nicks;
-	int	i;
-
-	for (i = 0; i < list->max; i++)
-	{
-		new_free(&list->list[i]->nick);
-		new_free(&list->list[i]->userhost);
-		new_free(&list->list[i]);
-	}
-	new_free((void **)&list->list);
-	list->max = list->max_alloc = 0;
+	nicklist_clear(&chan->nicks);
 }
 
 /* Channel destructor -- caller must free "chan". */
@@ -206,22 +779,7 @@ static void 	destroy_channel (Channel *chan)
 	Char *	new_current_channel;
 
 	is_current_now = is_current_channel(chan->channel, chan->server);
-
-	if (chan != channel_list)
-	{
-		if (!chan->prev)
-			panic(1, "chan != channel_list, but chan->prev is NULL");
-		chan->prev->next = chan->next;
-	}
-	else
-	{
-		if (chan->prev)
-			panic(1, "channel_list->prev is not NULL");
-		channel_list = chan->next;
-	}
-
-	if (chan->next)
-		chan->next->prev = chan->prev;
+	unlink_channel(chan);
 
 	/*
 	 * If we are a current window, then we will no longer be so;
@@ -242,8 +800,14 @@ static void 	destroy_channel (Channel *chan)
 	chan->server = NOSERV;
 	chan->winref = -1;
 
-	if (chan->nicks.max_alloc)
+	if (chan->nicks.max_alloc || chan->nicks.table)
 		clear_channel(chan);
+	new_free((char **)&chan->hll);
+	chan->approximate = 0;
+	new_free(&chan->nick_list);
+	new_free(&chan->chops_list);
+	new_free(&chan->nochops_list);
+	chan->lists_generation = 0;
 
 	new_free(&chan->modestr);
 	chan->limit = 0;
@@ -267,11 +831,13 @@ void 	add_channel (const char *name, int server)
 		destroy_channel(new_c);
 		malloc_strcpy(&(new_c->channel), name);
 		new_c->server = server;
+		link_channel(new_c);
 	}
 	else
 		new_c = create_channel(name, server);
 
 	new_c->waiting = 1;		/* This channel is "syncing" */
+	nicklist_begin_bulk(&new_c->nicks);
 	get_time(&new_c->join_time);
 
 	if (was_window == -1)
@@ -328,19 +894,126 @@ void 	remove_channel (const char *channel, int server)
 
 /*
  *
- * Nickname maintainance
+ * Approximate channels
+ *
+ * Twitch stops sending JOINs and PARTs for channels with more than 1000
+ * people in them, so past some point there's no use trying to keep track
+ * of everybody.  Once a channel has more than /SET APPROXIMATE_CHANNEL_SIZE
+ * nicks, it only keeps that many of them -- whoever spoke most recently.
+ * Everybody else is only counted, in a HyperLogLog sketch, which can 
+ * tell about how many different nicks it has seen (give or take 3%) in 
+ * HLL_REGISTERS bytes.  Nobody ever gets taken out of the count.
  *
  */
-static Nick *	find_nick_on_channel (Channel *ch, const char *nick)
+#define HLL_BITS	10
+#define HLL_REGISTERS	(1 << HLL_BITS)
+
+static u_32int_t	hll_hash (const char *nick)
 {
-	int cnt, loc;
-	Nick *new_n = (Nick *)find_array_item((array *)&ch->nicks,
-						nick, &cnt, &loc);
+	u_32int_t	h = 2166136261U;	/* FNV-1a */
+	unsigned char	c;
 
-	if (cnt >= 0 || !new_n)
-		return NULL;
+	while ((c = (unsigned char)*nick++))
+	{
+		if (c >= 'A' && c <= '^')
+			c += 'a' - 'A';
+		h = (h ^ c) * 16777619U;
+	}
 
-	return new_n;
+	/* FNV doesn't mix the high bits well enough for this */
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h & 0xFFFFFFFFU;
+}
+
+/*
+ * The top HLL_BITS of the hash pick a register, which remembers the 
+ * longest run of leading zeros (plus one) it has seen in the rest.
+ */
+static void	hll_add (u_char *regs, const char *nick)
+{
+	u_32int_t	h = hll_hash(nick);
+	u_32int_t	bit = 1U << (31 - HLL_BITS);
+	u_char		rank = 1;
+
+	while (bit && !(h & bit))
+	{
+		rank++;
+		bit >>= 1;
+	}
+	if (regs[h >> (32 - HLL_BITS)] < rank)
+		regs[h >> (32 - HLL_BITS)] = rank;
+}
+
+static int	hll_count (const u_char *regs)
+{
+	double	sum = 0, estimate;
+	int	i, zeros = 0;
+
+	for (i = 0; i < HLL_REGISTERS; i++)
+	{
+		sum += ldexp(1.0, -(int)regs[i]);
+		if (regs[i] == 0)
+			zeros++;
+	}
+
+	estimate = 0.7213 / (1 + 1.079 / HLL_REGISTERS) * 
+			HLL_REGISTERS * HLL_REGISTERS / sum;
+
+	/* Small counts come out better by counting the empty registers */
+	if (estimate <= 2.5 * HLL_REGISTERS && zeros)
+		estimate = HLL_REGISTERS * log((double)HLL_REGISTERS / zeros);
+
+	return (int)(estimate + 0.5);
+}
+
+/* Forget whoever spoke least recently until we're back down to size */
+static void	channel_trim (Channel *chan)
+{
+	Nick *	n;
+
+	while (chan->nicks.max > chan->approximate && (n = chan->nicks.oldest))
+	{
+		/* We never forget ourselves */
+		if (is_me(chan->server, n->nick))
+		{
+			nicklist_lru_touch(&chan->nicks, n);
+			continue;
+		}
+
+		if ((n = nicklist_remove(&chan->nicks, n->nick)))
+			free_nick(&n);
+	}
+}
+
+static void	channel_make_approximate (Channel *chan, int size)
+{
+	Nick *	n;
+
+	chan->hll = (u_char *)new_malloc(HLL_REGISTERS);
+	memset(chan->hll, 0, HLL_REGISTERS);
+	for (n = chan->nicks.newest; n; n = n->lru_older)
+		hll_add(chan->hll, n->nick);
+
+	chan->approximate = size;
+	channel_trim(chan);
+
+	if (x_debug & DEBUG_CHANNELS)
+		yell("Channel [%s] on server [%d] is now approximate (keeping %d)",
+			chan->channel, chan->server, size);
+}
+
+/*
+ *
+ * Nickname maintainance
+ *
+ */
+static Nick *	find_nick_on_channel (Channel *ch, const char *nick)
+{
+	return nicklist_find(&ch->nicks, nick);
 }
 
 static Nick *	find_nick (int server, const char *channel, const char *nick)
@@ -361,6 +1034,7 @@ static Nick *	find_nick (int server, const char *channel, const char *nick)
  */
 static Nick *	find_suspicious_on_channel (Channel *ch, const char *nick)
 {
+	Nick **	nicks = nicklist_sorted(&ch->nicks);
 	int	pos;
 
 	/*
@@ -368,7 +1042,7 @@ static Nick *	find_suspicious_on_channel (Channel *ch, const char *nick)
 	 */
 	for (pos = 0; pos < ch->nicks.max; pos++)
 	{
-		Nick *	n = ch->nicks.list[pos];
+		Nick *	n = nicks[pos];
 		char *	s = n->nick;
 		size_t	siz = strlen(s);
 
@@ -395,6 +1069,25 @@ static Nick *	find_suspicious_on_channel (Channel *ch, const char *nick)
 
 
 
+/* Nick constructor */
+static Nick *	create_nick (Channel *chan, const char *nick, int suspicious, int chanop, int voice, int half_assed)
+{
+	Nick *	new_n = (Nick *)new_malloc(sizeof(Nick));
+
+	new_n->channel = chan;
+	new_n->index_next = NULL;
+	new_n->index_prev = NULL;
+	new_n->lru_newer = NULL;
+	new_n->lru_older = NULL;
+	new_n->nick = intern_string(nick);
+	new_n->userhost = NULL;
+	new_n->suspicious = suspicious;
+	new_n->chanop = chanop;
+	new_n->voice = voice;
+	new_n->half_assed = half_assed;
+	return new_n;
+}
+
 /*
  * add_to_channel: adds the given nickname to the given channel.  If the
  * nickname is already on the channel, nothing happens.  If the channel is
@@ -408,6 +1101,7 @@ void 	add_to_channel (const char *channel, const char *nick, int server, int sus
 	int	ischop = oper;
 	int	isvoice = voice;
 	int	half_assed = ha;
+	int	size;
 const	char	*prefix;
 
 	if (!(chan = find_channel(channel, server)))
@@ -472,19 +1166,21 @@ const	char	*prefix;
 		}
 	}
 
-	new_n = (Nick *)new_malloc(sizeof(Nick));
-	new_n->nick = malloc_strdup(nick);
-	new_n->userhost = NULL;
-	new_n->suspicious = suspicious;
-	new_n->chanop = ischop;
-	new_n->voice = isvoice;
-	new_n->half_assed = half_assed;
-
-	if ((old = (Nick *)add_to_array((array *)&chan->nicks, (array_item *)new_n)))
+	/* Approximate channels just count people until they say something */
+	if (chan->hll)
 	{
-		new_free(&old->nick);
-		new_free(&old->userhost);
+		hll_add(chan->hll, nick);
+		if (!is_me(server, nick) && !find_nick_on_channel(chan, nick))
+			return;
 	}
+
+	new_n = create_nick(chan, nick, suspicious, ischop, isvoice, half_assed);
+	if ((old = nicklist_add(&chan->nicks, new_n)))
+		free_nick(&old);
+
+	if (!chan->hll && (size = get_int_var(APPROXIMATE_CHANNEL_SIZE_VAR)) > 0
+			&& chan->nicks.max > size)
+		channel_make_approximate(chan, size);
 }
 
 void 	add_userhost_to_channel (const char *channel, const char *nick, int server, const char *uh)
@@ -503,6 +1199,10 @@ void 	add_userhost_to_channel (const char *channel, const char *nick, int server
 	if (!(chan = find_channel(channel, server)))
 		return;		/* Oh well.  Time to punt. */
 
+	/* Approximate channels don't know everybody, and that's ok. */
+	if (chan->hll && !find_nick_on_channel(chan, nick))
+		return;
+
 	while (!(new_n = find_nick_on_channel(chan, nick)))
 	{
 		if (!(new_n = find_suspicious_on_channel(chan, nick)))
@@ -519,9 +1219,9 @@ void 	add_userhost_to_channel (const char *channel, const char *nick, int server
 		 */
 		else
 		{
-		    remove_from_array((array *)&chan->nicks, new_n->nick);
-		    malloc_strcpy(&new_n->nick, nick);
-		    add_to_array((array *)&chan->nicks, (array_item *)new_n);
+		    nicklist_remove(&chan->nicks, new_n->nick);
+		    intern_strcpy(&new_n->nick, nick);
+		    nicklist_add(&chan->nicks, new_n);
 		    if (x_debug & DEBUG_CHANNELS)
 		    {
 			yell("Detected and corrected a nickname mangled by "
@@ -538,10 +1238,40 @@ void 	add_userhost_to_channel (const char *channel, const char *nick, int server
 		}
 	}
 
-	malloc_strcpy(&new_n->userhost, uh);
+	intern_strcpy(&new_n->userhost, uh);
 }
 
 
+/*
+ * channel_saw_speaker: "nick" said something on "channel".  They move to
+ * the front of the line of people an approximate channel remembers, and
+ * if it had forgotten them (or never knew them), it knows them again.
+ */
+void	channel_saw_speaker (const char *channel, const char *nick, int server, const char *uh)
+{
+	Channel *chan;
+	Nick *	n;
+
+	if (!(chan = find_channel(channel, server)))
+		return;
+
+	if ((n = find_nick_on_channel(chan, nick)))
+	{
+		nicklist_lru_touch(&chan->nicks, n);
+		return;
+	}
+
+	if (!chan->hll)
+		return;
+
+	hll_add(chan->hll, nick);
+	n = create_nick(chan, nick, 0, 0, -1, -1);
+	intern_strcpy(&n->userhost, uh);
+	nicklist_add(&chan->nicks, n);
+	nicklist_lru_touch(&chan->nicks, n);
+	channel_trim(chan);
+}
+
 /*
  * remove_from_channel: removes the given nickname from the given channel. If
  * the nickname is not on the channel or the channel doesn't exist, nothing
@@ -551,21 +1281,33 @@ void 	remove_from_channel (const char *channel, const char *nick, int server)
 {
 	Channel *chan = NULL;
 	Nick	*tmp;
+	Nick	**nicks;
+	int	i, cnt;
 
 	if (server == NOSERV) return;
 
+	/* They QUIT -- nick_index knows which channels they were on */
+	if (!channel)
+	{
+		cnt = find_nick_everywhere(nick, server, &nicks);
+		for (i = 0; i < cnt; i++)
+		{
+			chan = nicks[i]->channel;
+			if ((tmp = nicklist_remove(&chan->nicks, nicks[i]->nick)))
+				free_nick(&tmp);
+		}
+		new_free((char **)&nicks);
+		return;
+	}
+
 	while (traverse_all_channels(&chan, server, 1))
 	{
 		/* This is correct, dont change it! */
 		if (channel && server_stricmp(channel, chan->channel, server))
 			continue;
 
-		if ((tmp = (Nick *)remove_from_array((array *)&chan->nicks, nick)))
-		{
-			new_free(&tmp->nick);
-			new_free(&tmp->userhost); /* Da5id reported mf here */
-			new_free((char **)&tmp);
-		}
+		if ((tmp = nicklist_remove(&chan->nicks, nick)))
+			free_nick(&tmp);	/* Da5id reported mf here */
 	}
 }
 
@@ -576,20 +1318,33 @@ void 	remove_from_channel (const char *channel, const char *nick, int server)
  */
 void 	rename_nick (const char *old_nick, const char *new_nick, int server)
 {
-	Channel *chan = NULL;
-	Nick	*tmp;
+	Channel *chan;
+	Nick	*tmp, *old, *newer;
+	Nick	**nicks;
+	int	i, cnt;
 
 	if (server == NOSERV) return;		/* Sanity check */
 
-	while (traverse_all_channels(&chan, server, 1))
+	cnt = find_nick_everywhere(old_nick, server, &nicks);
+	for (i = 0; i < cnt; i++)
 	{
-		if ((tmp = (Nick *)remove_from_array((array *)&chan->nicks, old_nick)))
+		chan = nicks[i]->channel;
+		newer = nicks[i]->lru_newer;
+		if ((tmp = nicklist_remove(&chan->nicks, nicks[i]->nick)))
 		{
-			malloc_strcpy(&tmp->nick, new_nick);
-			malloc_strcpy(&tmp->userhost, FromUserHost);
-			add_to_array((array *)&chan->nicks, (array_item *)tmp);
+			intern_strcpy(&tmp->nick, new_nick);
+			intern_strcpy(&tmp->userhost, FromUserHost);
+			if ((old = nicklist_add(&chan->nicks, tmp)))
+				free_nick(&old);
+			else
+			{
+				/* They keep their place in line */
+				nicklist_lru_unlink(&chan->nicks, tmp);
+				nicklist_lru_insert(&chan->nicks, tmp, newer);
+			}
 		}
 	}
+	new_free((char **)&nicks);
 }
 
 
@@ -651,64 +1406,92 @@ int	number_on_channel (const char *name, int server)
 {
 	Channel *channel = find_channel(name, server);
 
-	if (channel)
-		return channel->nicks.max;
-	else
+	if (!channel)
 		return 0;
+	if (channel->hll)
+		return MAX(channel->nicks.max, hll_count(channel->hll));
+	return channel->nicks.max;
 }
 
-char	*create_nick_list (const char *name, int server)
+/*
+ * Throw out the cached nick lists if the channel has changed since they
+ * were made.
+ */
+static void	check_channel_lists (Channel *channel)
 {
-	Channel *channel = find_channel(name, server);
+	if (channel->lists_generation == channel->nicks.generation)
+		return;
+
+	new_free(&channel->nick_list);
+	new_free(&channel->chops_list);
+	new_free(&channel->nochops_list);
+	channel->lists_generation = channel->nicks.generation;
+}
+
+/*
+ * Make a list of the nicks on "channel" that are chanops (chops == 1),
+ * aren't (chops == 0), or everybody (chops == -1).  This is the slow 
+ * way; the create_*_list() functions only do it when they have to.
+ */
+static char *	make_nick_list (Channel *channel, int chops)
+{
+	Nick	**nicks;
 	char 	*str = NULL;
 	int 	i;
 	size_t	clue = 0;
 
+	nicks = nicklist_sorted(&channel->nicks);
+	for (i = 0; i < channel->nicks.max; i++)
+	    if (chops == -1 || !nicks[i]->chanop == !chops)
+		malloc_strcat_word_c(&str, space, nicks[i]->nick, DWORD_NO, &clue);
+
+	if (!str)
+		return malloc_strdup(empty_string);
+	return str;
+}
+
+char	*create_nick_list (const char *name, int server)
+{
+	Channel *channel = find_channel(name, server);
+
 	if (!channel)
 		return NULL;
 
-	for (i = 0; i < channel->nicks.max; i++)
-		malloc_strcat_word_c(&str, space, channel->nicks.list[i]->nick, DWORD_NO, &clue);
+	check_channel_lists(channel);
+	if (!channel->nick_list)
+		channel->nick_list = make_nick_list(channel, -1);
 
-	return str;
+	if (!*channel->nick_list)
+		return NULL;
+	return malloc_strdup(channel->nick_list);
 }
 
 char	*create_chops_list (const char *name, int server)
 {
 	Channel *channel = find_channel(name, server);
-	char 	*str = NULL;
-	int 	i;
-	size_t	clue = 0;
 
 	if (!channel)
 		return malloc_strdup(empty_string);
 
-	for (i = 0; i < channel->nicks.max; i++)
-	    if (channel->nicks.list[i]->chanop)
-		malloc_strcat_word_c(&str, space, channel->nicks.list[i]->nick, DWORD_NO, &clue);
+	check_channel_lists(channel);
+	if (!channel->chops_list)
+		channel->chops_list = make_nick_list(channel, 1);
 
-	if (!str)
-		return malloc_strdup(empty_string);
-	return str;
+	return malloc_strdup(channel->chops_list);
 }
 
 char	*create_nochops_list (const char *name, int server)
 {
 	Channel *channel = find_channel(name, server);
-	char 	*str = NULL;
-	int 	i;
-	size_t	clue = 0;
 
 	if (!channel)
 		return malloc_strdup(empty_string);
 
-	for (i = 0; i < channel->nicks.max; i++)
-	    if (!channel->nicks.list[i]->chanop)
-		malloc_strcat_word_c(&str, space, channel->nicks.list[i]->nick, DWORD_NO, &clue);
+	check_channel_lists(channel);
+	if (!channel->nochops_list)
+		channel->nochops_list = make_nick_list(channel, 0);
 
-	if (!str)
-		return malloc_strdup(empty_string);
-	return str;
+	return malloc_strdup(channel->nochops_list);
 }
 
 /*
@@ -876,7 +1659,10 @@ static void	decifer_mode (const char *modes, Channel *chan)
 			if (is_me(from_server, arg))
 				chan->chop = add;
 			if ((nick = find_nick_on_channel(chan, arg)))
+			{
 				nick->chanop = add;
+				chan->nicks.generation++;  /* For $chops() */
+			}
 			continue;
 		}
 		case 'v':
@@ -954,6 +1740,33 @@ int	channel_is_syncing (const char *channel, int server)
 		return 0;
 }
 
+/* 
+ * The server has sent us all the names on a channel we're syncing.
+ * (The channel is still syncing until channel_not_waiting().)
+ */
+void	channel_names_done (const char *channel, int server)
+{
+	Channel *tmp = find_channel(channel, server);
+
+	if (tmp)
+		nicklist_end_bulk(&tmp->nicks);
+}
+
+/*
+ * Is "channel" only keeping track of its recent speakers?  If so, then 
+ * number_on_channel() is an estimate, and is_on_channel() and 
+ * create_nick_list() only know about the people who spoke recently.
+ */
+int	channel_is_approximate (const char *channel, int server)
+{
+	Channel *tmp = find_channel(channel, server);
+
+	if (tmp && tmp->hll)
+		return 1;
+	else
+		return 0;
+}
+
 void	channel_not_waiting (const char *channel, int server)
 {
 	Channel *tmp = find_channel(channel, server);
@@ -962,6 +1775,7 @@ void	channel_not_waiting (const char *channel, int server)
 	if (tmp)
 	{
 		tmp->waiting = 0;
+		nicklist_end_bulk(&tmp->nicks);
 		l = message_from(channel, LEVEL_OTHER);
 		do_hook(CHANNEL_SYNC_LIST, "%s %f %d",
 			tmp->channel, 
@@ -1047,7 +1861,7 @@ int	is_channel_anonymous (const char *channel, int server_index)
  */
 static void 	show_channel (Channel *chan)
 {
-	NickList 	*tmp = &chan->nicks;
+	Nick		**nicks = nicklist_sorted(&chan->nicks);
 	char		local_buf[BIG_BUFFER_SIZE * 10 + 1];
 	char		*ptr;
 	int		nick_len;
@@ -1058,13 +1872,13 @@ static void 	show_channel (Channel *chan)
 	*ptr = 0;
 	nick_len = BIG_BUFFER_SIZE * 10;
 
-	for (i = 0; i < tmp->max; i++)
+	for (i = 0; i < chan->nicks.max; i++)
 	{
-		strlcpy(ptr, tmp->list[i]->nick, nick_len);
-		if (tmp->list[i]->userhost)
+		strlcpy(ptr, nicks[i]->nick, nick_len);
+		if (nicks[i]->userhost)
 		{
 			strlcat(ptr, "!", nick_len);
-			strlcat(ptr, tmp->list[i]->userhost, nick_len);
+			strlcat(ptr, nicks[i]->userhost, nick_len);
 		}
 		strlcat(ptr, space, nick_len);
 
@@ -1076,18 +1890,28 @@ static void 	show_channel (Channel *chan)
 			break;		/* No more space. */
 	}
 
-	say("\t%s +%s (%s) (Win: %d): %s", 
-		chan->channel, 
-		get_cmode(chan),
-		get_server_name(chan->server), 
-		chan->winref > 0 ? chan->winref : -1,
-		local_buf);
+	if (chan->hll)
+		say("\t%s +%s (%s) (Win: %d) (About %d, %d recent): %s", 
+			chan->channel, 
+			get_cmode(chan),
+			get_server_name(chan->server), 
+			chan->winref > 0 ? chan->winref : -1,
+			number_on_channel(chan->channel, chan->server),
+			chan->nicks.max,
+			local_buf);
+	else
+		say("\t%s +%s (%s) (Win: %d): %s", 
+			chan->channel, 
+			get_cmode(chan),
+			get_server_name(chan->server), 
+			chan->winref > 0 ? chan->winref : -1,
+			local_buf);
 }
 
 char	*scan_channel (char *cname)
 {
 	Channel 	*wc = find_channel(cname, from_server);
-	NickList 	*nicks;
+	Nick		**nicks;
 	char		buffer[NICKNAME_LEN + 5];
 	char		*retval = NULL;
 	int		i;
@@ -1096,24 +1920,24 @@ char	*scan_channel (char *cname)
 	if (!wc)
 		return malloc_strdup(empty_string);
 
-	nicks = &wc->nicks;
-	for (i = 0; i < nicks->max; i++)
+	nicks = nicklist_sorted(&wc->nicks);
+	for (i = 0; i < wc->nicks.max; i++)
 	{
-		if (nicks->list[i]->chanop)
+		if (nicks[i]->chanop)
 			buffer[0] = '@';
-		else if (nicks->list[i]->half_assed == 1)
+		else if (nicks[i]->half_assed == 1)
 			buffer[0] = '%';
 		else
 			buffer[0] = '.';
 
-		if (nicks->list[i]->voice == 1)
+		if (nicks[i]->voice == 1)
 			buffer[1] = '+';
-		else if (nicks->list[i]->voice == -1)
+		else if (nicks[i]->voice == -1)
 			buffer[1] = '?';
 		else
 			buffer[1] = '.';
 
-		strlcpy(buffer + 2, nicks->list[i]->nick, sizeof(buffer) - 2);
+		strlcpy(buffer + 2, nicks[i]->nick, sizeof(buffer) - 2);
 		malloc_strcat_word_c(&retval, space, buffer, DWORD_NO, &clue);
 	}
 
@@ -1310,30 +2134,44 @@ void 	destroy_server_channels (int server)
 
 const char *	what_channel (const char *nick, int servref)
 {
-	Channel *tmp = NULL;
+	Nick **		nicks;
+	const char *	retval = NULL;
 
-	while (traverse_all_channels(&tmp, servref, 1))
-	{
-		if (find_nick_on_channel(tmp, nick))
-			return tmp->channel;
-	}
-
-	return NULL;
+	if (find_nick_everywhere(nick, servref, &nicks))
+		retval = nicks[0]->channel->channel;
+	new_free((char **)&nicks);
+	return retval;
 }
 
+/*
+ * walk_channels: Call with init = 1 to get the first channel "nick" is on
+ * (on from_server), and then with init = 0 to get the rest, until it
+ * returns NULL.  The list is made when you call it with init = 1.
+ */
 const char *	walk_channels (int init, const char *nick)
 {
-	static	Channel *tmp = (Channel *) 0;
+	static	char ** names = NULL;
+	static	int	cnt = 0, next = 0;
+	Nick **		nicks;
+	int		i;
 
 	if (init)
-		tmp = NULL;
-
-	while (traverse_all_channels(&tmp, from_server, 1))
 	{
-		if (find_nick_on_channel(tmp, nick))
-			return (tmp->channel);
+		for (i = 0; i < cnt; i++)
+			new_free(&names[i]);
+		new_free((char **)&names);
+
+		cnt = find_nick_everywhere(nick, from_server, &nicks);
+		if (cnt)
+		    names = (char **)new_malloc(sizeof(char *) * cnt);
+		for (i = 0; i < cnt; i++)
+		    names[i] = malloc_strdup(nicks[i]->channel->channel);
+		new_free((char **)&nicks);
+		next = 0;
 	}
 
+	if (next < cnt)
+		return names[next++];
 	return NULL;
 }
 
@@ -1341,18 +2179,27 @@ const char *	fetch_userhost (int server, const char *chan, const char *nick)
 {
 	Channel *tmp = NULL;
 	Nick *user = NULL;
+	Nick **nicks;
+	const char *retval = NULL;
+	int	i, cnt;
 
 	if (server == NOSERV) return NULL;		/* Sanity check */
 
 	if (chan && (tmp = find_channel(chan, server)) &&
 			(user = find_nick_on_channel(tmp, nick)))
 		return user->userhost;
-	else while (traverse_all_channels(&tmp, server, 1))
-		if ((user = find_nick_on_channel(tmp, nick)) && 
-				user->userhost)
-			return user->userhost;
 
-	return NULL;
+	cnt = find_nick_everywhere(nick, server, &nicks);
+	for (i = 0; i < cnt; i++)
+	{
+		if (nicks[i]->userhost)
+		{
+			retval = nicks[i]->userhost;
+			break;
+		}
+	}
+	new_free((char **)&nicks);
+	return retval;
 }
 
 int 	get_channel_oper (const char *channel, int server)
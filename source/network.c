@@ -47,6 +47,10 @@
 typedef struct sockaddr_un USA;
 #endif
 
+#ifdef USE_THREADED_DNS
+#include <pthread.h>
+#endif
+
 static int	Connect 	 (int, SA *);
 static socklen_t socklen  	 (SA *);
 static int	Getnameinfo 	 (const SA *, socklen_t, char *, size_t, char *, size_t, int);
@@ -691,16 +695,29 @@ int	my_getaddrinfo (const char *nodename, const char *servname, const AI *hints,
 #endif
                 len = strlen(storage.sun_path) + 3;
 
-		(*res) = new_malloc(sizeof(*results));
-		(*res)->ai_flags = 0;
-		(*res)->ai_family = AF_UNIX;
-		(*res)->ai_socktype = SOCK_STREAM;
-		(*res)->ai_protocol = 0;
-		(*res)->ai_addrlen = len;
-		(*res)->ai_canonname = malloc_strdup(nodename);
-		(*res)->ai_addr = new_malloc(sizeof(storage));
-		*(USA *)((*res)->ai_addr) = storage;
-		(*res)->ai_next = 0;
+		/*
+		 * This runs in the dns threads, so it has to use malloc()
+		 * and not new_malloc().  See dns_thread().
+		 */
+		if (!(results = calloc(1, sizeof(*results))))
+			return EAI_MEMORY;
+		results->ai_flags = 0;
+		results->ai_family = AF_UNIX;
+		results->ai_socktype = SOCK_STREAM;
+		results->ai_protocol = 0;
+		results->ai_addrlen = len;
+		results->ai_canonname = strdup(nodename);
+		results->ai_addr = malloc(sizeof(storage));
+		if (!results->ai_canonname || !results->ai_addr)
+		{
+			free(results->ai_canonname);
+			free(results->ai_addr);
+			free(results);
+			return EAI_MEMORY;
+		}
+		*(USA *)(results->ai_addr) = storage;
+		results->ai_next = 0;
+		*res = results;
 
                 return 0;
 	}
@@ -722,9 +739,9 @@ void	my_freeaddrinfo (AI *ai)
 #ifdef GETADDRINFO_DOES_NOT_DO_AF_UNIX
 	if (ai->ai_family == AF_UNIX)
 	{
-		new_free(&ai->ai_canonname);
-		new_free(&ai->ai_addr);
-		new_free(&ai);
+		free(ai->ai_canonname);
+		free(ai->ai_addr);
+		free(ai);
 		return;
 	}
 #endif
@@ -825,31 +842,116 @@ int	Socket (int domain, int type, int protocol)
 	return s;
 }
 
-pid_t	async_getaddrinfo (const char *nodename, const char *servname, const AI *hints, int fd)
+/*
+ * The dns cache remembers the marshalled results of recent lookups, so
+ * that reconnecting to a server (or a bunch of servers) doesn't have to
+ * look the same hostname up over and over.  Getaddrinfo() doesn't tell
+ * us the real ttl, so we just keep things for DNS_CACHE_TTL seconds.
+ * The cache is only ever touched by the main thread.
+ */
+#define DNS_CACHE_SIZE	32
+#define DNS_CACHE_TTL	300
+
+typedef struct DNSCache
 {
-	AI *results = NULL;
-	ssize_t	err;
+	char *	host;
+	char *	port;
+	int	family;
+	time_t	expires;
+	char *	data;		/* As written by marshall_getaddrinfo() */
+	ssize_t	len;
+} DNSCache;
 
-#ifdef ASYNC_DNS
+static	DNSCache	dns_cache[DNS_CACHE_SIZE];
+
+static DNSCache *	dns_cache_find (const char *host, const char *port, int family)
+{
+	int	i;
+	time_t	right_now = time(NULL);
+
+	if (!host || !port)
+		return NULL;
+
+	for (i = 0; i < DNS_CACHE_SIZE; i++)
 	{
-	/* XXX Letting /exec clean up after us is a hack. */
-	pid_t	helper;
-	if ((helper = fork()))
-		return helper;
+		if (!dns_cache[i].host || dns_cache[i].expires < right_now)
+			continue;
+		if (dns_cache[i].family == family &&
+		    !my_stricmp(dns_cache[i].host, host) &&
+		    !strcmp(dns_cache[i].port, port))
+			return &dns_cache[i];
 	}
-#endif
+	return NULL;
+}
+
+static void	dns_cache_clear (DNSCache *c)
+{
+	new_free(&c->host);
+	new_free(&c->port);
+	new_free(&c->data);
+	c->len = 0;
+	c->expires = 0;
+}
+
+/*
+ * dns_cache_store - Remember a successful lookup.  "data" and "len" are
+ *	what the lookup wrote (after the length), before unmarshalling.
+ */
+void	dns_cache_store (const char *host, const char *port, int family, const void *data, ssize_t len)
+{
+	DNSCache *c;
+	int	i;
+
+	if (!host || !port || len <= 0)
+		return;
+
+	/* Reuse this lookup's old entry, or the one expiring soonest */
+	if (!(c = dns_cache_find(host, port, family)))
+	{
+		c = &dns_cache[0];
+		for (i = 0; i < DNS_CACHE_SIZE; i++)
+			if (dns_cache[i].expires < c->expires)
+				c = &dns_cache[i];
+	}
+
+	dns_cache_clear(c);
+	malloc_strcpy(&c->host, host);
+	malloc_strcpy(&c->port, port);
+	c->family = family;
+	c->data = new_malloc(len);
+	memcpy(c->data, data, len);
+	c->len = len;
+	c->expires = time(NULL) + DNS_CACHE_TTL;
+}
+
+/*
+ * dns_cache_forget - Throw away a lookup that didn't work out (ie, none
+ *	of the addresses would take our connection.)
+ */
+void	dns_cache_forget (const char *host, const char *port, int family)
+{
+	DNSCache *c;
+
+	if ((c = dns_cache_find(host, port, family)))
+		dns_cache_clear(c);
+}
+
+/*
+ * getaddrinfo_to_fd - Look up a hostname and write the results to 'fd' 
+ *	the way do_server() expects to read them.  This runs in a child 
+ *	process or a dns thread, so it must not touch the rest of the client.
+ */
+static void	getaddrinfo_to_fd (const char *nodename, const char *servname, const AI *hints, int fd)
+{
+	AI *results = NULL;
+	ssize_t	err;
 
         if ((err = my_getaddrinfo(nodename, servname, hints, &results)))
         {
 		err = -labs(err);		/* Always a negative number */
 		if (!write(fd, &err, sizeof(err))) 
 			(void) 0;
-		close(fd);
-#ifdef ASYNC_DNS
-		exit(0);
-#else
-		return 0;
-#endif
+		return;
         }
 
 	if (!results)
@@ -857,17 +959,174 @@ pid_t	async_getaddrinfo (const char *nodename, const char *servname, const AI *h
 		err = 0;
 		if (!write(fd, &err, sizeof(err))) 
 			(void) 0;
-		close(fd);
-#ifdef ASYNC_DNS
-		exit(0);
-#else
-		return 0;
-#endif
+		return;
         }
 
         marshall_getaddrinfo(fd, results);
         my_freeaddrinfo(results);
-        close(fd);
+}
+
+#ifdef USE_THREADED_DNS
+/*
+ * A small pool of threads does the lookups, so we don't have to fork a
+ * copy of the (very large) client for each one.  Threads are started as 
+ * lookups come in, up to DNS_THREADS, and then stick around waiting for 
+ * more.  Each lookup owns its own copy of the fd, which the thread closes
+ * when it is done; do_server() sees the results just like it would from
+ * a child process.
+ */
+#define DNS_THREADS	4
+
+typedef struct DNSLookup
+{
+	char *	nodename;
+	char *	servname;
+	AI	hints;
+	int	fd;
+	struct DNSLookup *next;
+} DNSLookup;
+
+static	pthread_mutex_t	dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+static	pthread_cond_t	dns_cond = PTHREAD_COND_INITIALIZER;
+static	DNSLookup *	dns_queue_head = NULL;
+static	DNSLookup *	dns_queue_tail = NULL;
+static	int		dns_threads = 0;
+static	int		dns_idle_threads = 0;
+
+/*
+ * Nothing in here may use new_malloc() or say() and friends; the threads
+ * only ever use malloc() and free().
+ */
+static void *	dns_thread (void *unused)
+{
+	DNSLookup *lookup;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&dns_mutex);
+		while (!dns_queue_head)
+		{
+			dns_idle_threads++;
+			pthread_cond_wait(&dns_cond, &dns_mutex);
+			dns_idle_threads--;
+		}
+		lookup = dns_queue_head;
+		if (!(dns_queue_head = lookup->next))
+			dns_queue_tail = NULL;
+		pthread_mutex_unlock(&dns_mutex);
+
+		getaddrinfo_to_fd(lookup->nodename, lookup->servname, 
+					&lookup->hints, lookup->fd);
+		close(lookup->fd);
+		free(lookup->nodename);
+		free(lookup->servname);
+		free(lookup);
+	}
+	return NULL;
+}
+
+/*
+ * threaded_getaddrinfo - Hand a lookup to the thread pool.
+ *	Returns 0 if a thread will do the lookup, -1 if the caller 
+ *	has to do it some other way.
+ */
+static int	threaded_getaddrinfo (const char *nodename, const char *servname, const AI *hints, int fd)
+{
+	DNSLookup *lookup;
+	pthread_t	thread;
+	sigset_t	all, old;
+	int		err;
+
+	if (!(lookup = malloc(sizeof(DNSLookup))))
+		return -1;
+	lookup->nodename = nodename ? strdup(nodename) : NULL;
+	lookup->servname = servname ? strdup(servname) : NULL;
+	memset(&lookup->hints, 0, sizeof(lookup->hints));
+	lookup->hints.ai_flags = hints->ai_flags;
+	lookup->hints.ai_family = hints->ai_family;
+	lookup->hints.ai_socktype = hints->ai_socktype;
+	lookup->hints.ai_protocol = hints->ai_protocol;
+	lookup->next = NULL;
+	if ((lookup->fd = dup(fd)) < 0)
+	{
+		free(lookup->nodename);
+		free(lookup->servname);
+		free(lookup);
+		return -1;
+	}
+
+	pthread_mutex_lock(&dns_mutex);
+	if (dns_idle_threads == 0 && dns_threads < DNS_THREADS)
+	{
+		/* The threads must leave all signals to the main thread */
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+		err = pthread_create(&thread, NULL, dns_thread, NULL);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+		if (err == 0)
+		{
+			pthread_detach(thread);
+			dns_threads++;
+		}
+		else if (dns_threads == 0)
+		{
+			pthread_mutex_unlock(&dns_mutex);
+			close(lookup->fd);
+			free(lookup->nodename);
+			free(lookup->servname);
+			free(lookup);
+			return -1;
+		}
+	}
+
+	if (dns_queue_tail)
+		dns_queue_tail->next = lookup;
+	else
+		dns_queue_head = lookup;
+	dns_queue_tail = lookup;
+	pthread_cond_signal(&dns_cond);
+	pthread_mutex_unlock(&dns_mutex);
+	return 0;
+}
+#endif
+
+/*
+ * async_getaddrinfo - Look up a hostname without blocking the client.
+ *	The results are written to 'fd' for do_server() to pick up.  
+ *	They come from the dns cache if we can, otherwise from the dns 
+ *	thread pool, otherwise from a child process.  The caller may close
+ *	'fd' as soon as we return.
+ */
+pid_t	async_getaddrinfo (const char *nodename, const char *servname, const AI *hints, int fd)
+{
+	DNSCache *c;
+
+	if ((c = dns_cache_find(nodename, servname, hints->ai_family)))
+	{
+		if (!write(fd, &c->len, sizeof(c->len)))
+			(void) 0;
+		if (!write(fd, c->data, c->len))
+			(void) 0;
+		return 0;
+	}
+
+#ifdef USE_THREADED_DNS
+	if (!threaded_getaddrinfo(nodename, servname, hints, fd))
+		return 0;
+#endif
+
+#ifdef ASYNC_DNS
+	{
+	/* XXX Letting /exec clean up after us is a hack. */
+	pid_t	helper;
+	if ((helper = fork()))
+		return helper;
+	}
+#endif
+
+	getaddrinfo_to_fd(nodename, servname, hints, fd);
+	close(fd);
 #ifdef ASYNC_DNS
 	exit(0);
 #endif
@@ -892,7 +1151,9 @@ void	marshall_getaddrinfo (int fd, AI *results)
 	}
 
 	/* Why do I know I'm gonna regret this? */
-	ptr = retval = new_malloc(len + 1);
+	/* (This may be running in a dns thread, so no new_malloc here) */
+	if (!(ptr = retval = malloc(len + 1)))
+		return;
 	memset(retval, 0, len + 1);
 	for (result = results; result; result = result->ai_next)
 	{
@@ -936,7 +1197,7 @@ void	marshall_getaddrinfo (int fd, AI *results)
 		(void) 0;
 	if (!write(fd, (void *)retval, len)) 
 		(void) 0;
-	new_free(&retval);
+	free(retval);
 }
 
 void	unmarshall_getaddrinfo (AI *results)
@@ -72,8 +72,10 @@ typedef	struct	myio_struct
 	short	segments,
 		error,
 		clean,
-		held;
+		held,
+		writable;
 	void	(*callback) (int vfd);
+	void	(*write_callback) (int vfd);
 	int	(*io_callback) (int vfd, int quiet);
 	int	(*failure_callback) (int channel, int error);
 	int	quiet;
@@ -100,6 +102,7 @@ static	void	kunlock (void);
 static	int	ksleep (double dur);
 static	int	kreadable (int vfd, double);
 static	int	kwritable (int vfd, double);
+static	int	kwatchwrites (void);
 
 /* These functions implement basic i/o operations for unix */
 static int	unix_read (int channel, int);
@@ -277,7 +280,9 @@ ssize_t	dgets (int vfd, char *buf, size_t buflen, int buffer)
 {
 	size_t	cnt = 0;
 	size_t	consumed = 0;
-	char	h = 0;
+	size_t	avail;
+	char *	start;
+	char *	nl = NULL;
 	MyIO *	ioe;
 
 	if (buflen == 0)
@@ -298,14 +303,17 @@ ssize_t	dgets (int vfd, char *buf, size_t buflen, int buffer)
 	    return -1;
 	}
 
+	start = ioe->buffer + ioe->read_pos;
+	avail = ioe->write_pos - ioe->read_pos;
+	if (buffer >= 0)
+		nl = memchr(start, '\n', avail);
 
 	/*
 	 * So the buffer probably has changed now, because we just read
 	 * in more data.  Check again to see if there is a newline.  If
 	 * there is not, and the caller wants a complete line, just punt.
 	 */
-	if (buffer == 1 && !memchr(ioe->buffer + ioe->read_pos, '\n', 
-					ioe->write_pos - ioe->read_pos))
+	if (buffer == 1 && !nl)
 	{
 		ioe->clean = 1;
 		kcleaned(vfd);
@@ -316,10 +324,10 @@ ssize_t	dgets (int vfd, char *buf, size_t buflen, int buffer)
 	 * So if the caller wants 'buflen' bytes, and we don't have it,
 	 * then mark the buffer clean and wait for more.
 	 */
-	if (buffer == -2 && ioe->write_pos - ioe->read_pos < buflen)
+	if (buffer == -2 && avail < buflen)
 	{
 		yell("dgets: Wanted %ld bytes, have %ld bytes", 
-			(long)(ioe->write_pos - ioe->read_pos), (long)buflen);
+			(long)avail, (long)buflen);
 		ioe->clean = 1;
 		kcleaned(vfd);
 		return 0;
@@ -327,33 +335,21 @@ ssize_t	dgets (int vfd, char *buf, size_t buflen, int buffer)
 
 	/*
 	 * AT THIS POINT WE'VE COMMITED TO RETURNING WHATEVER WE HAVE.
+	 *
+	 * For buffered data, we consume up through the newline (or all of
+	 * it, if there isn't one), but only copy what will fit.  For 
+	 * unbuffered data, we consume only what we can copy.
 	 */
-
-	consumed = 0;
-	while (ioe->read_pos < ioe->write_pos)
+	if (buffer >= 0)
 	{
-	    h = ioe->buffer[ioe->read_pos++];
-	    consumed++;
-
-	    /* Only copy the data if there is some place to put it. */
-	    if (cnt <= buflen - 1)
-		buf[cnt++] = h;
-
-	    /* 
-	     * For buffered data, don't stop until we see the newline. 
-	     * For unbuffered data, stop if we run out of space.
-	     */
-	    if (buffer >= 0)
-	    {
-		if (h == '\n')
-		    break;
-	    }
-	    else
-	    {
-		if (cnt == buflen)
-		    break;
-	    }
+		consumed = nl ? (size_t)(nl - start) + 1 : avail;
+		cnt = consumed < buflen ? consumed : buflen;
 	}
+	else
+		consumed = cnt = avail < buflen ? avail : buflen;
+
+	memcpy(buf, start, cnt);
+	ioe->read_pos += consumed;
 
 	if (ioe->read_pos == ioe->write_pos)
 	{
@@ -379,7 +375,7 @@ ssize_t	dgets (int vfd, char *buf, size_t buflen, int buffer)
 					vfd, (long)consumed, (long)cnt);
 
 		/* If the line had a newline, then put the newline in. */
-		if (buffer >= 0 && h == '\n')
+		if (buffer >= 0 && nl)
 		{
 			cnt = buflen - 2;
 			buf[cnt++] = '\n';
@@ -404,6 +400,110 @@ ssize_t	dgets (int vfd, char *buf, size_t buflen, int buffer)
 	    return 0;
 }
 
+/*
+ * dgets_lines -- Return all of the complete lines buffered for a vfd at once.
+ *
+ * This is like calling dgets(vfd, ..., linelen, 1) over and over until it
+ * returns 0, except that the buffer is scanned for newlines in a single
+ * pass and the caller gets every line in one callback.  Whatever partial
+ * line is left over gets moved to the front of the buffer once, by the
+ * next dgets_buffer().  This matters for servers that send hundreds of
+ * lines in each read().
+ *
+ * Arguments:
+ * 1) vfd      - A "dirty" newio file descriptor.
+ * 2) buf      - A buffer into which all of the lines are copied, one after
+ *		 another.  Each line ends with its newline and is null
+ *		 terminated, just as dgets() would return it.
+ * 3) buflen   - The size of 'buf'.  This must be larger than 'linelen'.
+ * 4) linelen  - The longest line to return; longer lines are truncated 
+ *		 the same way dgets() truncates them.
+ * 5) line_starts - An array that is filled in with the start of each line
+ *		 in 'buf'.
+ * 6) maxlines - The number of elements in 'line_starts'.
+ *
+ * Return values:
+ *	-1	The file descriptor is dead
+ *	 0	There are no complete lines (the fd is now clean)
+ *	>0	The number of lines returned in 'line_starts'.
+ *
+ * If 'buf' or 'line_starts' fills up, the remaining lines stay buffered and 
+ * the vfd stays dirty, so you will be called back again for them.
+ */
+ssize_t	dgets_lines (int vfd, char *buf, size_t buflen, size_t linelen, char **line_starts, int maxlines)
+{
+	MyIO *	ioe;
+	char *	p;
+	char *	end;
+	char *	nl;
+	char *	out;
+	size_t	len, cnt;
+	int	count = 0;
+
+	if (linelen < 2 || buflen <= linelen)
+	{
+	    syserr(SRV(vfd),
+			"dgets_lines: Destination buffer for vfd [%d] is too "
+			"small. This is surely a bug.", vfd);
+	    return -1;
+	}
+
+	if (!(ioe = io_rec[vfd]))
+		panic(1, "dgets_lines called on unsetup vfd %d", vfd);
+
+	if (ioe->error)
+	{
+	    if (!ioe->quiet)
+	       syserr(SRV(vfd), "dgets_lines: fd [%d] must be closed", vfd);
+	    return -1;
+	}
+
+	p = ioe->buffer + ioe->read_pos;
+	end = ioe->buffer + ioe->write_pos;
+	out = buf;
+
+	while (count < maxlines && p < end && (nl = memchr(p, '\n', end - p)))
+	{
+		len = nl - p + 1;
+		cnt = len <= linelen ? len : linelen - 1;
+
+		/* No room for this one -- leave it for next time. */
+		if (out + cnt + 1 > buf + buflen)
+			break;
+
+		if (cnt < len)
+		{
+			if (x_debug & DEBUG_INBOUND) 
+				yell("VFD [%d], Truncated (did [%ld], max [%ld])", 
+					vfd, (long)len, (long)cnt);
+			memcpy(out, p, cnt - 1);
+			out[cnt - 1] = '\n';
+		}
+		else
+			memcpy(out, p, cnt);
+
+		out[cnt] = 0;
+		line_starts[count++] = out;
+		out += cnt + 1;
+		p = nl + 1;
+	}
+
+	ioe->read_pos = p - ioe->buffer;
+	if (ioe->read_pos == ioe->write_pos)
+	{
+		ioe->read_pos = ioe->write_pos = 0;
+		ioe->clean = 1;
+		kcleaned(vfd);
+	}
+	else if (count == 0)
+	{
+		ioe->clean = 1;
+		kcleaned(vfd);
+	}
+
+	return count;
+}
+
 /*************************************************************************/
 /*
  * do_wait -- The main sleeping routine.  When all of the fd's are clean,
@@ -455,7 +555,7 @@ static	int	polls = 0;
 	 * we shall just return and allow them to be cleaned.
 	 */
 	for (vfd = 0; vfd <= global_max_vfd; vfd++)
-		if (io_rec[vfd] && !io_rec[vfd]->clean)
+		if (io_rec[vfd] && (!io_rec[vfd]->clean || io_rec[vfd]->writable))
 			return 1;
 
 	/*
@@ -473,9 +573,20 @@ static	int	polls = 0;
 void	do_filedesc (void)
 {
 	int	vfd;
+	void	(*write_callback) (int);
 
 	for (vfd = 0; vfd <= global_max_vfd; vfd++)
 	{
+		/* If they were waiting to write, tell them they can. */
+		if (io_rec[vfd] && io_rec[vfd]->writable)
+		{
+			write_callback = io_rec[vfd]->write_callback;
+			io_rec[vfd]->writable = 0;
+			io_rec[vfd]->write_callback = NULL;
+			if (write_callback)
+				write_callback(vfd);
+		}
+
 		/* Then tell the user they have data ready for them. */
 		while (io_rec[vfd] && !io_rec[vfd]->clean)
 			io_rec[vfd]->callback(vfd);
@@ -562,6 +673,8 @@ int 	new_open (int channel, void (*callback) (int), int io_type, int quiet, int
 	ioe->error = 0;
 	ioe->clean = 1;
 	ioe->held = 0;
+	ioe->writable = 0;
+	ioe->write_callback = NULL;
 	ioe->quiet = quiet;
 	ioe->server = server;
 
@@ -612,6 +725,32 @@ int 	new_open (int channel, void (*callback) (int), int io_type, int quiet, int
 	return vfd;
 }
 
+/*
+ * new_wait_writable -- Call "callback" once, the next time "vfd" can be
+ * written to without blocking.  A NULL callback stops waiting.  Returns -1
+ * if we can't tell you that (the vfd isn't set up, it is still connecting,
+ * or this i/o strategy can't watch for writes), so you'll have to poll.
+ */
+int	new_wait_writable (int vfd, void (*callback) (int))
+{
+	MyIO *ioe;
+
+	if (vfd < 0 || vfd > global_max_vfd || !(ioe = io_rec[vfd]))
+		return -1;
+	if (!kwatchwrites() || ioe->io_callback == unix_connect)
+		return -1;
+
+	ioe->write_callback = callback;
+	if (callback)
+		kwrite(vfd);
+	else
+	{
+		ioe->writable = 0;
+		knowrite(vfd);
+	}
+	return 0;
+}
+
 /*
  * On a VFD registered with new_open(), you may want a callback when the
  * fd has gone bad, so you can do your own cleanup.
@@ -718,10 +857,12 @@ int	new_close_with_option (int vfd, int virtual)
 	return -1;
 }
 
+#ifdef USE_SELECT
 /* 
  * The lower level IO functions call us when an channel (fd) is found dead,
  * and has been untracked (FD_CLR) and unregistered (new_close()), so we
- * may tell any owner of this.
+ * may tell any owner of this.  Only select() ever finds out about a dead
+ * channel this way; the others just stop reporting it.
  */
 static	void	fd_is_invalid (int channel)
 {
@@ -742,6 +883,7 @@ static	void	fd_is_invalid (int channel)
 
 
 }
+#endif
 
 
 /***********************************************************************/
@@ -974,6 +1116,27 @@ static void	new_io_event (int vfd)
 	}
 }
 
+#if !defined(USE_PTHREAD) && !defined(USE_SOLARIS_PORTS)
+/*
+ * Call this function when a vfd that someone is waiting to write to
+ * (see new_wait_writable()) becomes writable.  Like new_io_event(), it
+ * only marks the vfd; do_filedesc() calls the user's callback.
+ */
+static void	new_write_event (int vfd)
+{
+	MyIO *ioe;
+
+	if (!(ioe = io_rec[vfd]))
+		panic(1, "new_write_event: vfd [%d] isn't set up!", vfd);
+
+	knowrite(vfd);
+	ioe->writable = 1;
+	if (x_debug & DEBUG_INBOUND) 
+		yell("VFD [%d], writable", vfd);
+}
+#endif
+
+#ifdef USE_SELECT
 static	int	is_fd_valid (int fd)
 {
 	int	retval;
@@ -988,6 +1151,7 @@ static	int	is_fd_valid (int fd)
 	else
 		return 1;
 }
+#endif
 
 
 /************************************************************************/
@@ -1079,6 +1243,13 @@ static	int	kdoit (Timeval *timeout)
 		 * /timer is probably a better solution than uncommenting the
 		 * break.
 		 */
+		if (FD_ISSET(channel, &working_wd) && io_rec[VFD(channel)] &&
+				io_rec[VFD(channel)]->write_callback)
+		{
+			new_write_event(VFD(channel));
+			FD_CLR(channel, &working_wd);
+		}
+
 		if (FD_ISSET(channel, &working_rd) ||
 		    FD_ISSET(channel, &working_wd))
 		{
@@ -1127,6 +1298,8 @@ static	int	kwritable (int vfd, double timeout)
 	return select(CHANNEL(vfd) + 1, NULL, &fd_read, NULL, &interval);
 }
 
+static	int	kwatchwrites (void) { return 1; }
+
 #endif
 
 /************************************************************************/
@@ -1243,7 +1416,11 @@ static	int	kdoit (Timeval *timeout)
 	else if (retval > 0)
 	{
 		channel = event.ident;
-		new_io_event(VFD(channel));
+		if (event.filter == EVFILT_WRITE && io_rec[VFD(channel)] &&
+				io_rec[VFD(channel)]->write_callback)
+			new_write_event(VFD(channel));
+		else
+			new_io_event(VFD(channel));
 	}
 
 	return retval;
@@ -1285,6 +1462,8 @@ static	int	kwritable (int vfd, double timeout)
 	return select(CHANNEL(vfd) + 1, NULL, &fd_read, NULL, &interval);
 }
 
+static	int	kwatchwrites (void) { return 1; }
+
 #endif
 
 /************************************************************************/
@@ -1366,6 +1545,13 @@ static	int	kdoit (Timeval *timeout)
 		{
 		    if (polls[vfd].revents)
 		    {
+			if (io_rec[vfd] && io_rec[vfd]->write_callback &&
+			    (polls[vfd].revents & (POLLOUT | POLLERR | POLLHUP)))
+			{
+				new_write_event(vfd);
+				if (!(polls[vfd].revents & ~POLLOUT))
+					break;
+			}
 			new_io_event(vfd);
 			break;
 		    }
@@ -1411,6 +1597,258 @@ static	int	kwritable (int vfd, double timeout)
 	return select(CHANNEL(vfd) + 1, NULL, &fd_read, NULL, &interval);
 }
 
+static	int	kwatchwrites (void) { return 1; }
+
+#endif
+
+/************************************************************************/
+/*
+ * Implementation of Linux epoll() front-end to synchronous unix calls
+ *
+ * Unlike select() and poll(), the kernel remembers the interest set for
+ * us, so we only tell it about changes, and epoll_wait() only returns
+ * the fds that are actually ready.  This keeps the cost of each trip
+ * through the main loop proportional to the number of busy fds rather
+ * than the number of open fds.
+ *
+ * Edge-triggering is only used for fds that are waiting for a connect()
+ * to complete (write interest only).  new_io_event() does just one read()
+ * per wakeup, so if a readable fd were edge triggered, any data beyond
+ * that one read() would never generate another event.  Read interest is
+ * therefore always level-triggered.
+ *
+ * epoll refuses regular files (EPERM), which can happen if stdin is
+ * redirected.  Those are always ready, so we just remember them and
+ * treat them as ready on every pass.
+ */
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+
+#define EPOLL_MAX_EVENTS 64
+
+static int	epoll_fd = -1;
+static int *	epoll_wanted = NULL;
+static char *	epoll_unpollable = NULL;
+static int	epoll_unpollable_count = 0;
+
+static void	kinit (void)
+{
+	int	i;
+
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	{
+		syserr(-1, "kinit(epoll): epoll_create1() failed: %s", 
+				strerror(errno));
+		irc_exit(1, "Your system doesn't support epoll(7)");
+	}
+
+	epoll_wanted = (int *)new_malloc(sizeof(int) * IO_ARRAYLEN);
+	epoll_unpollable = (char *)new_malloc(IO_ARRAYLEN);
+	for (i = 0; i < IO_ARRAYLEN; i++)
+	{
+		epoll_wanted[i] = 0;
+		epoll_unpollable[i] = 0;
+	}
+}
+
+/*
+ * Tell the kernel that 'channel' should now be watched for 'events'
+ * (some combination of EPOLLIN and EPOLLOUT, or 0 to stop watching).
+ */
+static void	ksetevents (int channel, int events)
+{
+	struct epoll_event ev;
+	int	old, op;
+
+	old = epoll_wanted[channel];
+	if (old == events)
+		return;
+	epoll_wanted[channel] = events;
+
+	if (epoll_unpollable[channel])
+	{
+		if (events == 0)
+		{
+			epoll_unpollable[channel] = 0;
+			epoll_unpollable_count--;
+		}
+		return;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = channel;
+	ev.events = events;
+	if (events == EPOLLOUT)
+		ev.events |= EPOLLET;
+
+	if (old == 0)
+		op = EPOLL_CTL_ADD;
+	else if (events == 0)
+		op = EPOLL_CTL_DEL;
+	else
+		op = EPOLL_CTL_MOD;
+
+	if (epoll_ctl(epoll_fd, op, channel, &ev) == 0)
+		return;
+
+	/* 
+	 * The kernel forgets an fd when it is close()d, so if someone
+	 * closed it behind our back and it got reused, just start over.
+	 */
+	if (op == EPOLL_CTL_MOD && errno == ENOENT)
+	{
+		op = EPOLL_CTL_ADD;
+		if (epoll_ctl(epoll_fd, op, channel, &ev) == 0)
+			return;
+	}
+
+	if (op == EPOLL_CTL_ADD && errno == EPERM)
+	{
+		epoll_unpollable[channel] = 1;
+		epoll_unpollable_count++;
+	}
+	else if (op == EPOLL_CTL_DEL && (errno == ENOENT || errno == EBADF))
+		(void) 0;
+	else
+		syserr(CSRV(channel), "ksetevents(epoll): epoll_ctl(%d) failed: %s",
+				channel, strerror(errno));
+}
+
+static  void    kread (int vfd)	      
+{ 
+	int	channel = CHANNEL(vfd);
+	ksetevents(channel, epoll_wanted[channel] | EPOLLIN);
+}
+
+static  void    knoread (int vfd)
+{
+	int	channel = CHANNEL(vfd);
+	ksetevents(channel, epoll_wanted[channel] & ~EPOLLIN);
+}
+
+static  void    kholdread (int vfd)   { knoread(vfd); }
+static  void    kunholdread (int vfd) { kread(vfd); }
+
+static  void    kwrite (int vfd)
+{
+	int	channel = CHANNEL(vfd);
+	ksetevents(channel, epoll_wanted[channel] | EPOLLOUT);
+}
+
+static  void    knowrite (int vfd)
+{
+	int	channel = CHANNEL(vfd);
+	ksetevents(channel, epoll_wanted[channel] & ~EPOLLOUT);
+}
+
+static	void	kcleaned (int vfd) { return; }
+
+static	int	kdoit (Timeval *timeout)
+{
+	struct epoll_event	events[EPOLL_MAX_EVENTS];
+	int	ms;
+	int	i, channel, vfd;
+	int	retval;
+
+	/* Round up, so a sub-millisecond timeout doesn't become a poll. */
+	if (timeout == NULL)
+		ms = -1;
+	else
+		ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+
+	if (epoll_unpollable_count)
+		ms = 0;
+
+	errno = 0;
+	retval = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, ms);
+
+	if (retval < 0)
+	{
+		if (errno != EINTR)
+			syserr(-1, "kdoit(epoll): epoll_wait() failed: %s", 
+					strerror(errno));
+		return retval;
+	}
+
+	for (i = 0; i < retval; i++)
+	{
+		channel = events[i].data.fd;
+		vfd = VFD(channel);
+
+		/* An earlier event in this batch may have closed this fd. */
+		if (vfd < 0 || vfd > global_max_vfd || !io_rec[vfd])
+			continue;
+
+		if (io_rec[vfd]->write_callback && (events[i].events & 
+				(EPOLLOUT | EPOLLERR | EPOLLHUP)))
+		{
+			new_write_event(vfd);
+			if (!(events[i].events & ~EPOLLOUT))
+				continue;
+		}
+
+		/* If it's dirty, it will be back. */
+		if (!io_rec[vfd]->clean)
+			continue;
+		new_io_event(vfd);
+	}
+
+	if (epoll_unpollable_count)
+	{
+	    for (channel = 0; channel <= global_max_channel; channel++)
+	    {
+		if (!epoll_unpollable[channel] || !epoll_wanted[channel])
+			continue;
+
+		vfd = VFD(channel);
+		if (!io_rec[vfd] || !io_rec[vfd]->clean)
+			continue;
+		new_io_event(vfd);
+		retval++;
+	    }
+	}
+
+	return retval;
+}
+
+static	void	klock (void) { return; }
+static	void	kunlock (void) { return; }
+
+static	int	ksleep (double timeout)
+{
+	Timeval interval;
+
+	interval.tv_sec = (time_t)timeout;
+	interval.tv_usec = (timeout - interval.tv_sec) * 1000000;
+	return select(0, NULL, NULL, NULL, &interval);
+}
+
+static	int	kreadable (int vfd, double timeout)
+{
+	fd_set	fd_read;
+	Timeval	interval;
+
+	FD_ZERO(&fd_read);
+	FD_SET(CHANNEL(vfd), &fd_read);
+	interval.tv_sec = (time_t)timeout;
+	interval.tv_usec = (timeout - interval.tv_sec) * 1000000;
+	return select(CHANNEL(vfd) + 1, &fd_read, NULL, NULL, &interval);
+}
+
+static	int	kwritable (int vfd, double timeout)
+{
+	fd_set	fd_read;
+	Timeval	interval;
+
+	FD_ZERO(&fd_read);
+	FD_SET(CHANNEL(vfd), &fd_read);
+	interval.tv_sec = (time_t)timeout;
+	interval.tv_usec = (timeout - interval.tv_sec) * 1000000;
+	return select(CHANNEL(vfd) + 1, NULL, &fd_read, NULL, &interval);
+}
+
+static	int	kwatchwrites (void) { return 1; }
+
 #endif
 
 
@@ -1676,6 +2114,9 @@ static	int	kwritable (int vfd, double timeout)
 	return select(CHANNEL(vfd) + 1, NULL, &fd_read, NULL, &interval);
 }
 
+/* The i/o threads only know how to read. */
+static	int	kwatchwrites (void) { return 0; }
+
 #endif
 
 /************************************************************************/
@@ -1825,5 +2266,8 @@ static	int	kwritable (int vfd, double timeout)
 	return select(CHANNEL(vfd) + 1, NULL, &fd_read, NULL, &interval);
 }
 
+/* Writable events would look just like readable ones. */
+static	int	kwatchwrites (void) { return 0; }
+
 #endif
 
@@ -1465,6 +1465,12 @@ DISPLAY:
 
 		if (!channel_is_syncing(channel, from_server))
 			display_msg(from, comm, ArgList);
+		else
+		{
+			channel_names_done(channel, from_server);
+			if (server_has_cap(from_server, "twitch.tv/commands"))
+				channel_not_waiting(channel, from_server);
+		}
 
 		break;
 	}
@@ -68,6 +68,33 @@ static	void	strip_modes (const char *, const char *, const char *);
 /* User and host information from server 2.7 */
 const char	*FromUserHost = empty_string;
 
+/*
+ * IRCv3 message tags (the "@key=value;key2=value2" that can come before
+ * the :sender).  parse_server() strips them off before anything else looks
+ * at the line, so the handlers never have to know about them.  They are
+ * only split up into keys and values if somebody asks for one, and the
+ * values are only unescaped when they are asked for.
+ */
+#define MESSAGE_TAGS_INLINE	64	/* More than this are malloc()ed */
+
+typedef struct {
+	const char *	key;
+	size_t		keylen;
+	const char *	value;
+	size_t		valuelen;
+} MessageTag;
+
+typedef struct {
+	const char *	raw;		/* The tags, as received */
+	int		parsed;		/* Has 'tags' been filled in yet? */
+	int		count;
+	int		size;		/* How many 'tags' has room for */
+	MessageTag *	tags;		/* 'some', unless there were lots */
+	MessageTag	some[MESSAGE_TAGS_INLINE];
+} MessageTags;
+
+static	MessageTags *	current_tags = NULL;
+
 /*
  * is_channel: determines if the argument is a channel.  If it's a number,
  * begins with MULTI_CHANNEL and has no '*', or STRING_CHANNEL, then its a
@@ -242,6 +269,143 @@ static void 	BreakArgs (char *Input, const char **Sender, const char **OutPut)
 	OutPut[ArgCount] = NULL;
 }
 
+/*
+ * split_message_tags: Fill in the key/value view of the current line's
+ * tags.  Nothing is copied; each tag just points into 'raw'.
+ */
+static void	split_message_tags (MessageTags *mt)
+{
+	const char *	p;
+	const char *	end;
+	const char *	eq;
+	MessageTag *	t;
+
+	mt->parsed = 1;
+	mt->count = 0;
+
+	for (p = mt->raw; *p; p = end)
+	{
+		end = p + strcspn(p, ";");
+
+		if (end > p)
+		{
+			if (mt->count == mt->size)
+			{
+				mt->size *= 2;
+				if (mt->tags == mt->some)
+				{
+					mt->tags = new_malloc(sizeof(MessageTag) * mt->size);
+					memcpy(mt->tags, mt->some, sizeof(mt->some));
+				}
+				else
+					RESIZE(mt->tags, MessageTag, mt->size);
+			}
+
+			t = &mt->tags[mt->count++];
+			t->key = p;
+			if ((eq = memchr(p, '=', end - p)))
+			{
+				t->keylen = eq - p;
+				t->value = eq + 1;
+				t->valuelen = end - (eq + 1);
+			}
+			else
+			{
+				t->keylen = end - p;
+				t->value = end;
+				t->valuelen = 0;
+			}
+		}
+
+		if (*end == ';')
+			end++;
+	}
+}
+
+/*
+ * get_message_tags: Return the IRCv3 message tags of the line currently 
+ * being handled, as they were sent (without the leading @), or the empty
+ * string if there weren't any.
+ */
+const char *	get_message_tags (void)
+{
+	if (!current_tags)
+		return empty_string;
+	return current_tags->raw;
+}
+
+/*
+ * find_message_tag: Return the tag 'name' of the line currently being 
+ * handled, or NULL if it doesn't have one.  If the tag is there more than
+ * once, the last one wins (as per the IRCv3 message-tags spec).
+ */
+static MessageTag *	find_message_tag (const char *name)
+{
+	MessageTag *	t;
+	size_t		len;
+	int		i;
+
+	if (!current_tags || !name || !*name)
+		return NULL;
+
+	if (!current_tags->parsed)
+		split_message_tags(current_tags);
+
+	len = strlen(name);
+	for (i = current_tags->count - 1; i >= 0; i--)
+	{
+		t = &current_tags->tags[i];
+		if (t->keylen == len && !strncmp(t->key, name, len))
+			return t;
+	}
+	return NULL;
+}
+
+/*
+ * get_message_tag: Return the (unescaped) value of the IRCv3 message tag
+ * 'name' for the line currently being handled.  A tag without a value 
+ * returns the empty string.  If the tag is not present, NULL is returned.
+ * If the return value is not NULL, YOU MUST new_free() IT.
+ */
+char *	get_message_tag (const char *name)
+{
+	MessageTag *	t;
+	char *		retval;
+	char *		out;
+	const char *	p;
+	const char *	end;
+
+	if (!(t = find_message_tag(name)))
+		return NULL;
+
+	/* Unescape the value, as per the IRCv3 message-tags spec */
+	out = retval = new_malloc(t->valuelen + 1);
+	end = t->value + t->valuelen;
+	for (p = t->value; p < end; p++)
+	{
+		if (*p != '\\')
+		{
+			*out++ = *p;
+			continue;
+		}
+
+		/* A trailing backslash is just dropped */
+		if (++p == end)
+			break;
+
+		switch (*p)
+		{
+			case ':':	*out++ = ';';	break;
+			case 's':	*out++ = ' ';	break;
+			case 'r':	*out++ = '\r';	break;
+			case 'n':	*out++ = '\n';	break;
+			default:	*out++ = *p;	break;
+		}
+	}
+	*out = 0;
+	return retval;
+}
+
 /* in response to a TOPIC message from the server */
 static void	p_topic (const char *from, const char *comm, const char **ArgList)
 {
@@ -403,6 +567,10 @@ static void	p_privmsg (const char *from, const char *comm, const char **ArgList)
 	set_server_doing_privmsg(from_server, 1);
 	sed = 0;
 
+	/* Anybody who talks on a channel is on it */
+	if (is_channel(target))
+		channel_saw_speaker(target, from, from_server, FromUserHost);
+
 	/*
 	 * Do ctcp's first, and if there's nothing left, then dont
 	 * go to all the work below.  Plus, we dont set message_from
@@ -652,6 +820,42 @@ static void	p_error (const char *from, const char *comm, const char **ArgList)
 		say("%s %s", from, the_error);
 }
 
+/*
+ * CAP <target> <subcommand> [*] :<capabilities>
+ * We ask for /SET CAPABILITIES when we register (see register_server).
+ * The server's answers are kept with the server, where they can be seen 
+ * with $serverctl(GET <refnum> CAPS) and CAPS_AVAILABLE.
+ */
+static void	p_cap (const char *from, const char *comm, const char **ArgList)
+{
+	const char *	subcmd;
+	const char *	caps;
+	int		more = 0;
+
+	if (!ArgList[0] || !(subcmd = ArgList[1]) || !(caps = ArgList[2]))
+		{ rfc1459_odd(from, comm, ArgList); return; }
+
+	/* "CAP * LS * :..." means there are more lines to come */
+	if (!strcmp(caps, star) && ArgList[3])
+	{
+		more = 1;
+		caps = ArgList[3];
+	}
+
+	if (!strcmp(subcmd, "LS"))
+		server_caps_listed(from_server, caps, more);
+	else if (!strcmp(subcmd, "ACK"))
+		server_caps_acked(from_server, caps);
+	else if (!strcmp(subcmd, "NEW"))
+		server_caps_new(from_server, caps);
+	else if (!strcmp(subcmd, "DEL"))
+		server_caps_deleted(from_server, caps);
+	else if (!strcmp(subcmd, "NAK"))
+		server_caps_nakked(from_server, caps);
+	else
+		rfc1459_odd(from, comm, ArgList);
+}
+
 static void	p_channel (const char *from, const char *comm, const char **ArgList)
 {
 	const char	*channel;
@@ -681,7 +885,14 @@ static void	p_channel (const char *from, const char *comm, const char **ArgList)
 	if (is_me(from_server, from))
 	{
 		add_channel(channel, from_server);
-		send_to_server("MODE %s", channel);
+
+		/*
+		 * Twitch has no MODE or WHO for channels; it would just 
+		 * say "Unknown command".  We finish syncing at the end of
+		 * the NAMES list instead (see 366 in numbers.c).
+		 */
+		if (!server_has_cap(from_server, "twitch.tv/commands"))
+			send_to_server("MODE %s", channel);
 	}
 	else
 	{
@@ -973,6 +1184,9 @@ static void strip_modes (const char *from, const char *channel, const char *line
 	char	*free_copy;
 	int	l;
 
+	if (!hook_is_listened(MODE_STRIPPED_LIST))
+		return;
+
 	free_copy = LOCAL_COPY(line);
 	copy = free_copy;
 	mode = next_arg(copy, &copy);
@@ -1442,6 +1656,168 @@ static void 	p_notice (const char *from, const char *comm, const char **ArgList)
 	notify_mark(from_server, from, 1, 0);
 }
 
+/*
+ * The twitch.tv/commands capability adds a handful of commands that are
+ * not in rfc1459.  Most of what they have to say is in the message tags
+ * (see $tag()), so all of them throw /ON TWITCH as
+ *	$0 - The command (ie, USERNOTICE)
+ *	$1 - Who sent it (usually the server)
+ *	$2 - The channel (or * if there isn't one)
+ *	$3- - Whatever else there was
+ * and only the ones that are "messages" are displayed by default.
+ */
+static int	twitch_hook (const char *from, const char *comm, const char *channel, const char *rest)
+{
+	if (!from || !*from)
+		from = star;
+	if (!channel || !*channel)
+		channel = star;
+	if (!rest)
+		rest = empty_string;
+
+	return do_hook(TWITCH_LIST, "%s %s %s %s", comm, from, channel, rest);
+}
+
+/* USERNOTICE #channel [:message] -- Subs, raids, and so forth */
+static void	p_usernotice (const char *from, const char *comm, const char **ArgList)
+{
+	const char *	channel;
+	const char *	message;
+	char *		system_msg;
+	int		l;
+
+	if (!(channel = ArgList[0]))
+		{ rfc1459_odd(from, comm, ArgList); return; }
+	if (!(message = ArgList[1]))
+		message = empty_string;
+
+	system_msg = get_message_tag("system-msg");
+
+	l = message_from(channel, LEVEL_NOTICE);
+	if (twitch_hook(from, comm, channel, message))
+	{
+		if (system_msg && *system_msg && *message)
+			say("%s: %s [%s]", channel, system_msg, message);
+		else if (system_msg && *system_msg)
+			say("%s: %s", channel, system_msg);
+		else
+			say("%s: %s", channel, message);
+	}
+	pop_message_from(l);
+	new_free(&system_msg);
+}
+
+/* CLEARCHAT #channel [:nick] -- Timeouts, bans and /clear */
+static void	p_clearchat (const char *from, const char *comm, const char **ArgList)
+{
+	const char *	channel;
+	const char *	nick;
+	char *		duration;
+	int		l;
+
+	if (!(channel = ArgList[0]))
+		{ rfc1459_odd(from, comm, ArgList); return; }
+	nick = ArgList[1];
+
+	duration = get_message_tag("ban-duration");
+
+	l = message_from(channel, LEVEL_KICK);
+	if (twitch_hook(from, comm, channel, nick))
+	{
+		if (!nick || !*nick)
+			say("Chat in %s was cleared", channel);
+		else if (duration && *duration)
+			say("%s was timed out of %s for %s seconds", 
+				nick, channel, duration);
+		else
+			say("%s was banned from %s", nick, channel);
+	}
+	pop_message_from(l);
+	new_free(&duration);
+}
+
+/* CLEARMSG #channel :message -- One message was deleted */
+static void	p_clearmsg (const char *from, const char *comm, const char **ArgList)
+{
+	const char *	channel;
+	const char *	message;
+	char *		login;
+	int		l;
+
+	if (!(channel = ArgList[0]))
+		{ rfc1459_odd(from, comm, ArgList); return; }
+	if (!(message = ArgList[1]))
+		message = empty_string;
+
+	login = get_message_tag("login");
+
+	l = message_from(channel, LEVEL_KICK);
+	if (twitch_hook(from, comm, channel, message))
+		say("A message from %s was deleted in %s: %s", 
+			login && *login ? login : star, channel, message);
+	pop_message_from(l);
+	new_free(&login);
+}
+
+/* HOSTTARGET #channel :<target|-> [viewers] */
+static void	p_hosttarget (const char *from, const char *comm, const char **ArgList)
+{
+	const char *	channel;
+	const char *	stuff;
+	char *		target;
+	char *		viewers;
+	int		l;
+
+	if (!(channel = ArgList[0]))
+		{ rfc1459_odd(from, comm, ArgList); return; }
+	if (!(stuff = ArgList[1]))
+		{ rfc1459_odd(from, comm, ArgList); return; }
+
+	viewers = LOCAL_COPY(stuff);
+	if (!(target = next_arg(viewers, &viewers)))
+		{ rfc1459_odd(from, comm, ArgList); return; }
+
+	l = message_from(channel, LEVEL_OTHER);
+	if (twitch_hook(from, comm, channel, stuff))
+	{
+		if (*target == '-')
+			say("%s has stopped hosting", channel);
+		else
+			say("%s is now hosting %s", channel, target);
+	}
+	pop_message_from(l);
+}
+
+/*
+ * ROOMSTATE, USERSTATE and GLOBALUSERSTATE just tell us about state
+ * that lives in the tags.  Nobody wants to see these every time they 
+ * send a message, so they are only thrown to /ON TWITCH.
+ */
+static void	p_twitch_state (const char *from, const char *comm, const char **ArgList)
+{
+	int	l;
+
+	l = message_from(ArgList[0], LEVEL_OTHER);
+	twitch_hook(from, comm, ArgList[0], NULL);
+	pop_message_from(l);
+}
+
+/*
+ * RECONNECT -- The server is about to go away and wants us to come back.
+ * Like p_kill, this is advisory; the server will close the connection and
+ * the usual server state machinery decides whether to reconnect.
+ */
+static void	p_reconnect (const char *from, const char *comm, const char **ArgList)
+{
+	int	l;
+
+	l = message_from(NULL, LEVEL_OTHER);
+	if (twitch_hook(from, comm, NULL, NULL))
+		say("Server %s asked us to reconnect", 
+			from && *from ? from : get_server_itsname(from_server));
+	pop_message_from(l);
+}
+
 void	rfc1459_odd (const char *from, const char *comm, const char **ArgList)
 {
 	const char *	stuff;
@@ -1462,9 +1838,14 @@ void	rfc1459_odd (const char *from, const char *comm, const char **ArgList)
 protocol_command rfc1459[] = {
 {	"ADMIN",	NULL,		0		},
 {	"AWAY",		NULL,		0		},
+{	"CAP",		p_cap,		0		},
+{	"CLEARCHAT",	p_clearchat,	0		},
+{	"CLEARMSG",	p_clearmsg,	0		},
 { 	"CONNECT",	NULL,		0		},
 {	"ERROR",	p_error,	0		},
 {	"ERROR:",	p_error,	0		},
+{	"GLOBALUSERSTATE", p_twitch_state, PROTO_NOARGS	},
+{	"HOSTTARGET",	p_hosttarget,	0		},
 {	"INFO",		NULL,		0		},
 {	"INVITE",	p_invite,	0		},
 {	"ISON",		NULL,		PROTO_QUOTEBAD	},
@@ -1484,8 +1865,10 @@ protocol_command rfc1459[] = {
 {	"PONG",		p_pong,		0		},
 {	"PRIVMSG",	p_privmsg,	0		},
 {	"QUIT",		p_quit,		PROTO_QUOTEBAD	},
+{	"RECONNECT",	p_reconnect,	PROTO_NOARGS	},
 {	"REHASH",	NULL,		0		},
 {	"RESTART",	NULL,		0		},
+{	"ROOMSTATE",	p_twitch_state,	0		},
 {	"RPONG",	p_rpong,	0		},
 {	"SERVER",	NULL,		PROTO_QUOTEBAD	},
 {	"SILENCE",	p_silence,	0		},
@@ -1497,7 +1880,9 @@ protocol_command rfc1459[] = {
 {	"TRACE",	NULL,		0		},
 {	"USER",		NULL,		0		},
 {	"USERHOST",	NULL,		PROTO_QUOTEBAD	},
+{	"USERNOTICE",	p_usernotice,	0		},
 {	"USERS",	NULL,		0		},
+{	"USERSTATE",	p_twitch_state,	0		},
 {	"VERSION",	NULL,		0		},
 {	"WALLOPS",	p_wallops,	0		},
 {	"WHO",		NULL,		PROTO_QUOTEBAD	},
@@ -1508,6 +1893,60 @@ protocol_command rfc1459[] = {
 #define NUMBER_OF_COMMANDS (sizeof(rfc1459) / sizeof(protocol_command)) - 2;
 int 	num_protocol_cmds = -1;
 
+/*
+ * The protocol commands are looked up through an open-addressed hash
+ * table that is built from rfc1459[] the first time we need it.  It has
+ * to be at least twice as big as rfc1459[] and a power of two.
+ */
+#define PROTOCOL_HASH_SIZE	128
+
+static	protocol_command *	protocol_hash[PROTOCOL_HASH_SIZE];
+
+static u_32int_t	protocol_hash_key (const char *command)
+{
+	u_32int_t	h = 2166136261U;	/* FNV-1a */
+
+	while (*command)
+	{
+		h ^= (unsigned char)*command++;
+		h *= 16777619U;
+	}
+	return h & (PROTOCOL_HASH_SIZE - 1);
+}
+
+static void	init_protocol_hash (void)
+{
+	int		loc;
+	u_32int_t	i;
+
+	if ((size_t)PROTOCOL_HASH_SIZE < 2 * (sizeof(rfc1459) / sizeof(protocol_command)))
+		panic(1, "PROTOCOL_HASH_SIZE is too small for rfc1459[]");
+
+	for (i = 0; i < PROTOCOL_HASH_SIZE; i++)
+		protocol_hash[i] = NULL;
+
+	for (loc = 0; rfc1459[loc].command; loc++)
+	{
+		i = protocol_hash_key(rfc1459[loc].command);
+		while (protocol_hash[i])
+			i = (i + 1) & (PROTOCOL_HASH_SIZE - 1);
+		protocol_hash[i] = &rfc1459[loc];
+	}
+}
+
+static protocol_command *	find_protocol_command (const char *command)
+{
+	u_32int_t	i;
+
+	for (i = protocol_hash_key(command); protocol_hash[i]; 
+				i = (i + 1) & (PROTOCOL_HASH_SIZE - 1))
+	{
+		if (!strcmp(protocol_hash[i]->command, command))
+			return protocol_hash[i];
+	}
+	return NULL;
+}
+
 #define islegal(c) ((((c) >= 'A') && ((c) <= '~')) || \
                     (((c) >= '0') && ((c) <= '9')) || \
 		     ((c) == '*') || \
@@ -1524,22 +1963,56 @@ void 	parse_server (const char *orig_line, size_t orig_line_size)
 	const char	**ArgList;
 	const char	*TrueArgs[MAXPARA + 2];	/* Include space for command */
 	const char 	*OldFromUserHost;
-	int	loc;
+	MessageTags	tags, *old_tags;
+	protocol_command *proto;
 	char	*line;
 
 	if (num_protocol_cmds == -1)
+	{
 		num_protocol_cmds = NUMBER_OF_COMMANDS;
+		init_protocol_hash();
+	}
 
 	if (!orig_line || !*orig_line)
 		return;		/* empty line from server -- bye bye */
 
+	/*
+	 * Take the IRCv3 message tags off the front, if there are any.
+	 * Everything after this point sees the line as if there were no tags.
+	 * The tags remain available through $tag() and $tags() until we're
+	 * done with the line.
+	 */
+	tags.raw = empty_string;
+	tags.parsed = 0;
+	tags.count = 0;
+	tags.size = MESSAGE_TAGS_INLINE;
+	tags.tags = tags.some;
+	if (*orig_line == '@')
+	{
+		size_t	len = strcspn(orig_line, " ");
+		char *	raw;
+
+		raw = alloca(len);
+		memcpy(raw, orig_line + 1, len - 1);
+		raw[len - 1] = 0;
+		tags.raw = raw;
+
+		orig_line += len;
+		while (*orig_line == ' ')
+			orig_line++;
+		if (!*orig_line)
+			return;		/* Nothing but tags -- bye bye */
+	}
+	old_tags = current_tags;
+	current_tags = &tags;
+
 	if (*orig_line == ':')
 	{
 		if (!do_hook(RAW_IRC_LIST, "%s", orig_line + 1))
-			return;
+			goto done;
 	}
 	else if (!do_hook(RAW_IRC_LIST, "* %s", orig_line))
-		return;
+		goto done;
 
 	if (inbound_line_mangler)
 	{
@@ -1556,35 +2029,38 @@ void 	parse_server (const char *orig_line, size_t orig_line_size)
 	ArgList = TrueArgs;
 	BreakArgs(line, &from, ArgList);
 
-	if ((!(comm = *ArgList++)) || !from || !*ArgList)
+	if ((comm = *ArgList++) && !is_number(comm))
+		proto = find_protocol_command(comm);
+	else
+		proto = NULL;
+
+	if (!comm || !from || 
+	    (!*ArgList && !(proto && (proto->flags & PROTO_NOARGS))))
 	{ 
 		rfc1459_odd(from, comm, ArgList);
-		return;		/* Serious protocol violation -- ByeBye */
+		goto done;	/* Serious protocol violation -- ByeBye */
 	}
 
 	if (*from && !islegal(*from))
 	{ 
 		rfc1459_odd(from, comm, ArgList);
-		return;		
+		goto done;
 	}
 
-	/* Some day all this needs to be replaced with an alist. */
+	/* Numerics are handled by the big switch in numbers.c */
 	if (is_number(comm))
 		numbered_command(from, comm, ArgList);
+	else if (proto && proto->inbound_handler)
+		proto->inbound_handler(from, comm, ArgList);
 	else
-	{
-		for (loc = 0; rfc1459[loc].command; loc++)
-			if (!strcmp(rfc1459[loc].command, comm))
-				break;
-
-		if (rfc1459[loc].command && rfc1459[loc].inbound_handler)
-			rfc1459[loc].inbound_handler(from, comm, ArgList);
-		else
-			rfc1459_odd(from, comm, ArgList);
-	}
+		rfc1459_odd(from, comm, ArgList);
 
 	FromUserHost = OldFromUserHost;
 	from_server = -1;
+done:
+	current_tags = old_tags;
+	if (tags.tags != tags.some)
+		new_free((char **)&tags.tags);
 }
 
 /*
@@ -1658,9 +2134,14 @@ void	rfc1459_any_to_utf8 (char *buffer, size_t buffsiz, char **extra)
 	/* 
 	 * Point the "server part" at the start, and move the 
 	 * "payload part" to the argument starting with colon.
+	 * IRCv3 message tags can't contain spaces, so skip them first
+	 * to keep the space before the :sender from looking like a payload.
 	 */
 	server_part = buffer;
-	for (payload_part = server_part; *payload_part; payload_part++)
+	payload_part = server_part;
+	if (*payload_part == '@')
+		payload_part += strcspn(payload_part, " ");
+	for (; *payload_part; payload_part++)
 	{
 		if (payload_part[0] == ' ' && payload_part[1] == ':')
 		{
@@ -1846,7 +2327,7 @@ void	rfc1459_any_to_utf8 (char *buffer, size_t buffsiz, char **extra)
 	if (*payload_part)
 		bytes_needed += strlen(payload_part) + 1;
 
-	if (bytes_needed > buffsiz)
+	if (bytes_needed >= buffsiz)
 	{
 		*extra = new_malloc(bytes_needed + 2);
 		buffer = *extra;
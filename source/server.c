@@ -55,6 +55,7 @@
 #include "vars.h"
 #include "newio.h"
 #include "reg.h"
+#include "timer.h"
 
 /************************ SERVERLIST STUFF ***************************/
 
@@ -133,6 +134,11 @@ static	void	free_serverinfo (ServerInfo *s);
 static	int	serverinfo_to_servref (ServerInfo *s);
 static	int	serverinfo_to_newserv (ServerInfo *s);
 static 	void 	remove_from_server_list (int i);
+static	void	bucket_set (TokenBucket *b, int capacity, double period);
+static	void	discard_sendq (Server *s, int keep_partial);
+static	void	hold_server_sendq (int refnum);
+static	void	release_server_sendq (int refnum);
+static	int	get_server_addr_family (int server);
 static	char *	shortname (const char *oname);
 static void	set_server_uh_addr (int refnum);
 
@@ -783,6 +789,32 @@ static	int	serverinfo_to_newserv (ServerInfo *si)
 
 	s->ssl_certificate = NULL;
 	s->ssl_certificate_hash = NULL;
+	s->ssl_resume_hits = 0;
+	s->ssl_resume_misses = 0;
+
+	s->sendq_head = NULL;
+	s->sendq_tail = NULL;
+	s->sendq_depth = 0;
+	s->sendq_bytes = 0;
+	s->sendq_offset = 0;
+	s->sendq_pending = NULL;
+	s->sendq_pending_len = 0;
+	s->sendq_pending_offset = 0;
+	bucket_set(&s->send_bucket, 0, 1);
+	bucket_set(&s->join_bucket, 0, 1);
+	bucket_set(&s->chan_bucket, 0, 1);
+	s->chan_buckets.list = NULL;
+	s->chan_buckets.max = 0;
+	s->chan_buckets.total_max = 0;
+	s->chan_buckets.func = (alist_func)my_stricmp;
+	s->chan_buckets.hash = HASH_INSENSITIVE;
+	s->throttled = 0;
+	s->throttled_since.tv_sec = 0;
+	s->throttled_since.tv_usec = 0;
+	s->sendq_held = 0;
+	s->caps_available = NULL;
+	s->caps = NULL;
+	s->caps_listing = 0;
 
 	s->stricmp_table = 1;		/* By default, use rfc1459 */
 	s->funny_match = NULL;
@@ -881,6 +913,7 @@ static 	void 	remove_from_server_list (int i)
 	set_server_status(i, SERVER_DELETED);
 
 	clean_server_queues(i);
+	discard_sendq(s, 0);
 	new_free(&s->itsname);
 	new_free(&s->away);
 	new_free(&s->version_string);
@@ -900,6 +933,8 @@ static 	void 	remove_from_server_list (int i)
 	new_free(&s->sent_body);
 	new_free(&s->ssl_certificate);
 	new_free(&s->ssl_certificate_hash);
+	new_free(&s->caps_available);
+	new_free(&s->caps);
 	new_free(&s->funny_match);
 	new_free(&s->default_realname);
 	destroy_notify_list(i);
@@ -1383,6 +1418,13 @@ BUILT_IN_COMMAND(servercmd)
 
 
 /* SERVER INPUT STUFF */
+/* The most lines do_server() will take from dgets_lines() at once */
+#define MAX_SERVER_LINES 64
+/* The most time do_server() will spend on one batch of lines */
+#define SERVER_BATCH_TIME 0.1
+/* IRCv3 message tags don't count against the server's line length */
+#define MESSAGE_TAGS_LENGTH 8191
+
 /*
  * do_server: A callback suitable for use with new_open() to handle servers
  *
@@ -1406,7 +1448,6 @@ BUILT_IN_COMMAND(servercmd)
 void	do_server (int fd)
 {
 	Server *s;
-	char	buffer[IO_BUFFER_SIZE + 1];
 	int	des,
 		i, l;
 	char *extra = NULL;
@@ -1414,7 +1455,7 @@ void	do_server (int fd)
 	for (i = 0; i < number_of_servers; i++)
 	{
 		ssize_t	junk;
-		char 	*bufptr = buffer;
+		char 	*bufptr;
 		int	retval = 0;
 
 		if (!(s = get_server(i)))
@@ -1534,6 +1575,10 @@ void	do_server (int fd)
 				}
 				else
 				{
+				    dns_cache_store(s->info->host, 
+					ltoa(s->info->port), 
+					get_server_addr_family(i),
+					s->addrs, s->addr_len);
 				    unmarshall_getaddrinfo(s->addrs);
 				    s->des = new_close(s->des);
 
@@ -1636,7 +1681,8 @@ something_broke:
 			{
 				/* XXX 'des' might not be both the vfd and channel! */
 				/* (ie, on systems where vfd != channel) */
-				int	ssl_err = ssl_startup(des, des);
+				int	ssl_err = ssl_startup(des, des, 
+						s->info->host, s->info->port);
 
 				/* SSL connection failed */
 				if (ssl_err == -1)
@@ -1714,6 +1760,11 @@ return_from_ssl_detour:
 				goto something_broke;
 			}
 
+			if (get_ssl_resumed(des))
+				s->ssl_resume_hits++;
+			else
+				s->ssl_resume_misses++;
+
 			goto return_from_ssl_detour;	/* All is well! */
 		}
 #endif
@@ -1721,66 +1772,126 @@ return_from_ssl_detour:
 		/* Everything else is a normal read. */
 		else
 		{
+			char	lines_buffer[IO_BUFFER_SIZE * 4];
+			char *	line_starts[MAX_SERVER_LINES];
+			ssize_t	n;
+			int	batch, done = 0;
+			Timeval	batch_start;
+
 			last_server = i;
-			junk = dgets(des, bufptr, get_server_line_length(i), 1);
+			if ((batch = get_int_var(SERVER_BATCH_SIZE_VAR)) < 1)
+				batch = 1;
+			get_time(&batch_start);
 
-			/* 
-			 * If we were to support encapsulating protocols, 
-			 * we would do the extraction here.  In the end, 
-			 * we want 'bufptr' to contain the rfc1459 message,
-			 * and whatever metadata would go into other vars.
-			 *
-			 * XXX TODO - We need to de-couple the protocol
-			 * status (to the server) from the status of the
-			 * socket we use to talk to it.
+			/*
+			 * Take every complete line we already have, up to
+			 * /SET SERVER_BATCH_SIZE lines or SERVER_BATCH_TIME
+			 * seconds, and only redraw the screen once at the end.
+			 * Whatever is left over will be here next time.
 			 */
-
-			switch (junk)
+			if (batch > 1)
+				defer_window_updates();
+			while (done < batch)
 			{
-				case 0:		/* Sit on incomplete lines */
-					break;
+				junk = dgets_lines(des, lines_buffer, sizeof(lines_buffer),
+					MIN(get_server_line_length(i) + MESSAGE_TAGS_LENGTH,
+					    IO_BUFFER_SIZE),
+					line_starts, MIN(batch - done, MAX_SERVER_LINES));
 
-				case -1:	/* EOF or other error */
-				{
-					server_is_unregistered(i);
-					close_server(i, NULL);
-					say("Connection closed from %s", s->info->host);
-					i++;		/* NEVER DELETE THIS! */
-					break;
-				}
+				/* 
+				 * If we were to support encapsulating protocols, 
+				 * we would do the extraction here.  In the end, 
+				 * we want 'bufptr' to contain the rfc1459 message,
+				 * and whatever metadata would go into other vars.
+				 *
+				 * XXX TODO - We need to de-couple the protocol
+				 * status (to the server) from the status of the
+				 * socket we use to talk to it.
+				 */
 
-				default:	/* New inbound data */
+				switch (junk)
 				{
-					char *end;
-					int	l2;
-
-					end = strlen(buffer) + buffer;
-					if (*--end == '\n')
-						*end-- = '\0';
-					if (*end == '\r')
-						*end-- = '\0';
-
-					rfc1459_any_to_utf8(bufptr, sizeof(buffer), &extra);
-					if (extra)
-						bufptr = extra;
-
-					if (x_debug & DEBUG_INBOUND)
-						yell("[%d] <- [%s]", 
-							s->des, bufptr);
-
-					parsing_server_index = i;
-					/* I added this for caf. :) */
-					if (do_hook(RAW_IRC_BYTES_LIST, "%s", buffer))
+					case 0:		/* Sit on incomplete lines */
+						break;
+
+					case -1:	/* EOF or other error */
 					{
-					    /* XXX What should 2nd arg be? */
-					    parse_server(bufptr, sizeof buffer);
+						server_is_unregistered(i);
+						close_server(i, NULL);
+						say("Connection closed from %s", s->info->host);
+						i++;		/* NEVER DELETE THIS! */
+						break;
 					}
-					parsing_server_index = NOSERV;
 
-					new_free(&extra);
+					default:	/* New inbound data */
+					for (n = 0; n < junk; n++)
+					{
+						char *	line;
+						char *	end;
+						size_t	size;
+
+						/*
+						 * Something we did for a previous line
+						 * (ie, an /ON) may have closed or 
+						 * reconnected this server.  If so, the
+						 * rest of these lines are stale.
+						 */
+						if (get_server(i) != s || s->des != des)
+							break;
+
+						/* parse_server() resets this each time */
+						from_server = i;
+
+						/*
+						 * The line is used right where
+						 * dgets_lines() put it.  It owns
+						 * the bytes up to its nul, so it
+						 * can be recoded in place as long
+						 * as it doesn't grow; if it does,
+						 * the result goes in 'extra'.
+						 */
+						line = bufptr = line_starts[n];
+						size = strlen(line) + 1;
+
+						end = line + size - 1;
+						if (*--end == '\n')
+							*end-- = '\0';
+						if (end >= line && *end == '\r')
+							*end-- = '\0';
+
+						rfc1459_any_to_utf8(bufptr, size, &extra);
+						if (extra)
+							bufptr = extra;
+
+						if (x_debug & DEBUG_INBOUND)
+							yell("[%d] <- [%s]", 
+								s->des, bufptr);
+
+						parsing_server_index = i;
+						/* I added this for caf. :) */
+						if (do_hook(RAW_IRC_BYTES_LIST, "%s", bufptr))
+						{
+						    /* XXX What should 2nd arg be? */
+						    parse_server(bufptr, size);
+						}
+						parsing_server_index = NOSERV;
+
+						new_free(&extra);
+					}
+					done += junk;
 					break;
 				}
+
+				if (junk <= 0)
+					break;
+				if (get_server(i) != s || s->des != des)
+					break;
+				if (time_diff(batch_start, get_time(NULL)) > 
+						SERVER_BATCH_TIME)
+					break;
 			}
+			if (batch > 1)
+				resume_window_updates();
 		}
 
 		pop_message_from(l);
@@ -1789,6 +1900,548 @@ return_from_ssl_detour:
 }
 
 
+/* OUTBOUND QUEUE STUFF */
+/*
+ * Every line sent to a server goes through its send queue.  Normally the
+ * queue is empty and a line is written as soon as it is queued, but if the
+ * server has rate limits (Twitch will disconnect or ban clients that send
+ * more than 20 lines in 30 seconds), lines wait their turn here.
+ *
+ * There are three kinds of token buckets, set with $serverctl():
+ *	SENDQ_RATE		Every line, except registration and PING/PONG
+ *	SENDQ_JOIN_RATE		Each channel that is JOINed
+ *	SENDQ_CHANNEL_RATE	Each PRIVMSG/NOTICE, separately per channel
+ * Lines are always written in the order they were sent, so a line waiting
+ * for a token holds up everything behind it.
+ */
+#define SENDQ_BATCH	16		/* Most lines per write */
+#define SENDQ_RETRY	0.1		/* Seconds to wait if newio can't tell us */
+
+static const char sendq_timeref[] = "SENDQ";
+static	int	sendq_timer_pending = 0;
+static	Timeval	sendq_timer_when;
+
+/*
+ * bucket_set - Allow "capacity" lines every "period" seconds.
+ *	A capacity of 0 turns off the bucket.  The bucket starts out full.
+ */
+static void	bucket_set (TokenBucket *b, int capacity, double period)
+{
+	if (capacity < 0)
+		capacity = 0;
+	if (period <= 0)
+		period = 1;
+
+	b->capacity = capacity;
+	b->period = period;
+	b->tokens = capacity;
+	get_time(&b->last);
+}
+
+/*
+ * bucket_wait - Refill a bucket and see how long until "cost" tokens
+ *	are available.  Returns 0 if they are available right now.
+ */
+static double	bucket_wait (TokenBucket *b, int cost, Timeval now)
+{
+	double	rate;
+
+	if (b->capacity <= 0 || cost <= 0)
+		return 0;
+	if (cost > b->capacity)
+		cost = b->capacity;
+
+	rate = b->capacity / b->period;
+	b->tokens += time_diff(b->last, now) * rate;
+	if (b->tokens > b->capacity)
+		b->tokens = b->capacity;
+	b->last = now;
+
+	if (b->tokens >= cost)
+		return 0;
+	return (cost - b->tokens) / rate;
+}
+
+static void	bucket_take (TokenBucket *b, int cost)
+{
+	if (b->capacity <= 0 || cost <= 0)
+		return;
+	if (cost > b->capacity)
+		cost = b->capacity;
+	b->tokens -= cost;
+}
+
+static TokenBucket *	find_channel_bucket (Server *s, const char *channel)
+{
+	ChannelBucket *cb;
+	int	cnt, loc;
+
+	if (s->chan_bucket.capacity <= 0)
+		return NULL;
+
+	cb = (ChannelBucket *)find_array_item(&s->chan_buckets, channel, 
+						&cnt, &loc);
+	if (cb && cnt < 0)
+		return &cb->bucket;
+
+	cb = (ChannelBucket *)new_malloc(sizeof(ChannelBucket));
+	cb->channel = malloc_strdup(channel);
+	bucket_set(&cb->bucket, s->chan_bucket.capacity, s->chan_bucket.period);
+	add_to_array(&s->chan_buckets, (array_item *)cb);
+	return &cb->bucket;
+}
+
+static void	destroy_channel_buckets (Server *s)
+{
+	ChannelBucket *cb;
+
+	while ((cb = (ChannelBucket *)array_pop(&s->chan_buckets, 0)))
+	{
+		new_free(&cb->channel);
+		new_free((char **)&cb);
+	}
+	new_free(&s->chan_buckets.list);
+	s->chan_buckets.max = 0;
+	s->chan_buckets.total_max = 0;
+}
+
+/*
+ * sendq_classify - Decide which buckets a queued line will be charged to.
+ */
+static void	sendq_classify (SendQueueItem *item)
+{
+	static const char *exempt[] = { "PASS", "NICK", "USER", "CAP", 
+			"AUTHENTICATE", "PING", "PONG", "QUIT", NULL };
+	char *	copy;
+	char *	cmd;
+	char *	target;
+	int	i;
+
+	item->exempt = 0;
+	item->joins = 0;
+	item->channel = NULL;
+
+	copy = LOCAL_COPY(item->line);
+	copy[strcspn(copy, "\r\n")] = 0;
+
+	if (*copy == '@')
+		next_arg(copy, &copy);
+	if (copy && *copy == ':')
+		next_arg(copy, &copy);
+	if (!(cmd = next_arg(copy, &copy)))
+		return;
+
+	for (i = 0; exempt[i]; i++)
+	{
+		if (!my_stricmp(cmd, exempt[i]))
+		{
+			item->exempt = 1;
+			return;
+		}
+	}
+
+	if (!my_stricmp(cmd, "JOIN"))
+	{
+		if ((target = next_arg(copy, &copy)))
+			for (item->joins = 1; *target; target++)
+				if (*target == ',')
+					item->joins++;
+	}
+	else if (!my_stricmp(cmd, "PRIVMSG") || !my_stricmp(cmd, "NOTICE"))
+	{
+		if ((target = next_arg(copy, &copy)) && is_channel(target) &&
+				!strchr(target, ','))
+			item->channel = malloc_strdup(target);
+	}
+}
+
+/*
+ * sendq_charge - Take the tokens a queued line needs.  If any of its
+ *	buckets are short, nothing is taken and we return how many
+ *	seconds until the line can go.
+ */
+static double	sendq_charge (Server *s, SendQueueItem *item, Timeval now)
+{
+	TokenBucket *cb = NULL;
+	double	wait;
+
+	if (item->exempt)
+		return 0;
+
+	wait = bucket_wait(&s->send_bucket, 1, now);
+	wait = MAX(wait, bucket_wait(&s->join_bucket, item->joins, now));
+	if (item->channel && (cb = find_channel_bucket(s, item->channel)))
+		wait = MAX(wait, bucket_wait(cb, 1, now));
+	if (wait > 0)
+		return wait;
+
+	bucket_take(&s->send_bucket, 1);
+	bucket_take(&s->join_bucket, item->joins);
+	if (cb)
+		bucket_take(cb, 1);
+	return 0;
+}
+
+static void	sendq_free_item (SendQueueItem *item)
+{
+	new_free(&item->line);
+	new_free(&item->channel);
+	new_free((char **)&item);
+}
+
+/*
+ * sendq_consume - Remove "written" bytes from the front of the queue.
+ *	A line that was only partly written stays at the front.
+ */
+static void	sendq_consume (Server *s, size_t written)
+{
+	SendQueueItem *item;
+	size_t	left;
+
+	left = s->sendq_offset + written;
+	while ((item = s->sendq_head) && left >= item->len)
+	{
+		left -= item->len;
+		s->sendq_head = item->next;
+		s->sendq_depth--;
+		s->sendq_bytes -= item->len;
+		sendq_free_item(item);
+	}
+	if (!s->sendq_head)
+	{
+		s->sendq_tail = NULL;
+		left = 0;
+	}
+	s->sendq_offset = left;
+}
+
+/*
+ * sendq_pend - Move a batch of lines out of the queue into one buffer for
+ *	ssl_write().  SSL_write() has no writev(), and when it says "try 
+ *	again" it has to be given the very same bytes, so the batch stays
+ *	in s->sendq_pending until all of it has been written.
+ */
+static void	sendq_pend (Server *s, struct iovec *iov, int count, size_t total)
+{
+	char *	p;
+	int	i;
+
+	s->sendq_pending = (char *)new_malloc(total);
+	for (p = s->sendq_pending, i = 0; i < count; i++)
+	{
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+	s->sendq_pending_len = total;
+	s->sendq_pending_offset = 0;
+	sendq_consume(s, total);
+}
+
+static void	sendq_unpend (Server *s)
+{
+	new_free(&s->sendq_pending);
+	s->sendq_pending_len = 0;
+	s->sendq_pending_offset = 0;
+}
+
+/*
+ * sendq_write - Write a batch of lines to a server in one go, without
+ *	waiting for room in the socket buffer.
+ */
+static ssize_t	sendq_write (Server *s, struct iovec *iov, int count)
+{
+#ifdef MSG_DONTWAIT
+	struct msghdr	msg;
+#endif
+
+	errno = 0;
+	if (s->sendq_pending)
+		return ssl_write(s->des, 
+			s->sendq_pending + s->sendq_pending_offset,
+			s->sendq_pending_len - s->sendq_pending_offset);
+
+#ifdef MSG_DONTWAIT
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+	return sendmsg(s->des, &msg, MSG_DONTWAIT);
+#else
+	return writev(s->des, iov, count);
+#endif
+}
+
+static int	sendq_timer (void *unused)
+{
+	Server *s;
+	int	i;
+
+	sendq_timer_pending = 0;
+	for (i = 0; i < number_of_servers; i++)
+		if ((s = get_server(i)) && (s->sendq_head || s->sendq_pending))
+			flush_server_sendq(i);
+	return 0;
+}
+
+/*
+ * sendq_schedule - Make sure the queues get looked at again in "wait"
+ *	seconds.  There is only one timer for all servers; it goes off
+ *	for whichever server needs it first.
+ */
+static void	sendq_schedule (double wait)
+{
+	Timeval	when;
+
+	when = time_add(get_time(NULL), double_to_timeval(wait));
+	if (sendq_timer_pending && time_diff(sendq_timer_when, when) >= 0)
+		return;
+
+	sendq_timer_when = when;
+	sendq_timer_pending = 1;
+	add_timer(1, sendq_timeref, wait, 1, sendq_timer, NULL, NULL, 
+			GENERAL_TIMER, -1, 0, 0);
+}
+
+/*
+ * sendq_writable - Called back by newio when a server we're waiting to
+ *	write to (see sendq_wait) can be written to again.
+ */
+static void	sendq_writable (int vfd)
+{
+	Server *s;
+	int	refnum;
+
+	refnum = SRV(vfd);
+	if ((s = get_server(refnum)) && s->des == vfd)
+		flush_server_sendq(refnum);
+}
+
+/*
+ * sendq_wait - The server's socket is full.  Try again when it can be
+ *	written to, or shortly, if newio can't tell us when that is.
+ */
+static void	sendq_wait (Server *s)
+{
+	if (new_wait_writable(s->des, sendq_writable) < 0)
+		sendq_schedule(SENDQ_RETRY);
+}
+
+/*
+ * flush_server_sendq - Write as much of a server's send queue as the
+ *	rate limits allow, up to SENDQ_BATCH lines at a time.  A short 
+ *	write (or EAGAIN) leaves the rest to be tried again when the
+ *	server can take more, rather than resetting the connection.
+ */
+void	flush_server_sendq (int refnum)
+{
+	Server *	s;
+	SendQueueItem *	item;
+	struct iovec	iov[SENDQ_BATCH];
+	Timeval		now;
+	double		wait = 0;
+	ssize_t		written;
+	size_t		total;
+	int		count;
+
+	if (!(s = get_server(refnum)))
+		return;
+	if (s->sendq_held)
+		return;
+
+	while (s->des != -1 && (s->sendq_head || s->sendq_pending))
+	{
+		get_time(&now);
+		total = 0;
+		count = 0;
+		if (!s->sendq_pending)
+		{
+		    for (item = s->sendq_head; item && count < SENDQ_BATCH; 
+				item = item->next)
+		    {
+			if (!item->charged && (wait = sendq_charge(s, item, now)) > 0)
+				break;
+			item->charged = 1;
+
+			iov[count].iov_base = item->line;
+			iov[count].iov_len = item->len;
+			if (count == 0)
+			{
+				iov[count].iov_base = item->line + s->sendq_offset;
+				iov[count].iov_len -= s->sendq_offset;
+			}
+			total += iov[count].iov_len;
+			count++;
+		    }
+
+		    if (count == 0)
+			break;
+
+		    if (s->throttled_since.tv_sec)
+		    {
+			s->throttled += time_diff(s->throttled_since, now);
+			s->throttled_since.tv_sec = 0;
+		    }
+
+		    if (get_server_ssl_enabled(refnum) == TRUE)
+			sendq_pend(s, iov, count, total);
+		}
+		if (s->sendq_pending)
+			total = s->sendq_pending_len - s->sendq_pending_offset;
+
+		if ((written = sendq_write(s, iov, count)) < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			{
+				sendq_wait(s);
+				return;
+			}
+
+			/* Throw the batch away; nobody will ever read it. */
+			if (s->sendq_pending)
+				sendq_unpend(s);
+			else while (count-- > 0)
+				sendq_consume(s, s->sendq_head->len - s->sendq_offset);
+
+			if (!get_int_var(NO_FAIL_DISCONNECT_VAR) &&
+					is_server_registered(refnum))
+			{
+				say("Write to server failed.  Resetting connection.");
+				set_server_status(refnum, SERVER_ERROR);
+				close_server(refnum, NULL);
+				return;
+			}
+			continue;
+		}
+
+		if (!s->sendq_pending)
+			sendq_consume(s, written);
+		else if ((s->sendq_pending_offset += written) == s->sendq_pending_len)
+			sendq_unpend(s);
+
+		if ((size_t)written < total)
+		{
+			sendq_wait(s);
+			return;
+		}
+		wait = 0;
+	}
+
+	if (wait > 0 && s->sendq_head)
+	{
+		if (!s->throttled_since.tv_sec)
+			s->throttled_since = now;
+		sendq_schedule(wait);
+	}
+}
+
+/*
+ * discard_sendq - Throw away a server's send queue.  If "keep_partial"
+ *	is set, a line that was partly written is kept, so the server 
+ *	doesn't get half a line, and so is an ssl batch that is waiting
+ *	to be retried.
+ */
+static void	discard_sendq (Server *s, int keep_partial)
+{
+	SendQueueItem *	item;
+	SendQueueItem *	keep = NULL;
+
+	if (keep_partial && s->sendq_offset > 0)
+	{
+		keep = s->sendq_head;
+		s->sendq_head = keep->next;
+		keep->next = NULL;
+	}
+
+	while ((item = s->sendq_head))
+	{
+		s->sendq_head = item->next;
+		sendq_free_item(item);
+	}
+
+	if (keep)
+	{
+		s->sendq_head = s->sendq_tail = keep;
+		s->sendq_depth = 1;
+		s->sendq_bytes = keep->len;
+	}
+	else
+	{
+		s->sendq_tail = NULL;
+		s->sendq_depth = 0;
+		s->sendq_bytes = 0;
+		s->sendq_offset = 0;
+	}
+
+	if (s->throttled_since.tv_sec)
+	{
+		s->throttled += time_diff(s->throttled_since, get_time(NULL));
+		s->throttled_since.tv_sec = 0;
+	}
+	if (!keep_partial)
+	{
+		sendq_unpend(s);
+		destroy_channel_buckets(s);
+	}
+}
+
+/*
+ * clear_server_sendq - Throw away whatever is waiting to be sent to a 
+ *	server, except for a partly written line if the server is open.
+ */
+void	clear_server_sendq (int refnum)
+{
+	Server *	s;
+
+	if ((s = get_server(refnum)))
+		discard_sendq(s, s->des != -1);
+}
+
+/*
+ * hold_server_sendq - Let lines pile up in the send queue without writing
+ *	them, so they can all go out together when release_server_sendq() 
+ *	is called.
+ */
+static void	hold_server_sendq (int refnum)
+{
+	Server *	s;
+
+	if ((s = get_server(refnum)))
+		s->sendq_held++;
+}
+
+static void	release_server_sendq (int refnum)
+{
+	Server *	s;
+
+	if (!(s = get_server(refnum)) || s->sendq_held <= 0)
+		return;
+	if (--s->sendq_held == 0)
+		flush_server_sendq(refnum);
+}
+
+static char *	bucket_to_str (TokenBucket *b)
+{
+	return malloc_sprintf(NULL, "%d %g", b->capacity, b->period);
+}
+
+/*
+ * get_server_sendq_throttled - How many seconds this server's queue has
+ *	spent waiting to be written, counting any wait going on now.
+ */
+static double	get_server_sendq_throttled (int refnum)
+{
+	Server *s;
+	double	retval;
+
+	if (!(s = get_server(refnum)))
+		return 0;
+
+	retval = s->throttled;
+	if (s->throttled_since.tv_sec)
+		retval += time_diff(s->throttled_since, get_time(NULL));
+	return retval;
+}
+
+
 /* SERVER OUTPUT STUFF */
 static void 	vsend_to_aserver_with_payload (int, const char *extra, const char *format, va_list args);
 void		send_to_aserver_raw (int, size_t len, const char *buffer);
@@ -1968,32 +2621,46 @@ static void 	vsend_to_aserver_with_payload (int refnum, const char *payload, con
 	from_server = ofs;
 }
 
+/*
+ * send_to_aserver_raw - Queue an already encoded line for a server
+ *
+ * Arguments:
+ *	refnum	- The server to send the line to
+ *	len	- How many bytes are in "buffer"
+ *	buffer	- The line to send, including its CR/LF.
+ *
+ * The line is written right away unless it has to wait for lines ahead
+ * of it, or for the server's rate limits (see flush_server_sendq).
+ */
 void	send_to_aserver_raw (int refnum, size_t len, const char *buffer)
 {
 	Server *s;
-	int des;
-	int err = 0;
+	SendQueueItem *item;
 
 	if (!(s = get_server(refnum)))
 		return;
 
-	if ((des = s->des) != -1 && buffer)
-	{
-	    if (get_server_ssl_enabled(refnum) == TRUE)
-		err = ssl_write(des, buffer, len);
-	    else
-		err = write(des, buffer, len);
+	if (s->des == -1 || !buffer || len == 0)
+		return;
 
-	    if (err == -1 && (!get_int_var(NO_FAIL_DISCONNECT_VAR)))
-	    {
-		if (is_server_registered(refnum))
-		{
-			say("Write to server failed.  Resetting connection.");
-			set_server_status(refnum, SERVER_ERROR);
-			close_server(refnum, NULL);
-		}
-	    }
-	}
+	item = (SendQueueItem *)new_malloc(sizeof(SendQueueItem));
+	item->line = new_malloc(len + 1);
+	memcpy(item->line, buffer, len);
+	item->line[len] = 0;
+	item->len = len;
+	item->charged = 0;
+	item->next = NULL;
+	sendq_classify(item);
+
+	if (s->sendq_tail)
+		s->sendq_tail->next = item;
+	else
+		s->sendq_head = item;
+	s->sendq_tail = item;
+	s->sendq_depth++;
+	s->sendq_bytes += len;
+
+	flush_server_sendq(refnum);
 }
 
 void	flush_server (int servnum)
@@ -2006,6 +2673,42 @@ void	flush_server (int servnum)
 
 
 /* CONNECTION/RECONNECTION STRATEGIES */
+/*
+ * get_server_addr_family - Which address family the server's "protocol"
+ *	asks for, in the form getaddrinfo() wants.
+ */
+static int	get_server_addr_family (int server)
+{
+	Server *s;
+
+	if (!(s = get_server(server)))
+		return AF_UNSPEC;
+
+	if (empty(s->info->proto_type))
+		return AF_UNSPEC;
+	else if (!my_stricmp(s->info->proto_type, "0")
+	      || !my_stricmp(s->info->proto_type, "any") 
+	      || !my_stricmp(s->info->proto_type, "ip") 
+	      || !my_stricmp(s->info->proto_type, "tcp") )
+		return AF_UNSPEC;
+	else if (!my_stricmp(s->info->proto_type, "4")
+	      || !my_stricmp(s->info->proto_type, "tcp4") 
+	      || !my_stricmp(s->info->proto_type, "ipv4") 
+	      || !my_stricmp(s->info->proto_type, "v4") 
+	      || !my_stricmp(s->info->proto_type, "ip4") )
+		return AF_INET;
+#ifdef INET6
+	else if (!my_stricmp(s->info->proto_type, "6")
+	      || !my_stricmp(s->info->proto_type, "tcp6") 
+	      || !my_stricmp(s->info->proto_type, "ipv6") 
+	      || !my_stricmp(s->info->proto_type, "v6") 
+	      || !my_stricmp(s->info->proto_type, "ip6") )
+		return AF_INET6;
+#endif
+	else
+		return AF_UNSPEC;
+}
+
 /*
  * Grab_server_address -- look up all of the addresses for a hostname and
  *	save them in the Server data for later use.  Someone must free
@@ -2048,29 +2751,7 @@ int	grab_server_address (int server)
 	new_open(xvfd[1], do_server, NEWIO_READ, 1, server);
 
 	memset(&hints, 0, sizeof(hints));
-	if (empty(s->info->proto_type))
-		hints.ai_family = AF_UNSPEC;
-	else if (!my_stricmp(s->info->proto_type, "0")
-	      || !my_stricmp(s->info->proto_type, "any") 
-	      || !my_stricmp(s->info->proto_type, "ip") 
-	      || !my_stricmp(s->info->proto_type, "tcp") )
-		hints.ai_family = AF_UNSPEC;
-	else if (!my_stricmp(s->info->proto_type, "4")
-	      || !my_stricmp(s->info->proto_type, "tcp4") 
-	      || !my_stricmp(s->info->proto_type, "ipv4") 
-	      || !my_stricmp(s->info->proto_type, "v4") 
-	      || !my_stricmp(s->info->proto_type, "ip4") )
-		hints.ai_family = AF_INET;
-#ifdef INET6
-	else if (!my_stricmp(s->info->proto_type, "6")
-	      || !my_stricmp(s->info->proto_type, "tcp6") 
-	      || !my_stricmp(s->info->proto_type, "ipv6") 
-	      || !my_stricmp(s->info->proto_type, "v6") 
-	      || !my_stricmp(s->info->proto_type, "ip6") )
-		hints.ai_family = AF_INET6;
-#endif
-	else
-		hints.ai_family = AF_UNSPEC;
+	hints.ai_family = get_server_addr_family(server);
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_ADDRCONFIG;
 	async_getaddrinfo(s->info->host, ltoa(s->info->port), &hints, xvfd[0]);
@@ -2166,6 +2847,8 @@ static int	connect_next_server_address (int server)
 
 	say("I'm out of addresses for server %d so I have to stop.", 
 			server);
+	dns_cache_forget(s->info->host, ltoa(s->info->port), 
+				get_server_addr_family(server));
 	/* Freeaddrinfo(s->addrs); */
 	/* s->addrs = NULL; */
 	new_free(&s->addrs);
@@ -2215,6 +2898,7 @@ int 	connect_to_server (int new_server)
 
 	set_server_status(new_server, SERVER_CONNECTING);
 	s->closing = 0;
+	clear_server_sendq(new_server);
 	oper_command = 0;
 	errno = 0;
 	memset(&s->local_sockname, 0, sizeof(s->local_sockname));
@@ -2353,12 +3037,17 @@ void	close_server (int refnum, const char *message)
 	     * D-line case.
 	     */
 	    if (was_registered)
+	    {
+		    /* Don't make the QUIT wait behind throttled lines */
+		    clear_server_sendq(refnum);
 		    send_to_aserver(refnum, "QUIT :%s\n", final_message);
+	    }
 	}
 
 	do_hook(SERVER_LOST_LIST, "%d %s %s", 
 			refnum, s->info->host, final_message);
 	s->des = new_close(s->des);
+	clear_server_sendq(refnum);
 	set_server_status(refnum, SERVER_CLOSED);
 }
 
@@ -2588,6 +3277,7 @@ void	register_server (int refnum, const char *nick)
 	Server *	s;
 	int		ofs = from_server;
 	const char *	usehost;
+	const char *	caps;
 
 	if (!(s = get_server(refnum)))
 		return;
@@ -2616,6 +3306,23 @@ void	register_server (int refnum, const char *nick)
 		get_server_name(refnum), get_server_port(refnum));
 	from_server = ofs;
 
+	/*
+	 * Everything we need to say to register goes out in one write.
+	 * We don't wait for the server to ACK our CAP REQ before we send
+	 * CAP END -- the server handles them in order, so the ACK will
+	 * have been sent by the time it sees the CAP END.  This saves a
+	 * round trip on every connect.
+	 */
+	hold_server_sendq(refnum);
+	new_free(&s->caps_available);
+	new_free(&s->caps);
+	s->caps_listing = 0;
+	if (!empty(caps = get_string_var(CAPABILITIES_VAR)))
+	{
+		send_to_aserver(refnum, "CAP LS 302");
+		send_to_aserver(refnum, "CAP REQ :%s", caps);
+	}
+
 	if (!empty(s->info->password))
 	{
 		char *dequoted = NULL;
@@ -2652,10 +3359,182 @@ void	register_server (int refnum, const char *nick)
 			get_string_var(DEFAULT_USERNAME_VAR),
 			s->realname);
 	change_server_nickname(refnum, nick);
+	if (!empty(caps))
+		send_to_aserver(refnum, "CAP END");
+	release_server_sendq(refnum);
+
 	if (x_debug & DEBUG_SERVER_CONNECT)
 		yell("Registered with server [%d]", refnum);
 }
 
+/* CAPABILITIES */
+/*
+ * find_cap - Find the capability "cap" in the space separated list "list".
+ *	A capability in the list may have a value ("sasl=PLAIN"), which 
+ *	is ignored.  Returns where "cap" starts in "list", or NULL.
+ */
+static const char *	find_cap (const char *list, const char *cap, size_t len)
+{
+	const char *p;
+
+	for (p = list; p && *p; )
+	{
+		while (*p == ' ')
+			p++;
+		if (!strncmp(p, cap, len) && 
+				(!p[len] || p[len] == ' ' || p[len] == '='))
+			return p;
+		p += strcspn(p, " ");
+	}
+	return NULL;
+}
+
+/*
+ * remove_caps - Remove each of the capabilities in "caps" from "*list".
+ */
+static void	remove_caps (char **list, const char *caps)
+{
+	char *	old, *word;
+	char *	retval = NULL;
+
+	if (!*list)
+		return;
+
+	old = LOCAL_COPY(*list);
+	while ((word = next_arg(old, &old)))
+		if (!find_cap(caps, word, strcspn(word, "=")))
+			malloc_strcat_word(&retval, space, word, DWORD_NO);
+	new_free(list);
+	*list = retval;
+}
+
+/*
+ * server_caps_listed - Handle a CAP LS from the server.
+ *	"more" is set if the server said more CAP LS lines are coming.
+ */
+void	server_caps_listed (int refnum, const char *caps, int more)
+{
+	Server *s;
+
+	if (!(s = get_server(refnum)))
+		return;
+
+	if (!s->caps_listing)
+		new_free(&s->caps_available);
+	malloc_strcat_wordlist(&s->caps_available, space, caps);
+	s->caps_listing = more;
+}
+
+/*
+ * server_caps_new - Handle a CAP NEW from the server.
+ */
+void	server_caps_new (int refnum, const char *caps)
+{
+	Server *s;
+
+	if (!(s = get_server(refnum)))
+		return;
+
+	remove_caps(&s->caps_available, caps);
+	malloc_strcat_wordlist(&s->caps_available, space, caps);
+}
+
+/*
+ * server_caps_acked - Handle a CAP ACK from the server.  A capability
+ *	with a - in front of it has been turned off.
+ */
+void	server_caps_acked (int refnum, const char *caps)
+{
+	Server *s;
+	char *	copy, *cap;
+
+	if (!(s = get_server(refnum)))
+		return;
+
+	copy = LOCAL_COPY(caps);
+	while ((cap = next_arg(copy, &copy)))
+	{
+		if (*cap == '-')
+			remove_caps(&s->caps, cap + 1);
+		else if (!find_cap(s->caps, cap, strlen(cap)))
+			malloc_strcat_word(&s->caps, space, cap, DWORD_NO);
+	}
+}
+
+/*
+ * server_caps_deleted - Handle a CAP DEL from the server.
+ */
+void	server_caps_deleted (int refnum, const char *caps)
+{
+	Server *s;
+
+	if (!(s = get_server(refnum)))
+		return;
+
+	remove_caps(&s->caps, caps);
+	remove_caps(&s->caps_available, caps);
+}
+
+/*
+ * server_caps_nakked - Handle a CAP NAK from the server.
+ *	If any capability in a CAP REQ can't be had, the server turns down
+ *	the whole thing.  Since register_server() doesn't wait for CAP LS
+ *	before it asks, this is how we find out that a server doesn't do 
+ *	some of /SET CAPABILITIES.  So we tell the user which ones the server
+ *	didn't offer, and ask again for the rest.  Every retry asks for 
+ *	fewer capabilities than the last one, so this can't go on forever.
+ */
+void	server_caps_nakked (int refnum, const char *caps)
+{
+	Server *s;
+	char *	copy, *cap;
+	char *	offered = NULL;
+	char *	refused = NULL;
+
+	if (!(s = get_server(refnum)))
+		return;
+
+	copy = LOCAL_COPY(caps);
+	while ((cap = next_arg(copy, &copy)))
+	{
+		if (*cap == '-')
+			continue;
+		if (find_cap(s->caps_available, cap, strlen(cap)))
+			malloc_strcat_word(&offered, space, cap, DWORD_NO);
+		else
+			malloc_strcat_word(&refused, space, cap, DWORD_NO);
+	}
+
+	if (x_debug & DEBUG_SERVER_CONNECT)
+		yell("Server [%d] would not enable [%s]", refnum, caps);
+
+	if (refused)
+		say("Server %s does not support capabilities: %s",
+			get_server_itsname(refnum), refused);
+	else if (offered)
+		say("Server %s would not enable capabilities: %s",
+			get_server_itsname(refnum), offered);
+
+	if (refused && offered)
+		send_to_aserver(refnum, "CAP REQ :%s", offered);
+
+	new_free(&offered);
+	new_free(&refused);
+}
+
+/*
+ * server_has_cap - Has the server ACKed the capability "cap"?
+ */
+int	server_has_cap (int refnum, const char *cap)
+{
+	Server *s;
+
+	if (!(s = get_server(refnum)))
+		return 0;
+
+	return find_cap(s->caps, cap, strlen(cap)) ? 1 : 0;
+}
+
 static const char *	get_server_password (int refnum)
 {
 	Server *s;
@@ -4291,6 +5170,19 @@ sorry_wrong_number:
  *			(This is the only way to delete a designation)
  *	DEFAULT_REALNAME Default realname, used at next connect.
  *	REALNAME	Realname. Read-only.
+ *	SENDQ		How many lines are waiting to be sent. Read-only.
+ *	SENDQ_BYTES	How many bytes are waiting to be sent. Read-only.
+ *	SENDQ_THROTTLED	Seconds lines have spent waiting. Read-only.
+ *	SENDQ_RATE	"<lines> <seconds>" allowed for all lines
+ *	SENDQ_JOIN_RATE	"<channels> <seconds>" allowed to be JOINed
+ *	SENDQ_CHANNEL_RATE "<lines> <seconds>" allowed to each channel
+ *			(A rate of 0 lines means unlimited, the default)
+ *	SSL_RESUMED	Whether this SSL connection resumed a saved session
+ *	SSL_RESUME_HITS	How many SSL connects resumed a session. Read-only.
+ *	SSL_RESUME_MISSES How many SSL connects did a full handshake.
+ *			Read-only.
+ *	CAPS		The capabilities the server ACKed. Read-only.
+ *	CAPS_AVAILABLE	The capabilities the server offered. Read-only.
  */
 char 	*serverctl 	(char *input)
 {
@@ -4355,6 +5247,10 @@ char 	*serverctl 	(char *input)
 		} else if (!my_strnicmp(listc, "COOKIE", len)) {
 			ret = get_server_cookie(refnum);
 			RETURN_STR(ret);
+		} else if (!my_strnicmp(listc, "CAPS", len)) {
+			RETURN_STR(get_server(refnum)->caps);
+		} else if (!my_strnicmp(listc, "CAPS_AVAILABLE", len)) {
+			RETURN_STR(get_server(refnum)->caps_available);
 		} else if (!my_strnicmp(listc, "GROUP", len)) {
 			ret = get_server_group(refnum);
 			RETURN_STR(ret);
@@ -4440,11 +5336,38 @@ char 	*serverctl 	(char *input)
 			RETURN_STR(get_server_realname(refnum));
 		} else if (!my_strnicmp(listc, "DEFAULT_REALNAME", len)) {
 			RETURN_STR(get_server_default_realname(refnum));
+		} else if (!my_strnicmp(listc, "SENDQ", 5)) {
+			Server *s = get_server(refnum);
+
+			if (!my_strnicmp(listc, "SENDQ", len)) {
+				RETURN_INT(s->sendq_depth);
+			} else if (!my_strnicmp(listc, "SENDQ_BYTES", len)) {
+				RETURN_INT(s->sendq_bytes + s->sendq_pending_len -
+						s->sendq_pending_offset);
+			} else if (!my_strnicmp(listc, "SENDQ_THROTTLED", len)) {
+				RETURN_FLOAT2(get_server_sendq_throttled(refnum));
+			} else if (!my_strnicmp(listc, "SENDQ_RATE", len)) {
+				RETURN_MSTR(bucket_to_str(&s->send_bucket));
+			} else if (!my_strnicmp(listc, "SENDQ_JOIN_RATE", len)) {
+				RETURN_MSTR(bucket_to_str(&s->join_bucket));
+			} else if (!my_strnicmp(listc, "SENDQ_CHANNEL_RATE", len)) {
+				RETURN_MSTR(bucket_to_str(&s->chan_bucket));
+			}
 		} else if (!my_strnicmp(listc, "SSL_", 4)) {
 			Server *s;
 			int	des;
 
-			if (!(s = get_server(refnum)) || s->ssl_enabled == FALSE)
+			if (!(s = get_server(refnum)))
+				RETURN_EMPTY;
+
+			/* These are kept across connections */
+			if (!my_strnicmp(listc, "SSL_RESUME_HITS", len)) {
+				RETURN_INT(s->ssl_resume_hits);
+			} else if (!my_strnicmp(listc, "SSL_RESUME_MISSES", len)) {
+				RETURN_INT(s->ssl_resume_misses);
+			}
+
+			if (s->ssl_enabled == FALSE)
 				RETURN_EMPTY;
 
 			if (!my_strnicmp(listc, "SSL_CIPHER", len)) {
@@ -4467,6 +5390,8 @@ char 	*serverctl 	(char *input)
 				RETURN_STR(get_ssl_u_cert_issuer(s->des));
 			} else if (!my_strnicmp(listc, "SSL_VERSION", len)) {
 				RETURN_STR(get_ssl_ssl_version(s->des));
+			} else if (!my_strnicmp(listc, "SSL_RESUMED", len)) {
+				RETURN_INT(get_ssl_resumed(s->des));
 			}
 		}
 	} else if (!my_strnicmp(listc, "SET", len)) {
@@ -4569,6 +5494,30 @@ char 	*serverctl 	(char *input)
 		else if (!my_strnicmp(listc, "DEFAULT_REALNAME", len)) {
 			set_server_default_realname(refnum, input);
 		}
+		else if (!my_strnicmp(listc, "SENDQ_", 6)) {
+			Server *s = get_server(refnum);
+			TokenBucket *b;
+			int	capacity;
+			double	period = 1;
+
+			if (!my_strnicmp(listc, "SENDQ_RATE", len))
+				b = &s->send_bucket;
+			else if (!my_strnicmp(listc, "SENDQ_JOIN_RATE", len))
+				b = &s->join_bucket;
+			else if (!my_strnicmp(listc, "SENDQ_CHANNEL_RATE", len))
+				b = &s->chan_bucket;
+			else
+				RETURN_EMPTY;
+
+			GET_INT_ARG(capacity, input);
+			if (!empty(input))
+				GET_FLOAT_ARG(period, input);
+			bucket_set(b, capacity, period);
+			if (b == &s->chan_bucket)
+				destroy_channel_buckets(s);
+			flush_server_sendq(refnum);
+			RETURN_INT(1);
+		}
 	} else if (!my_strnicmp(listc, "OMATCH", len)) {
 		int	i;
 
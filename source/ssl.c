@@ -56,6 +56,7 @@
 
 static	int	firsttime = 1;
 static void	ssl_setup_locking (void);
+static int	ssl_new_session (SSL *, SSL_SESSION *);
 
 static	char *	x509_default_cert_location_file = NULL;
 static	char *	x509_default_cert_location_dir = NULL;
@@ -247,8 +248,28 @@ static SSL_CTX	*SSL_CTX_init (int server)
 	ctx = SSL_CTX_new(server ? 
 			SSLv23_server_method() : 
 			SSLv23_client_method());
-	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_BOTH);
+	if (server)
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	else
+	{
+		/*
+		 * Every connection gets its own CTX, so OpenSSL's cache
+		 * would be thrown away with it.  Client sessions go into
+		 * our session cache (below) instead.
+		 */
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+					SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx, ssl_new_session);
+	}
 	SSL_CTX_set_timeout(ctx, 300);
+
+	/*
+	 * ssl_write() may write less than it was given, and after it says
+	 * "try again", the retry may come from a different buffer (the
+	 * same bytes, though).
+	 */
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+				SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 /*
 	SSL_CTX_load_verify_locations(ctx, "/usr/local/share/certs/ca-root-nss.crt", NULL);
 */
@@ -273,6 +294,7 @@ typedef struct ssl_metadata {
 	char *	issuer;
 	char *	u_cert_issuer;
 	char *	ssl_version;
+	int	resumed;
 } ssl_metadata;
 
 typedef struct	ssl_info_T {
@@ -283,12 +305,176 @@ typedef struct	ssl_info_T {
 
 	SSL_CTX	*ctx;		/* All our SSLs have their own ConTeXt */
 	SSL *	ssl_fd;		/* Each of our SSLs have their own (SSL *) */
+	char *	session_key;	/* "host:port:sni" in the session cache */
 	ssl_metadata	md;	/* Plain text info about SSL connection */
 } ssl_info;
 
 ssl_info *ssl_list = NULL;
 
 
+/* * * * * * */
+/*
+ * The session cache -- Remember the TLS sessions (and TLS 1.3 tickets)
+ * that servers give us, so when we reconnect to the same place we can
+ * resume the session instead of doing a full handshake.  When a server
+ * drops a lot of connections at once (twitch RECONNECT), this saves a 
+ * couple of round trips and the public key crypto for each one.
+ *
+ * Sessions are keyed by "host:port:sni", and they are only ever offered
+ * to the same host, port, and server name they came from.  OpenSSL tells
+ * us when the session has expired.  A session that fails to resume is 
+ * thrown away so the next try does a full handshake.
+ */
+#define SSL_SESSION_CACHE_SIZE	32
+
+typedef struct	ssl_session_T {
+	struct ssl_session_T *next;
+	char *		key;
+	SSL_SESSION *	session;
+} ssl_session;
+
+static	ssl_session *	ssl_session_list = NULL;
+static	int		ssl_session_count = 0;
+
+static ssl_session *	find_ssl_session (const char *key, ssl_session **prev)
+{
+	ssl_session *c, *p = NULL;
+
+	for (c = ssl_session_list; c; p = c, c = c->next)
+	{
+		if (!strcmp(c->key, key))
+		{
+			if (prev)
+				*prev = p;
+			return c;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * use_ssl_session -- Find the session for 'key' and move it to the front,
+ *		      so the one at the end is always the least recently used.
+ */
+static ssl_session *	use_ssl_session (const char *key)
+{
+	ssl_session *c, *p = NULL;
+
+	if (!(c = find_ssl_session(key, &p)))
+		return NULL;
+
+	if (p)
+	{
+		p->next = c->next;
+		c->next = ssl_session_list;
+		ssl_session_list = c;
+	}
+	return c;
+}
+
+static void	forget_ssl_session (const char *key)
+{
+	ssl_session *c, *p = NULL;
+
+	if (!key || !(c = find_ssl_session(key, &p)))
+		return;
+
+	if (p)
+		p->next = c->next;
+	else
+		ssl_session_list = c->next;
+	ssl_session_count--;
+
+	SSL_SESSION_free(c->session);
+	new_free(&c->key);
+	new_free(&c);
+}
+
+/*
+ * ssl_new_session -- OpenSSL calls this whenever a server gives us a
+ *		      session we might be able to resume later.
+ * RETURN VALUE:
+ *	1	We kept a reference to 'session'
+ *	0	We did not keep 'session'
+ */
+static int	ssl_new_session (SSL *ssl, SSL_SESSION *session)
+{
+	ssl_info *	x;
+	ssl_session *	c, *p;
+
+	if (!(x = (ssl_info *)SSL_get_app_data(ssl)) || !x->session_key)
+		return 0;
+
+	if ((c = use_ssl_session(x->session_key)))
+	{
+		SSL_SESSION_free(c->session);
+		c->session = session;
+		return 1;
+	}
+
+	/* Make room by throwing away the least recently used (at the end) */
+	if (ssl_session_count >= SSL_SESSION_CACHE_SIZE)
+	{
+		for (p = ssl_session_list; p->next; p = p->next)
+			;
+		forget_ssl_session(p->key);
+	}
+
+	c = new_malloc(sizeof(*c));
+	c->key = malloc_strdup(x->session_key);
+	c->session = session;
+	c->next = ssl_session_list;
+	ssl_session_list = c;
+	ssl_session_count++;
+
+	if (x_debug & DEBUG_SSL)
+		yell("SSL >>> Saved session for %s", x->session_key);
+	return 1;
+}
+
+/*
+ * offer_ssl_session -- If we have a session for the place 'x' is connecting
+ *			to, ask the server to resume it.
+ */
+static void	offer_ssl_session (ssl_info *x)
+{
+	ssl_session *	c;
+	long		expires;
+
+	if (!(c = use_ssl_session(x->session_key)))
+		return;
+
+	expires = SSL_SESSION_get_time(c->session) + 
+		  SSL_SESSION_get_timeout(c->session);
+	if (expires <= (long)time(NULL))
+	{
+		forget_ssl_session(x->session_key);
+		return;
+	}
+
+	if (x_debug & DEBUG_SSL)
+		yell("SSL >>> Offering saved session for %s", x->session_key);
+	SSL_set_session(x->ssl_fd, c->session);
+}
+
+/*
+ * Only hostnames go in the SNI extension; IP addresses are not allowed.
+ */
+static int	is_sni_hostname (const char *host)
+{
+	struct in_addr	a4;
+	struct in6_addr	a6;
+
+	if (!host || !*host)
+		return 0;
+	if (inet_pton(AF_INET, host, &a4) == 1)
+		return 0;
+	if (inet_pton(AF_INET6, host, &a6) == 1)
+		return 0;
+	return 1;
+}
+
+
 /*
  * find_ssl -- Get the data for an ssl-enabled connection.
  *
@@ -338,6 +524,7 @@ static ssl_info *	new_ssl_info (int vfd)
 	x->channel = -1;
 	x->ctx = NULL;
 	x->ssl_fd = NULL;
+	x->session_key = NULL;
 
 	x->md.vfd = vfd;
 	x->md.verify_result = 0;
@@ -349,6 +536,7 @@ static ssl_info *	new_ssl_info (int vfd)
 	x->md.issuer = NULL;
 	x->md.u_cert_issuer = NULL;
 	x->md.ssl_version = NULL;
+	x->md.resumed = 0;
 
 	return x;
 }
@@ -396,12 +584,14 @@ static ssl_info *	unlink_ssl_info (int vfd)
  * ARGS:
  *	vfd -- A virtual file descriptor, previously returned by new_open().
  *	channel -- The channel that is mapped to the vfd (passed to new_open())
+ *	host -- The hostname we are connecting to (for SNI and resumption)
+ *	port -- The port we are connecting to (for resumption)
  * RETURN VALUE:
  *	-1	Something really died
  *	 0	SSL negotiation is pending
  *	 1	SSL negotiation is complete
  */
-int	ssl_startup (int vfd, int channel)
+int	ssl_startup (int vfd, int channel, const char *host, int port)
 {
 	ssl_info *	x;
 	SSL *		ssl;
@@ -429,6 +619,17 @@ int	ssl_startup (int vfd, int channel)
 		return -1;
 	}
 
+	SSL_set_app_data(x->ssl_fd, x);
+	if (host)
+	{
+		const char *	sni = is_sni_hostname(host) ? host : empty_string;
+
+		if (*sni)
+			SSL_set_tlsext_host_name(x->ssl_fd, sni);
+		malloc_sprintf(&x->session_key, "%s:%d:%s", host, port, sni);
+		offer_ssl_session(x);
+	}
+
 	SSL_set_fd(x->ssl_fd, channel);
 	set_non_blocking(channel);
 	ssl_connect(vfd, 0);
@@ -468,6 +669,7 @@ int	ssl_shutdown (int vfd)
 		x->ssl_fd = NULL;
 	}
 
+	new_free(&x->session_key);
 	x->md.vfd = -1;
 	x->md.verify_result = 0;
 	new_free(&x->md.pem);
@@ -492,7 +694,11 @@ int	ssl_shutdown (int vfd)
  *	len -- The number of bytes in 'data' to send.
  * RETURN VALUE:
  *	-1 / EINVAL -- The vfd is not set up for ssl.
- *	Anything else -- The return value of SSL_write().
+ *	-1 / EAGAIN -- Nothing was written; call again later with the
+ *		       same bytes (SSL_write() insists on that), usually
+ *		       when the socket is writable.
+ *	-1 / Anything else -- The connection is broken.
+ *	Anything else -- The number of bytes written, which may be short.
  */
 int	ssl_write (int vfd, const void *data, size_t len)
 {
@@ -512,19 +718,40 @@ int	ssl_write (int vfd, const void *data, size_t len)
 		return -1;
 	}
 
-	err = SSL_write(x->ssl_fd, data, len);
-	BIO_flush(SSL_get_wbio(x->ssl_fd));
-	return err;
+	errno = 0;
+	if ((err = SSL_write(x->ssl_fd, data, len)) > 0)
+	{
+		BIO_flush(SSL_get_wbio(x->ssl_fd));
+		return err;
+	}
+
+	/* A 0 return is not a short write -- the connection is gone. */
+	switch (SSL_get_error(x->ssl_fd, err))
+	{
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			break;
+		case SSL_ERROR_SYSCALL:
+			if (errno == 0 || errno == EAGAIN || 
+					errno == EWOULDBLOCK || errno == EINTR)
+				errno = EPIPE;
+			break;
+		default:
+			errno = EPIPE;
+			break;
+	}
+	return -1;
 }
 
 /*
  * read_ssl -- Post whatever data is available on 'vfd' to the newio system.
- *		This operation may block if the SSL operations block.
  * ARGS:
  *	vfd -- A virtual file descriptor, previously passed to startup_ssl().
  *	quiet -- Should errors silently ignored (1) or displayed? (0)
  * RETURN VALUE:
  *	-1 / EINVAL -- The vfd is not set up for ssl.
+ *	1 -- SSL_read() wants more from the server before it has anything.
  *	Anything else -- The final return value of SSL_read().
  */
 int	ssl_read (int vfd, int quiet)
@@ -556,6 +783,19 @@ int	ssl_read (int vfd, int quiet)
 		if (c < 0)
 		{
 		    int ssl_error = SSL_get_error(x->ssl_fd, c);
+
+		    /*
+		     * The socket is nonblocking, so we may have only gotten
+		     * part of a record, or a record that isn't data (like a 
+		     * TLS 1.3 session ticket).  That's not an error; there
+		     * is just nothing for the user yet.  If OpenSSL wants to
+		     * write something first, it will get to do that the next
+		     * time we read or write.
+		     */
+		    if (ssl_error == SSL_ERROR_WANT_READ ||
+				ssl_error == SSL_ERROR_WANT_WRITE)
+			return 1;
+
 		    if (ssl_error == SSL_ERROR_NONE)
 			if (!quiet)
 			   syserr(SRV(vfd), "SSL_read failed with [%d]/[%d]", 
@@ -596,6 +836,9 @@ int	ssl_connect (int vfd, int quiet)
 			return 1;
 		else
 		{
+			/* Don't offer this session again */
+			forget_ssl_session(x->session_key);
+
 			/* Post the error */
 			syserr(SRV(vfd), "ssl_connect: posting error %d", 
 						ssl_err);
@@ -693,6 +936,7 @@ static char *get_x509_name(X509_NAME *nm)
  *	   f. x->md.issuer	(who issued the certificate; ie, the CA)
  *	   g. x->md.u_cert_issuer  (urlified version of #6)
  *	   h. x->md.ssl_version	(what SSL we're using, ie, "TLSv1")
+ *	   i. x->md.resumed	(whether we resumed a saved session)
  *	5. Hook /on ssl_server_cert with the above information
  *	6. Cleans up
  */
@@ -717,10 +961,11 @@ int	ssl_connected (int vfd)
 	/*
 	 * STEP 1: 
 	 * We had set nonblocking when we started the SSL negotiation
-	 * becuase that plays nicer with OpenSSL.  But we want our connections
-	 * to be blocking when we start reading from them.
+	 * becuase that plays nicer with OpenSSL.  We leave it that way, so
+	 * that a server that is slow to read doesn't make ssl_write() wait
+	 * (the send queue waits for it instead).  ssl_read() knows that 
+	 * a readable socket may not have a whole record yet.
 	 */
-	set_blocking(x->channel);
 
 	/*
 	 * STEP 2: 
@@ -731,6 +976,7 @@ int	ssl_connected (int vfd)
 	if (!(server_cert = SSL_get_peer_certificate(x->ssl_fd)))
 	{
 		syserr(SRV(vfd), "SSL negotiation failed - reporting as error");
+		forget_ssl_session(x->session_key);
 		SSL_CTX_free(x->ctx);
 		x->ctx = NULL;
 		x->ssl_fd = NULL;
@@ -814,6 +1060,11 @@ int	ssl_connected (int vfd)
 	 */
 	x->md.ssl_version = malloc_strdup(SSL_get_version(x->ssl_fd));	
 
+	/*
+	 * STEP 4i:	Did we resume a saved session?
+	 */
+	x->md.resumed = SSL_session_reused(x->ssl_fd) ? 1 : 0;
+
 
 	/* ==== */
 	/*
@@ -949,6 +1200,12 @@ const char *	get_ssl_ssl_version (int vfd)
 	return x->md.ssl_version;
 }
 
+int	get_ssl_resumed (int vfd)
+{
+	LOOKUP_SSL(vfd, 0)
+	return x->md.resumed;
+}
+
 
 # ifdef USE_PTHREAD
 #include <pthread.h>
@@ -987,7 +1244,7 @@ static void	ssl_setup_locking (void)
 # endif
 #else
 
-int	ssl_startup (int vfd, int channel)
+int	ssl_startup (int vfd, int channel, const char *host, int port)
 {
 	return -1;
 }
@@ -1036,6 +1293,7 @@ const char *	get_ssl_u_cert_subject (int vfd) { return empty_string; }
 const char *	get_ssl_issuer (int vfd) { return empty_string; }
 const char *	get_ssl_u_cert_issuer (int vfd) { return empty_string; }
 const char *	get_ssl_ssl_version (int vfd) { return empty_string; }
+int		get_ssl_resumed (int vfd) { return 0; }
 
 
 #endif
@@ -272,9 +272,11 @@ void 	init_variables_stage1 (void)
 
 	VAR(ALLOW_C1_CHARS, 		BOOL, NULL)
 	VAR(ALWAYS_SPLIT_BIGGEST, 	BOOL, NULL)
+	VAR(APPROXIMATE_CHANNEL_SIZE, 	INT,  NULL)
 	VAR(BANNER, 			STR,  NULL)
 	VAR(BANNER_EXPAND, 		BOOL, NULL)
 	VAR(BEEP, 			BOOL, NULL)
+	VAR(CAPABILITIES, 		STR,  NULL);
 	VAR(CHANNEL_NAME_WIDTH, 	INT,  update_all_status_wrapper)
 #define DEFAULT_CLIENT_INFORMATION IRCII_COMMENT
 	VAR(CLIENT_INFORMATION, 	STR,  NULL)
@@ -365,6 +367,7 @@ void 	init_variables_stage1 (void)
 	VAR(SCROLLBACK, INT,  set_scrollback_size);
 	VAR(SCROLLBACK_RATIO, INT,  NULL);
 	VAR(SCROLL_LINES, INT,  set_scroll_lines);
+	VAR(SERVER_BATCH_SIZE, INT,  NULL);
 	VAR(SHELL, STR,  NULL);
 	VAR(SHELL_FLAGS, STR,  NULL);
 	VAR(SHELL_LIMIT, INT,  NULL);
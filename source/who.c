@@ -850,7 +850,11 @@ do
 			ok = ok && wild_match(new_w->who_server, server);
 	}
 
-	if (ok)
+	if (ok && !new_w->who_stuff && !hook_is_listened(WHO_LIST) &&
+			!hook_is_listened(current_numeric))
+		put_it(format, channel, nick, status, user, host, name);
+
+	else if (ok)
 	{
 		char buffer[1024];
 
@@ -1642,6 +1642,52 @@ void 	update_all_status (void)
 		window_statusbar_needs_update(window);
 }
 
+/*
+ * While the server code is working through a batch of lines, there's no
+ * point in redrawing the status bars and the input line (and flushing the
+ * terminal) after every one of them.  Between defer_window_updates() and
+ * resume_window_updates(), update_all_windows() only does the things that
+ * output can't happen without, and cursor_to_input() does nothing.  The
+ * rest is done once, when the last deferral is resumed.
+ */
+static	int	deferred_updates = 0;
+
+void	defer_window_updates (void)
+{
+	deferred_updates++;
+}
+
+void	resume_window_updates (void)
+{
+	if (deferred_updates > 0 && --deferred_updates == 0)
+	{
+		update_all_windows();
+		cursor_to_input();
+	}
+}
+
+int	window_updates_deferred (void)
+{
+	return deferred_updates;
+}
+
+/*
+ * If something in a batch waits for the user (ie, /PAUSE or an input 
+ * prompt), io() needs the screen to be drawn properly in the meantime.
+ */
+int	suspend_window_updates_deferral (void)
+{
+	int	old = deferred_updates;
+
+	deferred_updates = 0;
+	return old;
+}
+
+void	restore_window_updates_deferral (int old)
+{
+	deferred_updates = old;
+}
+
 /*
  * update_all_windows: This goes through each visible window and draws the
  * necessary portions according the the update field of the window. 
@@ -1706,6 +1752,10 @@ static	int	restart = 0;
 			repaint_window_body(tmp);
 		}
 
+		/* Status bars can wait until the batch is done */
+		if (deferred_updates)
+			continue;
+
 		if (tmp->update & REDRAW_STATUS)
 		{
 			debuglog("update_all_windows(%d), redraw status",